@@ -16,6 +16,8 @@ assert MessagingError
 NO_TRAVERSAL_LIMIT = 2**64-1
 AVG_FREQ_HISTORY = 100
 SIMULATION = "SIMULATION" in os.environ
+# replay --virtual-time: the clock is the logMonoTime of the log being replayed
+VIRTUAL_TIME = os.getenv("VIRTUAL_TIME") == "1"
 
 # sec_since_boot is faster, but allow to run standalone too
 try:
@@ -138,6 +140,7 @@ class SubMaster:
                ignore_alive: Optional[List[str]] = None, ignore_avg_freq: Optional[List[str]] = None,
                addr: str = "127.0.0.1"):
     self.frame = -1
+    self.virtual_time = 0.
     self.updated = {s: False for s in services}
     self.rcv_time = {s: 0. for s in services}
     self.rcv_frame = {s: 0 for s in services}
@@ -182,7 +185,13 @@ class SubMaster:
     # non-blocking receive for non-polled sockets
     for s in self.non_polled_services:
       msgs.append(recv_one_or_none(self.sock[s]))
-    self.update_msgs(sec_since_boot(), msgs)
+
+    cur_time = sec_since_boot()
+    if VIRTUAL_TIME:
+      # the time of the newest message received
+      self.virtual_time = max([self.virtual_time] + [m.logMonoTime / 1e9 for m in msgs if m is not None])
+      cur_time = self.virtual_time
+    self.update_msgs(cur_time, msgs)
 
   def update_msgs(self, cur_time: float, msgs: List[capnp.lib.capnp._DynamicStructReader]) -> None:
     self.frame += 1
@@ -249,3 +258,6 @@ class PubMaster:
 
   def all_readers_updated(self, s: str) -> bool:
     return self.sock[s].all_readers_updated()
+
+  def wait_readers_done(self, s: str, timeout: int) -> bool:
+    return self.sock[s].wait_readers_done(timeout)
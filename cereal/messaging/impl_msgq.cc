@@ -16,7 +16,13 @@ void sig_handler(int signal) {
   msgq_do_exit = 1;
 }
 
+// the service of a namespaced endpoint "<ns>/<name>"
+static std::string service_name(const std::string &endpoint){
+  return endpoint.substr(endpoint.rfind('/') + 1);
+}
+
 static bool service_exists(std::string path){
+  path = service_name(path);
   for (const auto& it : services) {
     if (it.name == path) {
       return true;
@@ -27,6 +33,7 @@ static bool service_exists(std::string path){
 
 static size_t get_size(std::string endpoint){
   size_t sz = DEFAULT_SEGMENT_SIZE;
+  endpoint = service_name(endpoint);
 
   if (endpoint == "roadCameraState" || endpoint == "driverCameraState" || endpoint == "wideRoadCameraState"){
     sz *= 10;
@@ -200,6 +207,10 @@ bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
 
+bool MSGQPubSocket::wait_readers_done(int timeout) {
+  return msgq_wait_readers_done(q, timeout);
+}
+
 MSGQPubSocket::~MSGQPubSocket(){
   if (q != NULL){
     msgq_close_queue(q);
@@ -49,6 +49,7 @@ public:
   int sendMessage(Message *message);
   int send(char *data, size_t size);
   bool all_readers_updated();
+  bool wait_readers_done(int timeout);
   ~MSGQPubSocket();
 };
 
@@ -136,6 +136,11 @@ bool ZMQPubSocket::all_readers_updated() {
   return false;
 }
 
+// zmq doesn't know what its readers received, so they're never done. replay refuses virtual time with zmq
+bool ZMQPubSocket::wait_readers_done(int timeout) {
+  return false;
+}
+
 ZMQPubSocket::~ZMQPubSocket(){
   zmq_close(sock);
 }
@@ -48,6 +48,7 @@ public:
   int sendMessage(Message *message);
   int send(char *data, size_t size);
   bool all_readers_updated();
+  bool wait_readers_done(int timeout);
   ~ZMQPubSocket();
 };
 
@@ -49,6 +49,9 @@ public:
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
   virtual bool all_readers_updated() = 0;
+  // waits until the readers asked for another message after the last one sent. false after timeout ms.
+  // only msgq knows this, with zmq it's always false
+  virtual bool wait_readers_done(int timeout) = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
   static PubSocket * create(Context * context, std::string endpoint, int port, bool check_endpoint=true);
@@ -90,6 +93,7 @@ private:
   struct SubMessage;
   std::map<SubSocket *, SubMessage *> messages_;
   std::map<std::string, SubMessage *> services_;
+  uint64_t virtual_time_ = 0;
 };
 
 class MessageBuilder : public capnp::MallocMessageBuilder {
@@ -117,9 +121,11 @@ private:
 
 class PubMaster {
 public:
-  PubMaster(const std::vector<const char *> &service_list);
+  // with a namespace, the services are published to "<ns>/<name>". only supported by msgq
+  PubMaster(const std::vector<const char *> &service_list, const std::string &ns = "");
   inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
   int send(const char *name, MessageBuilder &msg);
+  inline bool wait_readers_done(const char *name, int timeout) { return sockets_.at(name)->wait_readers_done(timeout); }
   ~PubMaster();
 
 private:
@@ -32,6 +32,7 @@ cdef extern from "messaging.h":
     int sendMessage(Message *)
     int send(char *, size_t)
     bool all_readers_updated()
+    bool wait_readers_done(int) nogil
 
   cdef cppclass Poller:
     @staticmethod
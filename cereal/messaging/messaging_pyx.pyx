@@ -152,3 +152,9 @@ cdef class PubSocket:
 
   def all_readers_updated(self):
     return self.socket.all_readers_updated()
+
+  def wait_readers_done(self, int timeout):
+    cdef bool done
+    with nogil:
+      done = self.socket.wait_readers_done(timeout)
+    return done
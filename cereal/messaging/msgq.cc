@@ -9,9 +9,13 @@
 #include <cstdlib>
 #include <csignal>
 #include <random>
+#include <thread>
 
 #include <poll.h>
 #include <sys/ioctl.h>
+#ifndef __APPLE__
+#include <linux/futex.h>
+#endif
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -71,6 +75,26 @@ void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
   q->read_valids[id]->store(true);
   q->read_pointers[id]->store(*q->write_pointer);
+  q->ack_pointers[id]->store(*q->write_pointer);
+}
+
+// a reader that asks for another message is done with the ones it read.
+// unless the publisher waits for its readers this is a single store
+static void msgq_ack(msgq_queue_t *q, uint64_t read_pointer){
+  int id = q->reader_id;
+  if (*q->ack_pointers[id] == read_pointer){
+    return;
+  }
+  *q->ack_pointers[id] = read_pointer;
+
+  // the waiter sets ack_waiting before it checks the ack pointers, so either it sees this ack,
+  // or this sees ack_waiting set and wakes it. both are seq_cst
+  if (*q->ack_waiting){
+    (*q->ack_seq)++;
+    #ifndef __APPLE__
+      syscall(SYS_futex, q->ack_seq, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    #endif
+  }
 }
 
 void msgq_wait_for_subscriber(msgq_queue_t *q){
@@ -82,22 +106,31 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 }
 
 
+std::string msgq_path(const std::string &path){
+  // processes started with OPENPILOT_PREFIX, and namespaced endpoints ("<ns>/<name>"),
+  // get their queues in a directory of their own
+  std::string full_path = "/dev/shm/";
+  if (const char * prefix = std::getenv("OPENPILOT_PREFIX")){
+    full_path += std::string(prefix) + "/";
+  }
+  full_path += path;
+
+  for (size_t pos = strlen("/dev/shm/"); (pos = full_path.find('/', pos)) != std::string::npos; pos++){
+    mkdir(full_path.substr(0, pos).c_str(), 0775);
+  }
+  return full_path;
+}
+
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
   std::signal(SIGUSR2, sigusr2_handler);
 
-  const char * prefix = "/dev/shm/";
-  char * full_path = new char[strlen(path) + strlen(prefix) + 1];
-  strcpy(full_path, prefix);
-  strcat(full_path, path);
-
-  auto fd = open(full_path, O_RDWR | O_CREAT, 0664);
+  std::string full_path = msgq_path(path);
+  auto fd = open(full_path.c_str(), O_RDWR | O_CREAT, 0664);
   if (fd < 0) {
     std::cout << "Warning, could not open: " << full_path << std::endl;
-    delete[] full_path;
     return -1;
   }
-  delete[] full_path;
 
   int rc = ftruncate(fd, size + sizeof(msgq_header_t));
   if (rc < 0){
@@ -123,7 +156,10 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
     q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
     q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
     q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+    q->ack_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->ack_pointers[i]);
   }
+  q->ack_seq = reinterpret_cast<std::atomic<uint32_t>*>(&header->ack_seq);
+  q->ack_waiting = reinterpret_cast<std::atomic<uint32_t>*>(&header->ack_waiting);
 
   q->data = mem + sizeof(msgq_header_t);
   q->size = size;
@@ -148,6 +184,7 @@ void msgq_init_publisher(msgq_queue_t * q) {
 
   *q->write_uid = uid;
   *q->num_readers = 0;
+  *q->ack_waiting = 0;
 
   for (size_t i = 0; i < NUM_READERS; i++){
     *q->read_valids[i] = false;
@@ -324,6 +361,8 @@ int msgq_msg_ready(msgq_queue_t * q){
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
 
+  msgq_ack(q, *q->read_pointers[id]);
+
   // Check if new message is available
   return (read_pointer != write_pointer);
 }
@@ -353,6 +392,8 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
 
   char * p = q->data + read_pointer;
 
+  msgq_ack(q, *q->read_pointers[id]);
+
   // Check if new message is available
   if (read_pointer == write_pointer) {
     msg->size = 0;
@@ -462,3 +503,44 @@ bool msgq_all_readers_updated(msgq_queue_t *q) {
   }
   return num_readers > 0;
 }
+
+static bool msgq_all_readers_done(msgq_queue_t *q) {
+  uint64_t num_readers = *q->num_readers;
+  for (uint64_t i = 0; i < num_readers; i++) {
+    if (*q->read_valids[i] && *q->write_pointer != *q->ack_pointers[i]) {
+      // the slots of readers that exited are only reused once the slots run out
+      uint32_t tid = *q->read_uids[i] & 0xFFFFFFFF;
+      if (kill(tid, 0) == 0 || errno != ESRCH) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool msgq_wait_readers_done(msgq_queue_t *q, int timeout) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  *q->ack_waiting = 1;
+
+  bool done = false;
+  while (true) {
+    // an ack after the seq was read changes it, and the futex returns right away
+    uint32_t seq = *q->ack_seq;
+    done = msgq_all_readers_done(q);
+    auto remaining = deadline - std::chrono::steady_clock::now();
+    if (done || remaining <= std::chrono::nanoseconds(0)){
+      break;
+    }
+
+    #ifdef __APPLE__
+      std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(remaining, std::chrono::milliseconds(1)));
+    #else
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+      struct timespec ts = {.tv_sec = (time_t)(ns / 1000000000), .tv_nsec = (long)(ns % 1000000000)};
+      syscall(SYS_futex, q->ack_seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+    #endif
+  }
+
+  *q->ack_waiting = 0;
+  return done;
+}
@@ -18,6 +18,11 @@ struct  msgq_header_t {
   uint64_t read_pointers[NUM_READERS];
   uint64_t read_valids[NUM_READERS];
   uint64_t read_uids[NUM_READERS];
+  // read pointer of each reader when it last asked for a message, it's done with everything before
+  uint64_t ack_pointers[NUM_READERS];
+  // bumped on each ack, a futex for the publisher waiting on the readers
+  uint32_t ack_seq;
+  uint32_t ack_waiting;
 };
 
 struct msgq_queue_t {
@@ -27,6 +32,9 @@ struct msgq_queue_t {
   std::atomic<uint64_t> *read_pointers[NUM_READERS];
   std::atomic<uint64_t> *read_valids[NUM_READERS];
   std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *ack_pointers[NUM_READERS];
+  std::atomic<uint32_t> *ack_seq;
+  std::atomic<uint32_t> *ack_waiting;
   char * mmap_p;
   char * data;
   size_t size;
@@ -55,6 +63,7 @@ int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
 int msgq_msg_close(msgq_msg_t *msg);
 
+std::string msgq_path(const std::string &path);
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
@@ -66,3 +75,6 @@ int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
 bool msgq_all_readers_updated(msgq_queue_t *q);
+// waits until every reader asked for another message after reading the last one written, so it's done with it.
+// returns false after timeout ms
+bool msgq_wait_readers_done(msgq_queue_t *q, int timeout);
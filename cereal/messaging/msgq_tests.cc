@@ -0,0 +1,78 @@
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+
+#include "catch2/catch.hpp"
+#include "msgq.h"
+
+static void send_message(msgq_queue_t *q) {
+  msgq_msg_t msg;
+  msgq_msg_init_size(&msg, 128);
+  REQUIRE(msgq_msg_send(&msg, q) == 128);
+  msgq_msg_close(&msg);
+}
+
+// returns the size of the message received, 0 if there was none
+static size_t recv_message(msgq_queue_t *q) {
+  msgq_msg_t msg;
+  msgq_msg_recv(&msg, q);
+  const size_t size = msg.size;
+  msgq_msg_close(&msg);
+  return size;
+}
+
+TEST_CASE("msgq_wait_readers_done") {
+  remove("/dev/shm/test_queue");
+  msgq_queue_t writer, reader;
+  msgq_new_queue(&writer, "test_queue", 1024);
+  msgq_new_queue(&reader, "test_queue", 1024);
+  msgq_init_publisher(&writer);
+  msgq_init_subscriber(&reader);
+
+  SECTION("a reader is done once it asks for the next message") {
+    send_message(&writer);
+    REQUIRE(recv_message(&reader) == 128);
+    // it still holds the message
+    REQUIRE_FALSE(msgq_wait_readers_done(&writer, 10));
+
+    // the waiter is woken by the ack, long before the timeout
+    auto done = std::async(std::launch::async, [&]() { return msgq_wait_readers_done(&writer, 10000); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(recv_message(&reader) == 0);
+    REQUIRE(done.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    REQUIRE(done.get());
+
+    // nothing was sent since
+    REQUIRE(msgq_wait_readers_done(&writer, 0));
+  }
+
+  SECTION("readers that exited are not waited for") {
+    pid_t pid = fork();
+    if (pid == 0) {
+      msgq_queue_t child_reader;
+      msgq_new_queue(&child_reader, "test_queue", 1024);
+      msgq_init_subscriber(&child_reader);
+      _exit(0);
+    }
+    REQUIRE(waitpid(pid, nullptr, 0) == pid);
+
+    send_message(&writer);
+    REQUIRE(recv_message(&reader) == 128);
+    REQUIRE(recv_message(&reader) == 0);
+    REQUIRE(msgq_wait_readers_done(&writer, 1000));
+  }
+
+  SECTION("times out on a reader that doesn't ask for more") {
+    send_message(&writer);
+    const auto start = std::chrono::steady_clock::now();
+    REQUIRE_FALSE(msgq_wait_readers_done(&writer, 100));
+    REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(100));
+  }
+
+  msgq_close_queue(&writer);
+  msgq_close_queue(&reader);
+}
@@ -3,11 +3,14 @@
 #include <stdlib.h>
 #include <string>
 #include <mutex>
+#include <algorithm>
 
 #include "services.h"
 #include "messaging.h"
 
 const bool SIMULATION = (getenv("SIMULATION") != nullptr) && (std::string(getenv("SIMULATION")) == "1");
+// replay --virtual-time: the clock is the logMonoTime of the log being replayed
+const bool VIRTUAL_TIME = (getenv("VIRTUAL_TIME") != nullptr) && (std::string(getenv("VIRTUAL_TIME")) == "1");
 
 static inline uint64_t nanos_since_boot() {
   struct timespec t;
@@ -99,6 +102,13 @@ void SubMaster::update(int timeout) {
     messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
   }
 
+  if (VIRTUAL_TIME) {
+    // the time of the newest message received
+    for (auto &[name, event] : messages) {
+      virtual_time_ = std::max(virtual_time_, event.getLogMonoTime());
+    }
+    current_time = virtual_time_;
+  }
   update_msgs(current_time, messages);
 }
 
@@ -186,10 +196,11 @@ SubMaster::~SubMaster() {
   }
 }
 
-PubMaster::PubMaster(const std::vector<const char *> &service_list) {
+PubMaster::PubMaster(const std::vector<const char *> &service_list, const std::string &ns) {
+  assert(ns.empty() || !messaging_use_zmq());
   for (auto name : service_list) {
     assert(get_service(name) != nullptr);
-    PubSocket *socket = PubSocket::create(message_context.context(), name);
+    PubSocket *socket = PubSocket::create(message_context.context(), ns.empty() ? name : ns + "/" + name);
     assert(socket);
     sockets_[name] = socket;
   }
@@ -30,7 +30,7 @@ bool VisionIpcClient::connect(bool blocking){
   num_buffers = 0;
 
   // Connect to server socket and ask for all FDs of type
-  std::string path = "/tmp/visionipc_" + name;
+  std::string path = get_ipc_path(name);
 
   int socket_fd = -1;
   while (socket_fd < 0) {
@@ -1,10 +1,13 @@
 #include <iostream>
 #include <chrono>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 #include <random>
 
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "messaging/messaging.h"
@@ -12,13 +15,34 @@
 #include "visionipc/visionipc_server.h"
 #include "logger/logger.h"
 
+// a namespaced server name is "<ns>/<name>"
+static std::pair<std::string, std::string> split_namespace(const std::string &name){
+  size_t pos = name.rfind('/');
+  return {pos == std::string::npos ? "" : name.substr(0, pos + 1), name.substr(pos + 1)};
+}
+
 std::string get_endpoint_name(std::string name, VisionStreamType type){
   if (messaging_use_zmq()){
     assert(name == "camerad");
     return std::to_string(9000 + static_cast<int>(type));
   } else {
-    return "visionipc_" + name + "_" + std::to_string(type);
+    auto [ns, base] = split_namespace(name);
+    return ns + "visionipc_" + base + "_" + std::to_string(type);
+  }
+}
+
+std::string get_ipc_path(const std::string &name){
+  // the same layout as msgq, see msgq_path
+  std::string path = "/tmp/";
+  if (const char *prefix = std::getenv("OPENPILOT_PREFIX")){
+    path += std::string(prefix) + "/";
+  }
+  auto [ns, base] = split_namespace(name);
+  path += ns;
+  for (size_t pos = strlen("/tmp/"); (pos = path.find('/', pos)) != std::string::npos; pos++){
+    mkdir(path.substr(0, pos).c_str(), 0775);
   }
+  return path + "visionipc_" + base;
 }
 
 VisionIpcServer::VisionIpcServer(std::string name, cl_device_id device_id, cl_context ctx) : name(name), device_id(device_id), ctx(ctx) {
@@ -75,7 +99,7 @@ void VisionIpcServer::start_listener(){
 void VisionIpcServer::listener(){
   std::cout << "Starting listener for: " << name << std::endl;
 
-  std::string path = "/tmp/visionipc_" + name;
+  std::string path = get_ipc_path(name);
   int sock = ipc_bind(path.c_str());
   assert(sock >= 0);
 
@@ -10,6 +10,7 @@
 #include "visionipc/visionbuf.h"
 
 std::string get_endpoint_name(std::string name, VisionStreamType type);
+std::string get_ipc_path(const std::string &name);
 
 class VisionIpcServer {
  private:
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+import os
+import shutil
+import signal
+import tempfile
+import threading
+import time
+import unittest
+
+from common.params import Params
+
+
+class TestParams(unittest.TestCase):
+  def setUp(self):
+    self.tmpdir = tempfile.mkdtemp()
+    self.params = Params(self.tmpdir)
+
+  def tearDown(self):
+    shutil.rmtree(self.tmpdir)
+
+  def test_get_block_wake_latency(self):
+    # a blocking get waits on inotify, it used to poll the file every 100 ms
+    latencies = []
+    for _ in range(20):
+      self.params.delete("CarParams")
+      put_time = []
+
+      def put():
+        time.sleep(0.02)
+        put_time.append(time.monotonic())
+        Params(self.tmpdir).put("CarParams", "test")
+
+      t = threading.Thread(target=put)
+      t.start()
+      self.assertEqual(self.params.get("CarParams", block=True), b"test")
+      latencies.append(time.monotonic() - put_time[0])
+      t.join()
+
+    print(f"wake latency: avg {sum(latencies) / len(latencies) * 1e3:.2f} ms, worst {max(latencies) * 1e3:.2f} ms")
+    self.assertLess(sum(latencies) / len(latencies), 0.02)
+
+  def test_get_block_interrupted(self):
+    # the signal is sent from another thread, so any thread can handle it
+    for delay in (0.01, 0.1):
+      t = threading.Timer(delay, lambda: os.kill(os.getpid(), signal.SIGINT))
+      t.start()
+      start = time.monotonic()
+      with self.assertRaises(KeyboardInterrupt):
+        self.params.get("CarParams", block=True)
+      t.join()
+      self.assertLess(time.monotonic() - start, delay + 1)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -22,6 +22,7 @@
 #include "selfdrive/common/params.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/timing.h"
+#include "selfdrive/common/trace.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
 #include "selfdrive/locationd/ublox_msg.h"
@@ -186,6 +187,7 @@ void usb_retry_connect() {
 }
 
 void can_recv(PubMaster &pm) {
+  TRACE_SCOPE("boardd_can_recv");
   kj::Array<capnp::word> can_data;
   panda->can_receive(can_data);
   auto bytes = can_data.asBytes();
@@ -218,6 +220,7 @@ void can_send_thread() {
     //Dont send if older than 1 second
     if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
       if (!fake_send) {
+        TRACE_SCOPE("boardd_can_send");
         panda->can_send(event.getSendcan());
       }
     }
@@ -358,8 +361,10 @@ void panda_state_thread() {
 
     if (Hardware::TICI()) {
       double read_time = millis_since_boot();
-      ps.setVoltage(std::stoi(util::read_file("/sys/class/hwmon/hwmon1/in1_input")));
-      ps.setCurrent(std::stoi(util::read_file("/sys/class/hwmon/hwmon1/curr1_input")));
+      static util::SysfsReader voltage_reader("/sys/class/hwmon/hwmon1/in1_input");
+      static util::SysfsReader current_reader("/sys/class/hwmon/hwmon1/curr1_input");
+      ps.setVoltage(voltage_reader.readInt().value_or(0));
+      ps.setCurrent(current_reader.readInt().value_or(0));
       read_time = millis_since_boot() - read_time;
       if (read_time > 50) {
         LOGW("reading hwmon took %lfms", read_time);
@@ -14,7 +14,9 @@
 #include "selfdrive/common/clutil.h"
 #include "selfdrive/common/modeldata.h"
 #include "selfdrive/common/params.h"
+#include "selfdrive/common/statlog.h"
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/trace.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
 
@@ -157,6 +159,7 @@ bool CameraBuf::acquire() {
     return false;
   }
 
+  TRACE_SCOPE("camera_acquire");
   cur_frame_data = camera_bufs_metadata[cur_buf_idx];
   cur_rgb_buf = vipc_server->get_buffer(rgb_type);
   cl_mem camrabuf_cl = camera_bufs[cur_buf_idx].buf_cl;
@@ -187,6 +190,7 @@ bool CameraBuf::acquire() {
   rgb2yuv->queue(q, cur_rgb_buf->buf_cl, cur_yuv_buf->buf_cl);
 
   cur_frame_data.processing_time = (millis_since_boot() - start_time) / 1000.0;
+  statlog_sample("camerad.processing_time_ms", cur_frame_data.processing_time * 1000.0f);
 
   VisionIpcBufExtra extra = {
                         cur_frame_data.frame_id,
@@ -208,7 +212,9 @@ void CameraBuf::release() {
 }
 
 void CameraBuf::queue(size_t buf_idx) {
-  safe_queue.push(buf_idx);
+  if (!safe_queue.push(buf_idx)) {
+    LOGE_100("camera buffer queue full, dropped frame in buffer %zu (%lu dropped)", buf_idx, safe_queue.overflows());
+  }
 }
 
 // common functions
@@ -100,7 +100,9 @@ private:
 
   int cur_buf_idx;
 
-  SafeQueue<int> safe_queue;
+  // indices of the filled buffers, from the camera thread to the processing thread.
+  // holds more than the buffers of any camera, it only overflows if processing stalls
+  BoundedQueue<int> safe_queue{32};
 
   int frame_buf_count;
   release_cb release_callback;
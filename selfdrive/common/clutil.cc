@@ -1,10 +1,20 @@
 #include "selfdrive/common/clutil.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <iostream>
 #include <memory>
 
 #include "selfdrive/common/util.h"
+#include "selfdrive/hardware/hw.h"
 
 namespace {  // helper functions
 
@@ -52,6 +62,120 @@ void cl_print_build_errors(cl_program program, cl_device_id device) {
   std::cout << "build failed; status=" << status << ", log:" << std::endl << log << std::endl;
 }
 
+// Programs built from source are cached on disk as binaries, keyed by the source, the build
+// args, and the device and driver that built them. A miss, or a binary the driver rejects,
+// builds from source and replaces the cached binary. The header has the size and a hash of the
+// binary, so a torn or corrupted file is never passed to the driver.
+const char CL_CACHE_MAGIC[8] = {'C', 'L', 'B', 'I', 'N', '2', '\0', '\0'};
+struct ClCacheHeader {
+  char magic[8];
+  uint64_t size;  // of the binary that follows
+  uint64_t hash;  // FNV-1a of the binary
+};
+// entries are touched when they are loaded, the ones unused for this long are removed
+const int CL_CACHE_MAX_AGE_DAYS = 30;
+
+const uint64_t FNV1A_INIT = 14695981039346656037ULL;
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ ((const uint8_t *)data)[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::string cl_cache_path(cl_device_id device_id, const std::string &src, const char *args) {
+  cl_platform_id platform = NULL;
+  CL_CHECK(clGetDeviceInfo(device_id, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL));
+  const std::string key[] = {
+    src,
+    args ? args : "",
+    get_platform_info(platform, CL_PLATFORM_VERSION),
+    get_device_info(device_id, CL_DEVICE_NAME),
+    get_device_info(device_id, CL_DEVICE_VERSION),
+    get_device_info(device_id, CL_DRIVER_VERSION),
+  };
+  uint64_t hash = FNV1A_INIT;
+  for (const std::string &s : key) {
+    hash = fnv1a(hash, s.data(), s.size());
+    hash = (hash ^ 0xff) * 1099511628211ULL;  // separator
+  }
+  return Path::cl_cache() + "/" + util::string_format("%016llx", (unsigned long long)hash);
+}
+
+cl_program cl_program_from_cache(cl_context ctx, cl_device_id device_id, const std::string &path, const char *args) {
+  const std::string dat = util::read_file(path);
+  if (dat.empty()) return NULL;
+
+  ClCacheHeader header = {};
+  memcpy(&header, dat.data(), std::min(dat.size(), sizeof(header)));
+  const uint8_t *binary = (const uint8_t *)dat.data() + sizeof(header);
+  size_t length = dat.size() - sizeof(header);
+  if (dat.size() <= sizeof(header) || memcmp(header.magic, CL_CACHE_MAGIC, sizeof(CL_CACHE_MAGIC)) != 0 ||
+      header.size != length || header.hash != fnv1a(FNV1A_INIT, binary, length)) {
+    std::cout << "cached program " << path << " is corrupted, building from source" << std::endl;
+    return NULL;
+  }
+
+  cl_int err = CL_SUCCESS, binary_status = CL_SUCCESS;
+  cl_program prg = clCreateProgramWithBinary(ctx, 1, &device_id, &length, &binary, &binary_status, &err);
+  if (err != CL_SUCCESS || binary_status != CL_SUCCESS || clBuildProgram(prg, 1, &device_id, args, NULL, NULL) != CL_SUCCESS) {
+    std::cout << "cached program " << path << " rejected, building from source" << std::endl;
+    if (prg) clReleaseProgram(prg);
+    return NULL;
+  }
+  // keeps it from being pruned
+  utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+  return prg;
+}
+
+// removes the entries unused for CL_CACHE_MAX_AGE_DAYS, and the temp files of writers that died
+void cl_cache_prune() {
+  const time_t now = time(NULL);
+  DIR *d = opendir(Path::cl_cache().c_str());
+  if (!d) return;
+  while (struct dirent *de = readdir(d)) {
+    struct stat st;
+    if (de->d_name[0] == '.' || fstatat(dirfd(d), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    const bool tmp = strstr(de->d_name, ".tmp") != nullptr;
+    if (now - st.st_mtime > (tmp ? 24 * 3600 : CL_CACHE_MAX_AGE_DAYS * 24 * 3600)) {
+      unlinkat(dirfd(d), de->d_name, 0);
+    }
+  }
+  closedir(d);
+}
+
+void cl_cache_program(cl_program prg, const std::string &path) {
+  size_t length = 0;
+  if (clGetProgramInfo(prg, CL_PROGRAM_BINARY_SIZES, sizeof(length), &length, NULL) != CL_SUCCESS || length == 0) {
+    return;
+  }
+  std::string dat(sizeof(ClCacheHeader) + length, '\0');
+  unsigned char *binary = (unsigned char *)dat.data() + sizeof(ClCacheHeader);
+  if (clGetProgramInfo(prg, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) != CL_SUCCESS) {
+    return;
+  }
+  ClCacheHeader header = {.size = length, .hash = fnv1a(FNV1A_INIT, binary, length)};
+  memcpy(header.magic, CL_CACHE_MAGIC, sizeof(CL_CACHE_MAGIC));
+  memcpy(dat.data(), &header, sizeof(header));
+
+  // processes building the same program don't see each other's partial files, and the file is
+  // synced before it's renamed into place, so a power loss doesn't leave an empty entry
+  if (!util::create_directories(Path::cl_cache(), 0775)) return;
+  const std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+  int fd = HANDLE_EINTR(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664));
+  if (fd < 0) return;
+  ssize_t written = HANDLE_EINTR(write(fd, dat.data(), dat.size()));
+  const bool synced = written == (ssize_t)dat.size() && fsync(fd) == 0;
+  close(fd);
+  if (!synced || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return;
+  }
+  // a new entry is written when the source, args or driver changed, the old ones may be unused now
+  cl_cache_prune();
+}
+
 }  // namespace
 
 cl_device_id cl_get_device_id(cl_device_type device_type) {
@@ -78,11 +202,17 @@ cl_program cl_program_from_file(cl_context ctx, cl_device_id device_id, const ch
 }
 
 cl_program cl_program_from_source(cl_context ctx, cl_device_id device_id, const std::string& src, const char* args) {
+  const std::string cache_path = cl_cache_path(device_id, src, args);
+  if (cl_program prg = cl_program_from_cache(ctx, device_id, cache_path, args)) {
+    return prg;
+  }
+
   cl_program prg = CL_CHECK_ERR(clCreateProgramWithSource(ctx, 1, (const char*[]){src.c_str()}, NULL, &err));
   if (int err = clBuildProgram(prg, 1, &device_id, args, NULL, NULL); err != 0) {
     cl_print_build_errors(prg, device_id);
     assert(0);
   }
+  cl_cache_program(prg, cache_path);
   return prg;
 }
 
@@ -1,20 +1,65 @@
 #include "selfdrive/common/params.h"
 
 #include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
 
+#include <atomic>
+#include <cmath>
 #include <csignal>
+#include <cstring>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
 
 namespace {
 
 volatile sig_atomic_t params_do_exit = 0;
-void params_sig_handler(int signal) {
+std::atomic<int> params_blocking_gets = 0;
+// the handler also writes to a pipe the blocking gets poll, so a signal that comes after the
+// params_do_exit check, or that's handled by another thread, still wakes them
+int params_exit_pipe[2] = {-1, -1};
+struct sigaction params_prev_sigint = {}, params_prev_sigterm = {};
+void params_sig_handler(int signal, siginfo_t *info, void *context) {
+  // the handler stays installed, so the one it replaced still gets the signal, before a blocking get wakes
+  const struct sigaction &prev = signal == SIGINT ? params_prev_sigint : params_prev_sigterm;
+  if (prev.sa_flags & SA_SIGINFO) {
+    prev.sa_sigaction(signal, info, context);
+  } else if (prev.sa_handler == SIG_DFL && params_blocking_gets == 0) {
+    // outside of a blocking get, the signal does what it did before
+    std::signal(signal, SIG_DFL);
+    raise(signal);
+  } else if (prev.sa_handler != SIG_DFL && prev.sa_handler != SIG_IGN) {
+    prev.sa_handler(signal);
+  }
+
   params_do_exit = 1;
+  if (params_exit_pipe[1] >= 0) {
+    ssize_t ret = write(params_exit_pipe[1], "x", 1);
+    (void)ret;
+  }
+}
+
+// installs the handler, unless it's already installed. the handler a process sets later
+// replaces it, and is chained to the next time a blocking get installs it again
+void install_params_sig_handler(int signal, struct sigaction &prev) {
+  struct sigaction cur = {};
+  if (sigaction(signal, nullptr, &cur) != 0 || ((cur.sa_flags & SA_SIGINFO) && cur.sa_sigaction == params_sig_handler)) {
+    return;
+  }
+  struct sigaction sa = {};
+  sa.sa_sigaction = params_sig_handler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  prev = cur;
+  sigaction(signal, &sa, nullptr);
 }
 
 int fsync_dir(const std::string &path) {
@@ -383,9 +428,195 @@ std::unordered_map<std::string, uint32_t> keys = {
 
 } // namespace
 
+// Process-local cache of a params directory. Reads are served from memory, an inotify
+// watcher thread drops the keys that change and calls the callbacks registered for them
+// if their value changed. It follows the <params>/d symlink when a transaction swaps it.
+// Writes of this process invalidate their keys right away, writes of other processes
+// are seen once the watcher has woken up.
+class ParamsCache {
+public:
+  // one cache per directory. caches are never freed, the watcher threads run until exit
+  static ParamsCache *get(const std::string &path) {
+    std::lock_guard lk(caches_lock);
+    auto &cache = caches()[path];
+    if (!cache) {
+      cache = new ParamsCache(path);
+    }
+    return cache;
+  }
+
+  std::string read(const std::string &key) {
+    std::unique_lock lk(lock_);
+    if (auto it = values_.find(key); it != values_.end()) {
+      return it->second;
+    }
+    // cache the value only if the key didn't change while reading it
+    const uint64_t generation = generation_;
+    lk.unlock();
+    std::string value = util::read_file(path_ + "/" + key);
+    lk.lock();
+    if (generation == generation_ && inotify_fd_ >= 0) {
+      values_[key] = value;
+    }
+    return value;
+  }
+
+  void invalidate(const std::string &key = {}) {
+    std::lock_guard lk(lock_);
+    ++generation_;
+    if (key.empty()) {
+      values_.clear();
+    } else {
+      values_.erase(key);
+    }
+  }
+
+  int addCallback(const std::string &key, std::function<void(const std::string &)> callback) {
+    std::string value = read(key);
+    std::lock_guard lk(lock_);
+    callbacks_[++last_callback_id_] = {key, value, callback};
+    return last_callback_id_;
+  }
+
+  void removeCallback(int id) {
+    std::lock_guard lk(lock_);
+    callbacks_.erase(id);
+  }
+
+private:
+  ParamsCache(const std::string &path) : path_(path) {
+    // the parent is watched for the <params>/d symlink being swapped by a transaction
+    const std::string parent = path.substr(0, path.rfind('/'));
+    inotify_fd_ = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd_ >= 0) {
+      parent_wd_ = inotify_add_watch(inotify_fd_, parent.c_str(), IN_MOVED_TO);
+      dir_wd_ = inotify_add_watch(inotify_fd_, path.c_str(), DIR_EVENTS);
+      if (parent_wd_ < 0 || dir_wd_ < 0) {
+        close(inotify_fd_);
+        inotify_fd_ = -1;
+      }
+    }
+    if (inotify_fd_ < 0) {
+      LOGE("params cache disabled for %s, errno=%d", path.c_str(), errno);
+      return;
+    }
+    std::thread(&ParamsCache::watch, this).detach();
+  }
+
+  void watch() {
+    alignas(struct inotify_event) char buf[4096];
+    while (true) {
+      ssize_t len = HANDLE_EINTR(::read(inotify_fd_, buf, sizeof(buf)));
+      if (len <= 0) break;
+
+      std::vector<std::string> changed;
+      bool all_changed = false;
+      for (char *p = buf; p < buf + len;) {
+        auto event = (struct inotify_event *)p;
+        if (event->mask & IN_Q_OVERFLOW) {
+          all_changed = true;
+        } else if (event->wd == parent_wd_) {
+          if (event->len > 0 && strcmp(event->name, "d") == 0) {
+            // follow the symlink to the new directory
+            inotify_rm_watch(inotify_fd_, dir_wd_);
+            dir_wd_ = inotify_add_watch(inotify_fd_, path_.c_str(), DIR_EVENTS);
+            all_changed = true;
+          }
+        } else if (event->wd == dir_wd_ && event->len > 0 && event->name[0] != '.') {
+          changed.push_back(event->name);
+        }
+        p += sizeof(struct inotify_event) + event->len;
+      }
+
+      std::vector<int> callbacks;
+      {
+        std::lock_guard lk(lock_);
+        ++generation_;
+        if (all_changed) {
+          values_.clear();
+        }
+        for (const auto &key : changed) {
+          values_.erase(key);
+        }
+        for (auto &[id, cb] : callbacks_) {
+          if (all_changed || std::find(changed.begin(), changed.end(), cb.key) != changed.end()) {
+            callbacks.push_back(id);
+          }
+        }
+      }
+      for (int id : callbacks) {
+        notify(id);
+      }
+    }
+  }
+
+  // calls the callback if the value differs from the one it was last called with.
+  // called without the lock, so the callbacks can read params
+  void notify(int id) {
+    std::unique_lock lk(lock_);
+    auto it = callbacks_.find(id);
+    if (it == callbacks_.end()) return;
+    const std::string key = it->second.key;
+    lk.unlock();
+    std::string value = read(key);
+    lk.lock();
+    if (it = callbacks_.find(id); it != callbacks_.end() && it->second.value != value) {
+      it->second.value = value;
+      auto callback = it->second.callback;
+      lk.unlock();
+      callback(value);
+    }
+  }
+
+  static std::unordered_map<std::string, ParamsCache *> &caches() {
+    static std::unordered_map<std::string, ParamsCache *> caches;
+    return caches;
+  }
+  // the caches are locked over the fork, so the child gets them in a consistent state
+  static void atfork_prepare() {
+    caches_lock.lock();
+    for (auto &[path, cache] : caches()) cache->lock_.lock();
+  }
+  static void atfork_parent() {
+    for (auto &[path, cache] : caches()) cache->lock_.unlock();
+    caches_lock.unlock();
+  }
+  // the watcher threads don't exist in the child. the caches the Params of the child already
+  // have stop caching, and new Params get new caches
+  static void atfork_child() {
+    for (auto &[path, cache] : caches()) {
+      close(cache->inotify_fd_);
+      cache->inotify_fd_ = -1;
+      cache->values_.clear();
+      cache->lock_.unlock();
+    }
+    caches().clear();
+    caches_lock.unlock();
+  }
+  static inline std::mutex caches_lock;
+  static inline int atfork_registered = pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+
+  static const uint32_t DIR_EVENTS = IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_MODIFY;
+  struct Callback {
+    std::string key;
+    std::string value;  // last value passed to the callback
+    std::function<void(const std::string &)> callback;
+  };
+
+  const std::string path_;
+  int inotify_fd_ = -1;
+  int parent_wd_ = -1, dir_wd_ = -1;
+  std::mutex lock_;
+  uint64_t generation_ = 0;
+  std::unordered_map<std::string, std::string> values_;
+  int last_callback_id_ = 0;
+  std::map<int, Callback> callbacks_;
+};
+
 Params::Params(const std::string &path) {
   static std::string default_param_path = ensure_params_path();
   params_path = path.empty() ? default_param_path : ensure_params_path(path);
+  cache = ParamsCache::get(getParamPath());
 }
 
 bool Params::checkKey(const std::string &key) {
@@ -423,6 +654,7 @@ int Params::put(const char* key, const char* value, size_t value_size) {
 
     // Move temp into place.
     if ((result = rename(tmp_path.c_str(), getParamPath(key).c_str())) < 0) break;
+    cache->invalidate(key);
 
     // fsync parent directory
     result = fsync_dir(getParamPath());
@@ -436,33 +668,93 @@ int Params::put(const char* key, const char* value, size_t value_size) {
 int Params::remove(const std::string &key) {
   FileLock file_lock(params_path + "/.lock");
   int result = unlink(getParamPath(key).c_str());
+  cache->invalidate(key);
   if (result != 0) {
     return result;
   }
   return fsync_dir(getParamPath());
 }
 
-std::string Params::get(const std::string &key, bool block) {
+std::string Params::get(const std::string &key, bool block, int timeout_ms) {
   if (!block) {
-    return util::read_file(getParamPath(key));
-  } else {
-    // blocking read until successful
-    params_do_exit = 0;
-    void (*prev_handler_sigint)(int) = std::signal(SIGINT, params_sig_handler);
-    void (*prev_handler_sigterm)(int) = std::signal(SIGTERM, params_sig_handler);
+    return cache->read(key);
+  }
 
-    std::string value;
-    while (!params_do_exit) {
-      if (value = util::read_file(getParamPath(key)); !value.empty()) {
-        break;
+  // blocking read until successful, interrupted by a signal or timed out.
+  // inotify wakes the wait as soon as the value is moved into place
+  {
+    // a forked child makes its own pipe, the signals of one process don't wake the other
+    static std::mutex pipe_lock;
+    static pid_t pipe_pid = 0;
+    std::lock_guard lk(pipe_lock);
+    if (pipe_pid != getpid()) {
+      if (params_exit_pipe[0] >= 0) {
+        close(params_exit_pipe[0]);
+        close(params_exit_pipe[1]);
       }
-      util::sleep_for(100);  // 0.1 s
+      if (pipe2(params_exit_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        params_exit_pipe[0] = params_exit_pipe[1] = -1;
+      }
+      pipe_pid = getpid();
     }
+    for (char buf[64]; params_exit_pipe[0] >= 0 && read(params_exit_pipe[0], buf, sizeof(buf)) > 0;) {}
+    install_params_sig_handler(SIGINT, params_prev_sigint);
+    install_params_sig_handler(SIGTERM, params_prev_sigterm);
+    params_do_exit = 0;
+    params_blocking_gets++;
+  }
 
-    std::signal(SIGINT, prev_handler_sigint);
-    std::signal(SIGTERM, prev_handler_sigterm);
-    return value;
+  const std::string key_path = getParamPath();
+  int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  int dir_wd = -1;
+  if (fd >= 0) {
+    // the parent is watched for transactions swapping the <params>/d symlink
+    inotify_add_watch(fd, params_path.c_str(), IN_MOVED_TO);
+    dir_wd = inotify_add_watch(fd, key_path.c_str(), IN_MOVED_TO | IN_CREATE | IN_CLOSE_WRITE);
+  }
+
+  const double end_ts = millis_since_boot() + timeout_ms;
+  std::string value;
+  while (!params_do_exit) {
+    if (value = util::read_file(getParamPath(key)); !value.empty()) {
+      break;
+    }
+
+    int wait_ms = fd >= 0 ? -1 : 100;  // 0.1 s polling without inotify
+    if (timeout_ms >= 0) {
+      const int remaining_ms = std::ceil(end_ts - millis_since_boot());
+      if (remaining_ms <= 0) break;
+      wait_ms = wait_ms < 0 ? remaining_ms : std::min(wait_ms, remaining_ms);
+    }
+
+    // negative fds are ignored by poll
+    struct pollfd pfds[] = {{.fd = fd, .events = POLLIN}, {.fd = params_exit_pipe[0], .events = POLLIN}};
+    if (poll(pfds, std::size(pfds), wait_ms) > 0 && (pfds[0].revents & POLLIN)) {
+      alignas(struct inotify_event) char buf[4096];
+      bool swapped = false;
+      for (ssize_t len; (len = read(fd, buf, sizeof(buf))) > 0;) {
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+          swapped = swapped || ((struct inotify_event *)p)->wd != dir_wd;
+        }
+      }
+      if (swapped) {
+        inotify_rm_watch(fd, dir_wd);
+        dir_wd = inotify_add_watch(fd, key_path.c_str(), IN_MOVED_TO | IN_CREATE | IN_CLOSE_WRITE);
+      }
+    }
   }
+
+  if (fd >= 0) close(fd);
+  params_blocking_gets--;
+  return value;
+}
+
+int Params::watch(const std::string &key, std::function<void(const std::string &)> callback) {
+  return cache->addCallback(key, callback);
+}
+
+void Params::unwatch(int id) {
+  cache->removeCallback(id);
 }
 
 std::map<std::string, std::string> Params::readAll() {
@@ -473,12 +765,103 @@ std::map<std::string, std::string> Params::readAll() {
 void Params::clearAll(ParamKeyType key_type) {
   FileLock file_lock(params_path + "/.lock");
 
-  std::string path;
-  for (auto &[key, type] : keys) {
-    if (type & key_type) {
-      unlink(getParamPath(key).c_str());
+  // only the values that exist are unlinked, instead of every known key
+  const std::string key_path = getParamPath();
+  if (DIR *d = opendir(key_path.c_str())) {
+    while (struct dirent *de = readdir(d)) {
+      auto it = keys.find(de->d_name);
+      if (it != keys.end() && (it->second & key_type)) {
+        unlinkat(dirfd(d), de->d_name, 0);
+      }
+    }
+    closedir(d);
+  }
+  cache->invalidate();
+
+  fsync_dir(key_path);
+}
+
+// class Params::Transaction
+
+void Params::Transaction::put(const std::string &key, const std::string &val) {
+  staged_[key] = val;
+}
+
+void Params::Transaction::remove(const std::string &key) {
+  staged_[key] = std::nullopt;
+}
+
+int Params::Transaction::commit() {
+  if (staged_.empty()) return 0;
+
+  // The values are committed at once by swapping the <params>/d symlink to a new directory:
+  // 1) hardlink the values that don't change into a new directory
+  // 2) write the staged values to it
+  // 3) fsync the new directory once, instead of every value like put() does
+  // 4) swap the symlink and fsync the params directory
+  FileLock file_lock(params_.params_path + "/.lock");
+
+  const std::string key_path = params_.getParamPath();
+  char old_dir[PATH_MAX] = {};
+  if (!realpath(key_path.c_str(), old_dir)) return -1;
+
+  std::string tmp_path = params_.params_path + "/.tmp_XXXXXX";
+  if (!mkdtemp((char *)tmp_path.c_str())) return -1;
+  const std::string new_dir = tmp_path;
+
+  int result = 0;
+  if (DIR *d = opendir(old_dir)) {
+    while (struct dirent *de = readdir(d)) {
+      if (de->d_name[0] != '.' && staged_.find(de->d_name) == staged_.end()) {
+        if (linkat(dirfd(d), de->d_name, AT_FDCWD, (new_dir + "/" + de->d_name).c_str(), 0) != 0) {
+          result = -1;
+        }
+      }
+    }
+    closedir(d);
+  } else {
+    result = -1;
+  }
+
+  for (auto &[key, val] : staged_) {
+    if (result < 0) break;
+    if (!val) continue;
+
+    int fd = HANDLE_EINTR(open((new_dir + "/" + key).c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd < 0) {
+      result = -1;
+      break;
+    }
+    ssize_t bytes_written = HANDLE_EINTR(write(fd, val->data(), val->size()));
+    if (bytes_written < 0 || (size_t)bytes_written != val->size()) {
+      result = -20;
+    }
+    close(fd);
+  }
+  if (result == 0) result = fsync_dir(new_dir);
+
+  std::string link_path = new_dir + ".link";
+  if (result == 0 && (result = symlink(new_dir.c_str(), link_path.c_str())) == 0) {
+    if ((result = rename(link_path.c_str(), key_path.c_str())) == 0) {
+      result = fsync_dir(params_.params_path);
+    } else {
+      ::unlink(link_path.c_str());
+    }
+  }
+
+  // remove whichever directory is no longer linked
+  const std::string &unused_dir = result == 0 ? old_dir : new_dir;
+  if (DIR *d = opendir(unused_dir.c_str())) {
+    while (struct dirent *de = readdir(d)) {
+      if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+        unlinkat(dirfd(d), de->d_name, 0);
+      }
     }
+    closedir(d);
   }
+  rmdir(unused_dir.c_str());
 
-  fsync_dir(getParamPath());
+  params_.cache->invalidate();
+  staged_.clear();
+  return result;
 }
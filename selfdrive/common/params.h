@@ -1,6 +1,8 @@
 #pragma once
 
+#include <functional>
 #include <map>
+#include <optional>
 #include <string>
 
 enum ParamKeyType {
@@ -12,6 +14,8 @@ enum ParamKeyType {
   ALL = 0xFFFFFFFF
 };
 
+class ParamsCache;
+
 class Params {
 public:
   Params(const std::string &path = {});
@@ -25,13 +29,35 @@ public:
   int remove(const std::string &key);
   void clearAll(ParamKeyType type);
 
-  // helpers for reading values
-  std::string get(const std::string &key, bool block = false);
+  // helpers for reading values. non-blocking reads are served from a process-local cache.
+  // blocking reads wait until the key is written, a SIGINT/SIGTERM or timeout_ms (-1 waits forever)
+  std::string get(const std::string &key, bool block = false, int timeout_ms = -1);
   inline bool getBool(const std::string &key) {
     return get(key) == "1";
   }
   std::map<std::string, std::string> readAll();
 
+  // callback is called with the new value from a watcher thread whenever key changes.
+  // callbacks are not inherited by forked processes
+  int watch(const std::string &key, std::function<void(const std::string &)> callback);
+  void unwatch(int id);
+
+  // Stages writes and commits them atomically, by swapping in a new value directory. it takes two fsyncs,
+  // one of the new directory and one of the params directory, however many values are written
+  class Transaction {
+  public:
+    Transaction(Params &params) : params_(params) {}
+    void put(const std::string &key, const std::string &val);
+    inline void putBool(const std::string &key, bool val) { put(key, val ? "1" : "0"); }
+    void remove(const std::string &key);
+    // returns 0 on success, nothing is written otherwise
+    int commit();
+
+  private:
+    Params &params_;
+    std::map<std::string, std::optional<std::string>> staged_;  // values to write, nullopt to remove
+  };
+
   // helpers for writing values
   int put(const char *key, const char *val, size_t value_size);
   inline int put(const std::string &key, const std::string &val) {
@@ -43,4 +69,5 @@ public:
 
 private:
   std::string params_path;
+  ParamsCache *cache = nullptr;
 };
@@ -1,8 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <condition_variable>
+#include <cstdint>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 template <class T>
 class SafeQueue {
@@ -50,3 +63,156 @@ private:
   std::condition_variable cv;
   std::queue<T> q;
 };
+
+// Bounded lock-free multi-producer multi-consumer queue (Vyukov's ring of sequenced cells).
+// push and pop take no locks and don't allocate. a full queue doesn't block or grow: push
+// returns false and the overflow is counted, so the producer decides what to drop.
+// consumers that wait for an element sleep on a futex, producers only make a syscall if one is asleep.
+template <class T>
+class BoundedQueue {
+public:
+  // the capacity is rounded up to a power of 2
+  explicit BoundedQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+    mask = size - 1;
+    cells = std::make_unique<Cell[]>(size);
+    for (size_t i = 0; i < size; ++i) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  // returns false if the queue is full, v is left untouched
+  bool push(T &&v) {
+    Cell *cell;
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells[pos & mask];
+      const size_t seq = cell->seq.load(std::memory_order_acquire);
+      const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        overflow_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(v);
+    cell->seq.store(pos + 1, std::memory_order_release);
+
+    // only the first push after a consumer went to sleep makes a syscall
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint32_t state = sleep_state.load(std::memory_order_relaxed);
+    while (state & SLEEPING) {
+      if (sleep_state.compare_exchange_weak(state, state + 1)) {
+        wake();
+        break;
+      }
+    }
+    return true;
+  }
+
+  // waits up to timeout_ms for an element, -1 waits forever
+  bool try_pop(T &v, int timeout_ms = 0) {
+    if (pop_one(v)) return true;
+    if (timeout_ms == 0) return false;
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+      int64_t remaining_ns = -1;
+      if (timeout_ms > 0) {
+        remaining_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining_ns <= 0) return false;
+      }
+
+      // announce the sleep before checking the queue a last time, so a push in between wakes us
+      uint32_t state = sleep_state.load(std::memory_order_relaxed);
+      if (!(state & SLEEPING) && !sleep_state.compare_exchange_strong(state, state | SLEEPING)) continue;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (pop_one(v)) return true;
+
+      wait(state | SLEEPING, remaining_ns);
+      if (pop_one(v)) return true;
+    }
+  }
+
+  // pops up to max elements into out, waiting up to timeout_ms for the first one. returns the number popped
+  size_t pop_batch(T *out, size_t max, int timeout_ms = 0) {
+    if (max == 0 || !try_pop(out[0], timeout_ms)) return 0;
+
+    size_t n = 1;
+    while (n < max && pop_one(out[n])) ++n;
+    return n;
+  }
+
+  // approximate while producers or consumers are running
+  size_t size() const {
+    const size_t t = tail.load(std::memory_order_acquire);
+    const size_t h = head.load(std::memory_order_acquire);
+    return t > h ? t - h : 0;
+  }
+  bool empty() const { return size() == 0; }
+  size_t capacity() const { return mask + 1; }
+  // number of pushes rejected because the queue was full
+  uint64_t overflows() const { return overflow_count.load(std::memory_order_relaxed); }
+
+private:
+  bool pop_one(T &v) {
+    Cell *cell;
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells[pos & mask];
+      const size_t seq = cell->seq.load(std::memory_order_acquire);
+      const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+    v = std::move(cell->data);
+    cell->seq.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // sleeps until sleep_state changes from seen, or timeout_ns passed
+  void wait(uint32_t seen, int64_t timeout_ns) {
+#ifdef __linux__
+    struct timespec ts = {.tv_sec = (time_t)(timeout_ns / 1000000000), .tv_nsec = (long)(timeout_ns % 1000000000)};
+    syscall(SYS_futex, (uint32_t *)&sleep_state, FUTEX_WAIT_PRIVATE, seen, timeout_ns >= 0 ? &ts : nullptr, nullptr, 0);
+#else
+    if (sleep_state.load() == seen) {
+      const int64_t max_sleep_ns = 1000000;
+      std::this_thread::sleep_for(std::chrono::nanoseconds(timeout_ns >= 0 ? std::min(timeout_ns, max_sleep_ns) : max_sleep_ns));
+    }
+#endif
+  }
+
+  void wake() {
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)&sleep_state, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+  }
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  // producers and consumers touch different cache lines
+  alignas(64) std::atomic<size_t> tail = 0;
+  alignas(64) std::atomic<size_t> head = 0;
+  // futex word. the low bit is set while consumers sleep, producers clear it and bump the count to wake them
+  static const uint32_t SLEEPING = 1;
+  alignas(64) std::atomic<uint32_t> sleep_state = 0;
+  std::atomic<uint64_t> overflow_count = 0;
+};
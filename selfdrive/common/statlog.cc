@@ -3,41 +3,262 @@
 #endif
 
 #include "selfdrive/common/statlog.h"
-#include "selfdrive/common/util.h"
 
-#include <stdio.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <map>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <zmq.h>
 
-class StatlogState : public LogState {
-  public:
-    StatlogState() : LogState("ipc:///tmp/stats") {}
+#include "selfdrive/common/util.h"
+
+// Each thread records into its own shard, a fixed size table of metrics. A background
+// thread merges the shards every STATLOG_FLUSH_INTERVAL_MS and sends all metrics in one
+// packet, a line per metric. Recording a metric the thread has seen before doesn't allocate
+// and only takes the shard lock, which is contended while flushing.
+const int STATLOG_FLUSH_INTERVAL_MS = 5000;
+const size_t STATLOG_SHARD_SIZE = 128;  // metrics per thread, power of 2
+
+// inclusive upper bounds of the histogram buckets, the last bucket counts the samples above.
+// keep in sync with selfdrive/statsd.py
+const double STATLOG_HISTOGRAM_BOUNDS[] = {0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50,
+                                           100, 200, 500, 1000, 2000, 5000, 10000};
+const int STATLOG_HISTOGRAM_BUCKETS = std::size(STATLOG_HISTOGRAM_BOUNDS) + 1;
+
+enum class MetricType { GAUGE, COUNTER, HISTOGRAM };
+
+struct Metric {
+  MetricType type;
+  bool dirty = false;
+  double value = 0;  // last gauge value or counter sum
+  uint64_t count = 0;
+  double sum = 0, min = 0, max = 0;
+  uint32_t buckets[STATLOG_HISTOGRAM_BUCKETS] = {};
+
+  void record(double v) {
+    dirty = true;
+    if (type == MetricType::GAUGE) {
+      value = v;
+    } else if (type == MetricType::COUNTER) {
+      value += v;
+    } else {
+      min = count == 0 ? v : std::min(min, v);
+      max = count == 0 ? v : std::max(max, v);
+      sum += v;
+      ++count;
+      ++buckets[std::lower_bound(std::begin(STATLOG_HISTOGRAM_BOUNDS), std::end(STATLOG_HISTOGRAM_BOUNDS), v) - std::begin(STATLOG_HISTOGRAM_BOUNDS)];
+    }
+  }
+
+  void merge(const Metric &m) {
+    if (type == MetricType::GAUGE) {
+      value = m.value;
+    } else if (type == MetricType::COUNTER) {
+      value += m.value;
+    } else if (m.count > 0) {
+      min = count == 0 ? m.min : std::min(min, m.min);
+      max = count == 0 ? m.max : std::max(max, m.max);
+      sum += m.sum;
+      count += m.count;
+      for (int i = 0; i < STATLOG_HISTOGRAM_BUCKETS; ++i) buckets[i] += m.buckets[i];
+    }
+    dirty = true;
+  }
+
+  // gauges keep their value between flushes
+  void reset() {
+    dirty = false;
+    if (type != MetricType::GAUGE) {
+      value = sum = min = max = 0;
+      count = 0;
+      std::fill(std::begin(buckets), std::end(buckets), 0);
+    }
+  }
 };
 
-static StatlogState s = {};
+struct StatlogShard {
+  struct Slot {
+    uint64_t hash = 0;
+    std::string name;  // empty for a free slot
+    Metric metric;
+  };
 
-static void log(const char* metric_type, const char* metric, const char* fmt, ...) {
-  char* value_buf = nullptr;
-  va_list args;
-  va_start(args, fmt);
-  int ret = vasprintf(&value_buf, fmt, args);
-  va_end(args);
+  // open addressing, a thread doesn't get more than STATLOG_SHARD_SIZE metrics
+  Metric *find(const char *name, MetricType type) {
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+    for (const char *c = name; *c; ++c) {
+      hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+    }
+    for (size_t i = 0; i < STATLOG_SHARD_SIZE; ++i) {
+      Slot &slot = slots[(hash + i) & (STATLOG_SHARD_SIZE - 1)];
+      if (slot.name.empty()) {
+        slot.hash = hash;
+        slot.name = name;
+        slot.metric.type = type;
+        return &slot.metric;
+      } else if (slot.hash == hash && slot.metric.type == type && slot.name == name) {
+        return &slot.metric;
+      }
+    }
+    return nullptr;
+  }
 
-  if (ret > 0 && value_buf) {
-    char* line_buf = nullptr;
-    ret = asprintf(&line_buf, "%s:%s|%s", metric, value_buf, metric_type);
-    if (ret > 0 && line_buf) {
-      zmq_send(s.sock, line_buf, ret, ZMQ_NOBLOCK);
-      free(line_buf);
+  std::mutex lock;
+  std::vector<Slot> slots{STATLOG_SHARD_SIZE};
+  uint64_t dropped = 0;
+};
+
+class StatlogState {
+public:
+  StatlogState() : log("ipc:///tmp/stats") {
+    std::thread([this]() {
+      while (true) {
+        util::sleep_for(STATLOG_FLUSH_INTERVAL_MS);
+        flush();
+      }
+    }).detach();
+    std::atexit([]() { state().close(); });
+  }
+
+  // never destroyed, the flush thread and threads exiting late still use it
+  static StatlogState &state() {
+    static StatlogState *s = new StatlogState();
+    return *s;
+  }
+
+  void addShard(StatlogShard *shard) {
+    std::lock_guard lk(lock);
+    shards.push_back(shard);
+  }
+
+  // the metrics of an exiting thread are sent with the next flush
+  void removeShard(StatlogShard *shard) {
+    std::lock_guard lk(lock);
+    collect(shard);
+    shards.erase(std::remove(shards.begin(), shards.end(), shard), shards.end());
+  }
+
+  void flush() {
+    std::lock_guard lk(lock);
+    if (closed) return;
+
+    for (StatlogShard *shard : shards) {
+      collect(shard);
+    }
+
+    std::string packet;
+    char line[512];
+    for (auto &[name, m] : pending) {
+      if (!m.dirty) continue;
+
+      int len = 0;
+      if (m.type == MetricType::GAUGE) {
+        len = snprintf(line, sizeof(line), "%s:%f|g\n", name.c_str(), m.value);
+      } else if (m.type == MetricType::COUNTER) {
+        len = snprintf(line, sizeof(line), "%s:%f|c\n", name.c_str(), m.value);
+      } else {
+        // name:count;sum;min;max;bucket counts|h
+        len = snprintf(line, sizeof(line), "%s:%lu;%f;%f;%f", name.c_str(), (unsigned long)m.count, m.sum, m.min, m.max);
+        for (int i = 0; i < STATLOG_HISTOGRAM_BUCKETS && len < (int)sizeof(line); ++i) {
+          len += snprintf(line + len, sizeof(line) - len, ";%u", m.buckets[i]);
+        }
+        if (len < (int)sizeof(line)) {
+          len += snprintf(line + len, sizeof(line) - len, "|h\n");
+        }
+      }
+      if (len > 0 && len < (int)sizeof(line)) {
+        packet.append(line, len);
+      }
+      m.reset();
+    }
+    if (dropped > 0) {
+      packet += "statlog.dropped_metrics:" + std::to_string(dropped) + "|c\n";
+      dropped = 0;
+    }
+    if (!packet.empty()) {
+      zmq_send(log.sock, packet.data(), packet.size(), ZMQ_NOBLOCK);
+    }
+  }
+
+private:
+  // moves the metrics recorded by a thread since the last flush to pending. called with lock held
+  void collect(StatlogShard *shard) {
+    std::lock_guard shard_lk(shard->lock);
+    for (auto &slot : shard->slots) {
+      if (!slot.metric.dirty) continue;
+
+      auto it = pending.find(slot.name);
+      if (it == pending.end()) {
+        it = pending.emplace(slot.name, Metric{.type = slot.metric.type}).first;
+      }
+      it->second.merge(slot.metric);
+      slot.metric.reset();
     }
-    free(value_buf);
+    dropped += shard->dropped;
+    shard->dropped = 0;
+  }
+
+  // sends the last metrics at exit, the context lingers until they are delivered
+  void close() {
+    flush();
+    std::lock_guard lk(lock);
+    closed = true;
+    zmq_close(log.sock);
+    zmq_ctx_destroy(log.zctx);
+  }
+
+  std::mutex lock;
+  LogState log;
+  bool closed = false;
+  std::vector<StatlogShard *> shards;
+  std::map<std::string, Metric> pending;
+  uint64_t dropped = 0;
+};
+
+struct StatlogThreadShard {
+  StatlogThreadShard() { StatlogState::state().addShard(&shard); }
+  ~StatlogThreadShard() { StatlogState::state().removeShard(&shard); }
+  StatlogShard shard;
+};
+
+static void record(const char* metric_type, const char* metric, double value) {
+  MetricType type;
+  if (strcmp(metric_type, STATLOG_GAUGE) == 0) {
+    type = MetricType::GAUGE;
+  } else if (strcmp(metric_type, STATLOG_COUNTER) == 0) {
+    type = MetricType::COUNTER;
+  } else if (strcmp(metric_type, STATLOG_SAMPLE) == 0) {
+    type = MetricType::HISTOGRAM;
+  } else {
+    return;
+  }
+  if (!std::isfinite(value)) return;
+
+  static thread_local StatlogThreadShard thread_shard;
+  StatlogShard &shard = thread_shard.shard;
+  std::lock_guard lk(shard.lock);
+  if (Metric *m = shard.find(metric, type)) {
+    m->record(value);
+  } else {
+    ++shard.dropped;
   }
 }
 
 void statlog_log(const char* metric_type, const char* metric, int value) {
-  log(metric_type, metric, "%d", value);
+  record(metric_type, metric, value);
 }
 
 void statlog_log(const char* metric_type, const char* metric, float value) {
-  log(metric_type, metric, "%f", value);
+  record(metric_type, metric, value);
+}
+
+void statlog_flush() {
+  StatlogState::state().flush();
 }
@@ -2,9 +2,16 @@
 
 #define STATLOG_GAUGE "g"
 #define STATLOG_SAMPLE "sa"
+#define STATLOG_COUNTER "c"
 
+// Metrics are aggregated in the process and flushed to statsd in one packet every few seconds,
+// cheap enough for per frame paths. gauges keep the last value, counters are summed,
+// samples are collected in a histogram with fixed buckets.
 void statlog_log(const char* metric_type, const char* metric, int value);
 void statlog_log(const char* metric_type, const char* metric, float value);
+// sends the metrics recorded so far now, instead of with the next periodic flush
+void statlog_flush();
 
 #define statlog_gauge(metric, value) statlog_log(STATLOG_GAUGE, metric, value)
 #define statlog_sample(metric, value) statlog_log(STATLOG_SAMPLE, metric, value)
+#define statlog_count(metric, value) statlog_log(STATLOG_COUNTER, metric, value)
@@ -5,8 +5,10 @@
 #include "selfdrive/common/swaglog.h"
 
 #include <cassert>
+#include <cstdarg>
 #include <cstring>
 #include <mutex>
+#include <set>
 #include <string>
 
 #include <zmq.h>
@@ -16,15 +18,28 @@
 #include "selfdrive/common/version.h"
 #include "selfdrive/hardware/hw.h"
 
-class SwaglogState : public LogState {
- public:
-  SwaglogState() : LogState("ipc:///tmp/logmessage") {}
+// Log calls encode a binary record in a thread local buffer and send it on a thread local socket,
+// without locks or allocations. logmessaged converts the records to json.
+// | 0xff | levelnum | lineno | created | ctx, filename, funcname and msg lengths | ctx | filename | funcname | msg |
+const uint8_t SWAGLOG_BINARY_RECORD = 0xff;
+const size_t SWAGLOG_BUFFER_SIZE = 4096;
+
+struct __attribute__((packed)) SwaglogRecordHeader {
+  uint8_t marker;
+  uint8_t levelnum;
+  uint32_t lineno;
+  double created;
+  uint16_t ctx_len;
+  uint16_t filename_len;
+  uint16_t funcname_len;
+  uint32_t msg_len;
+};
 
-  bool initialized = false;
-  json11::Json::object ctx_j;
+class SwaglogState {
+ public:
+  SwaglogState() {
+    zctx = zmq_ctx_new();
 
-  inline void initialize() {
-    ctx_j = json11::Json::object {};
     print_level = CLOUDLOG_WARNING;
     const char* print_lvl = getenv("LOGPRINT");
     if (print_lvl) {
@@ -38,6 +53,7 @@ class SwaglogState : public LogState {
     }
 
     // openpilot bindings
+    json11::Json::object ctx_j;
     char* dongle_id = getenv("DONGLE_ID");
     if (dongle_id) {
       ctx_j["dongle_id"] = dongle_id;
@@ -57,45 +73,123 @@ class SwaglogState : public LogState {
     } else {
       ctx_j["device"] =  "pc";
     }
+    // the context doesn't change, it's serialized once
+    ctx = json11::Json(ctx_j).dump();
 
-    initialized = true;
+    std::atexit([]() { state().close(); });
   }
-};
 
-static SwaglogState s = {};
+  // initialized on first use, after the environment is set up. never destroyed,
+  // so threads still logging at exit don't touch a destroyed state
+  static SwaglogState &state() {
+    static SwaglogState *s = new SwaglogState();
+    return *s;
+  }
 
-static void log(int levelnum, const char* filename, int lineno, const char* func, const char* msg, const std::string& log_s) {
-  if (levelnum >= s.print_level) {
-    printf("%s: %s\n", filename, msg);
+  // opened by each thread on its first log call, and closed by that thread when it exits
+  void *openSocket() {
+    std::lock_guard lk(lock);
+    // the context may be terminated once closed
+    if (closed) return nullptr;
+
+    void *sock = zmq_socket(zctx, ZMQ_PUSH);
+    // Timeout on shutdown for messages to be received by the logging process
+    int timeout = 100;
+    zmq_setsockopt(sock, ZMQ_LINGER, &timeout, sizeof(timeout));
+    zmq_connect(sock, "ipc:///tmp/logmessage");
+    sockets.insert(sock);
+    return sock;
   }
-  char levelnum_c = levelnum;
-  zmq_send(s.sock, (levelnum_c + log_s).c_str(), log_s.length() + 1, ZMQ_NOBLOCK);
-}
+
+  void closeSocket(void *sock) {
+    std::lock_guard lk(lock);
+    if (sockets.erase(sock)) {
+      zmq_close(sock);
+    }
+  }
+
+  // called at exit, after the exiting thread closed its socket. zmq sockets aren't thread safe,
+  // so the sockets of the threads still running are left to them. zmq_ctx_term flushes the
+  // messages sent so far within the linger time, but it waits for all sockets to be closed,
+  // so it's only called when no other thread has one open
+  void close() {
+    closed = true;
+    std::lock_guard lk(lock);
+    if (sockets.empty()) {
+      zmq_ctx_term(zctx);
+    }
+  }
+
+  void *zctx;
+  int print_level;
+  std::string ctx;
+  std::atomic<bool> closed = false;
+
+ private:
+  // only taken when a thread opens or closes its socket
+  std::mutex lock;
+  std::set<void *> sockets;
+};
+
+// thread locals are destroyed before the atexit handlers run
+struct SwaglogThreadSocket {
+  ~SwaglogThreadSocket() {
+    if (sock) SwaglogState::state().closeSocket(sock);
+  }
+  void *sock = nullptr;
+};
+
+static thread_local SwaglogThreadSocket thread_socket;
+static thread_local char thread_buf[SWAGLOG_BUFFER_SIZE];
 
 void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func,
                 const char* fmt, ...) {
-  char* msg_buf = nullptr;
+  SwaglogState &s = SwaglogState::state();
+  if (s.closed) return;
+
+  SwaglogRecordHeader header = {
+    .marker = SWAGLOG_BINARY_RECORD,
+    .levelnum = (uint8_t)levelnum,
+    .lineno = (uint32_t)lineno,
+    .created = seconds_since_epoch(),
+    .ctx_len = (uint16_t)s.ctx.size(),
+    .filename_len = (uint16_t)strlen(filename),
+    .funcname_len = (uint16_t)strlen(func),
+  };
+  const size_t msg_offset = sizeof(header) + header.ctx_len + header.filename_len + header.funcname_len;
+
+  // format the message in place, messages too long for the thread buffer are formatted on the heap
+  char *buf = thread_buf;
+  std::string long_buf;
   va_list args;
   va_start(args, fmt);
-  int ret = vasprintf(&msg_buf, fmt, args);
+  int ret = msg_offset < SWAGLOG_BUFFER_SIZE ? vsnprintf(buf + msg_offset, SWAGLOG_BUFFER_SIZE - msg_offset, fmt, args) : -1;
   va_end(args);
+  if (ret < 0 || msg_offset + ret >= SWAGLOG_BUFFER_SIZE) {
+    va_start(args, fmt);
+    int len = vsnprintf(nullptr, 0, fmt, args);
+    va_end(args);
+    if (len < 0) return;
+
+    long_buf.resize(msg_offset + len + 1);
+    buf = long_buf.data();
+    va_start(args, fmt);
+    ret = vsnprintf(buf + msg_offset, len + 1, fmt, args);
+    va_end(args);
+  }
+  if (ret <= 0) return;
 
-  if (ret <= 0 || !msg_buf) return;
-
-  std::lock_guard lk(s.lock);
+  header.msg_len = ret;
+  char *p = buf;
+  memcpy(p, &header, sizeof(header));
+  memcpy(p += sizeof(header), s.ctx.data(), header.ctx_len);
+  memcpy(p += header.ctx_len, filename, header.filename_len);
+  memcpy(p += header.filename_len, func, header.funcname_len);
 
-  if (!s.initialized) s.initialize();
+  if (levelnum >= s.print_level) {
+    printf("%s: %s\n", filename, buf + msg_offset);
+  }
 
-  json11::Json log_j = json11::Json::object {
-    {"msg", msg_buf},
-    {"ctx", s.ctx_j},
-    {"levelnum", levelnum},
-    {"filename", filename},
-    {"lineno", lineno},
-    {"funcname", func},
-    {"created", seconds_since_epoch()}
-  };
-  std::string log_s = log_j.dump();
-  log(levelnum, filename, lineno, func, msg_buf, log_s);
-  free(msg_buf);
+  if (!thread_socket.sock && !(thread_socket.sock = s.openSocket())) return;
+  zmq_send(thread_socket.sock, buf, msg_offset + header.msg_len, ZMQ_NOBLOCK);
 }
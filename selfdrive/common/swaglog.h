@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+
 #include "selfdrive/common/timing.h"
 
 #define CLOUDLOG_DEBUG 10
@@ -17,33 +20,45 @@ void cloudlog_e(int levelnum, const char* filename, int lineno, const char* func
                                            __func__, \
                                            fmt, ## __VA_ARGS__)
 
-#define cloudlog_rl(burst, millis, lvl, fmt, ...)   \
-{                                                   \
-  static uint64_t __begin = 0;                      \
-  static int __printed = 0;                         \
-  static int __missed = 0;                          \
-                                                    \
-  int __burst = (burst);                            \
-  int __millis = (millis);                          \
-  uint64_t __ts = nanos_since_boot();               \
-                                                    \
-  if (!__begin) __begin = __ts;                     \
-                                                    \
-  if (__begin + __millis*1000000ULL < __ts) {       \
-    if (__missed) {                                 \
-      cloudlog(CLOUDLOG_WARNING, "cloudlog: %d messages suppressed", __missed); \
-    }                                               \
-    __begin = 0;                                    \
-    __printed = 0;                                  \
-    __missed = 0;                                   \
-  }                                                 \
-                                                    \
-  if (__printed < __burst) {                        \
-    cloudlog(lvl, fmt, ## __VA_ARGS__);             \
-    __printed++;                                    \
-  } else {                                          \
-    __missed++;                                     \
-  }                                                 \
+// per call site rate limit of cloudlog_rl, lock free so it's safe to share between threads.
+// the window start and both counts are one word, so a new window resets them atomically
+class CloudlogRateLimit {
+public:
+  // suppressed is set to the number of messages dropped in the previous window, once it's over
+  inline bool allow(int burst, int millis, int &suppressed) {
+    const uint32_t now = nanos_since_boot() / 1000000ULL;  // wraps every 49 days, only differences are used
+    uint64_t state = state_.load(std::memory_order_relaxed);
+    while (true) {
+      const uint32_t begin = state >> 32;
+      const uint32_t printed = (state >> 16) & 0xffff, missed = state & 0xffff;
+      const bool new_window = state == 0 || now - begin > (uint32_t)millis;
+      const uint32_t count = new_window ? 0 : printed;
+      const bool allowed = count < std::min<uint32_t>(burst, 0xffff);
+      const uint64_t next = (uint64_t)(new_window ? now : begin) << 32 |
+                            (uint64_t)(count + allowed) << 16 |
+                            (new_window ? !allowed : std::min<uint32_t>(missed + !allowed, 0xffff));
+      if (state_.compare_exchange_weak(state, next, std::memory_order_relaxed)) {
+        suppressed = new_window ? missed : 0;
+        return allowed;
+      }
+    }
+  }
+
+private:
+  // window start in ms << 32 | printed << 16 | missed
+  std::atomic<uint64_t> state_ = 0;
+};
+
+#define cloudlog_rl(burst, millis, lvl, fmt, ...)                                 \
+{                                                                                 \
+  static CloudlogRateLimit __rate_limit;                                          \
+  int __suppressed = 0;                                                           \
+  if (__rate_limit.allow((burst), (millis), __suppressed)) {                      \
+    cloudlog(lvl, fmt, ## __VA_ARGS__);                                           \
+  }                                                                               \
+  if (__suppressed) {                                                             \
+    cloudlog(CLOUDLOG_WARNING, "cloudlog: %d messages suppressed", __suppressed); \
+  }                                                                               \
 }
 
 #define LOGD(fmt, ...) cloudlog(CLOUDLOG_DEBUG, fmt, ## __VA_ARGS__)
@@ -0,0 +1,105 @@
+#define CATCH_CONFIG_MAIN
+
+#include <dirent.h>
+
+#include <string>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/common/clutil.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/hardware/hw.h"
+
+// runs on any OpenCL platform, pocl on PC. the cache is in $HOME/.comma/cl_cache on PC
+static const char *TEST_KERNEL = R"(
+__kernel void saxpy(__global const float *x, __global float *y, float a) {
+  const int i = get_global_id(0);
+  float v = y[i];
+  for (int j = 0; j < 16; ++j) {
+    v = a * x[i] + v * 0.5f;
+  }
+  y[i] = v;
+}
+)";
+
+static std::vector<std::string> cache_entries() {
+  std::vector<std::string> entries;
+  if (DIR *d = opendir(Path::cl_cache().c_str())) {
+    while (struct dirent *de = readdir(d)) {
+      if (de->d_name[0] != '.') entries.push_back(Path::cl_cache() + "/" + de->d_name);
+    }
+    closedir(d);
+  }
+  return entries;
+}
+
+// builds the test kernel, runs it on x = i, y = 1 and checks the output. returns the build time in ms
+static double build_and_run(cl_device_id device_id, cl_context ctx, const char *args) {
+  const double start = millis_since_boot();
+  cl_program prg = cl_program_from_source(ctx, device_id, TEST_KERNEL, args);
+  const double build_ms = millis_since_boot() - start;
+
+  const int N = 64;
+  std::vector<float> x(N), y(N, 1.0f);
+  for (int i = 0; i < N; ++i) x[i] = i;
+  cl_command_queue q = CL_CHECK_ERR(clCreateCommandQueue(ctx, device_id, 0, &err));
+  cl_mem x_cl = CL_CHECK_ERR(clCreateBuffer(ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, N * sizeof(float), x.data(), &err));
+  cl_mem y_cl = CL_CHECK_ERR(clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, N * sizeof(float), y.data(), &err));
+  cl_kernel krnl = CL_CHECK_ERR(clCreateKernel(prg, "saxpy", &err));
+  const float a = 2.0f;
+  CL_CHECK(clSetKernelArg(krnl, 0, sizeof(cl_mem), &x_cl));
+  CL_CHECK(clSetKernelArg(krnl, 1, sizeof(cl_mem), &y_cl));
+  CL_CHECK(clSetKernelArg(krnl, 2, sizeof(float), &a));
+  const size_t work_size = N;
+  CL_CHECK(clEnqueueNDRangeKernel(q, krnl, 1, NULL, &work_size, NULL, 0, NULL, NULL));
+  CL_CHECK(clEnqueueReadBuffer(q, y_cl, CL_TRUE, 0, N * sizeof(float), y.data(), 0, NULL, NULL));
+  for (int i = 0; i < N; ++i) {
+    float v = 1.0f;
+    for (int j = 0; j < 16; ++j) v = a * x[i] + v * 0.5f;
+    REQUIRE(y[i] == Approx(v));
+  }
+
+  clReleaseKernel(krnl);
+  clReleaseMemObject(x_cl);
+  clReleaseMemObject(y_cl);
+  clReleaseCommandQueue(q);
+  clReleaseProgram(prg);
+  return build_ms;
+}
+
+TEST_CASE("cl_program_from_source caches the binaries") {
+  setenv("HOME", "/tmp/test_clutil", 1);
+  system(("rm -rf " + Path::cl_cache()).c_str());
+
+  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  cl_context ctx = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+
+  const double cold_ms = build_and_run(device_id, ctx, "-DTEST_COLD");
+  const auto entries = cache_entries();
+  REQUIRE(entries.size() == 1);
+  const double warm_ms = build_and_run(device_id, ctx, "-DTEST_COLD");
+  REQUIRE(cache_entries() == entries);
+  WARN("build from source " << cold_ms << " ms, from the cached binary " << warm_ms << " ms");
+  REQUIRE(warm_ms < cold_ms);
+
+  SECTION("other args are another entry") {
+    build_and_run(device_id, ctx, "-DTEST_OTHER");
+    REQUIRE(cache_entries().size() == 2);
+  }
+  SECTION("corrupted entries are rebuilt") {
+    std::string dat = util::read_file(entries[0]);
+    dat[dat.size() / 2] ^= 0xff;
+    REQUIRE(util::write_file(entries[0].c_str(), dat.data(), dat.size(), O_WRONLY | O_TRUNC) == 0);
+    build_and_run(device_id, ctx, "-DTEST_COLD");
+    REQUIRE(util::read_file(entries[0]) != dat);
+  }
+  SECTION("truncated entries are rebuilt") {
+    const std::string dat = util::read_file(entries[0]);
+    REQUIRE(util::write_file(entries[0].c_str(), dat.data(), dat.size() / 2, O_WRONLY | O_TRUNC) == 0);
+    build_and_run(device_id, ctx, "-DTEST_COLD");
+    REQUIRE(util::read_file(entries[0]).size() > dat.size() / 2);
+  }
+
+  clReleaseContext(ctx);
+}
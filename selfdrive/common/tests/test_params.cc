@@ -0,0 +1,255 @@
+#define CATCH_CONFIG_MAIN
+
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/common/params.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+// the cache of a directory watches it for the rest of the process, so tests that rely on
+// the watcher get a directory of their own instead of a recreated one
+static std::string clean_params_dir(const std::string &name = "test_params") {
+  const std::string params_dir = "/tmp/" + name;
+  system(("rm -rf " + params_dir).c_str());
+  return params_dir;
+}
+
+// temporary files and value directories left behind, besides the one d links to
+static int stale_entries(const std::string &params_dir) {
+  char value_dir[PATH_MAX] = {};
+  REQUIRE(realpath((params_dir + "/d").c_str(), value_dir) != nullptr);
+  int count = 0;
+  for (const std::string dir : {params_dir, std::string(value_dir)}) {
+    DIR *d = opendir(dir.c_str());
+    REQUIRE(d != nullptr);
+    while (struct dirent *de = readdir(d)) {
+      const std::string path = dir + "/" + de->d_name;
+      count += path != value_dir && strncmp(de->d_name, ".tmp", 4) == 0;
+    }
+    closedir(d);
+  }
+  return count;
+}
+
+static std::vector<std::string> test_keys(int n) {
+  std::vector<std::string> keys;
+  for (int i = 0; i < n; ++i) {
+    keys.push_back("TestKey" + std::to_string(i));
+  }
+  return keys;
+}
+
+// waits up to a second for cond, the cache sees other writers once its watcher thread woke up
+template <typename F>
+static bool eventually(F cond) {
+  for (int i = 0; i < 1000 && !cond(); ++i) {
+    util::sleep_for(1);
+  }
+  return cond();
+}
+
+TEST_CASE("ParamsCache drops values written by another process") {
+  const std::string params_dir = clean_params_dir("test_params_cache");
+  Params params(params_dir);
+  params.put("TestKey", "old");
+  REQUIRE(params.get("TestKey") == "old");  // cached
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    Params(params_dir).put("TestKey", "new");
+    _exit(0);
+  }
+  REQUIRE(waitpid(pid, nullptr, 0) == pid);
+  REQUIRE(eventually([&]() { return params.get("TestKey") == "new"; }));
+
+  // and the ones removed by a transaction of another process
+  pid = fork();
+  if (pid == 0) {
+    Params child(params_dir);
+    Params::Transaction tx(child);
+    tx.remove("TestKey");
+    _exit(tx.commit());
+  }
+  int status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WEXITSTATUS(status) == 0);
+  REQUIRE(eventually([&]() { return params.get("TestKey").empty(); }));
+}
+
+TEST_CASE("Params::watch calls back when the value changes") {
+  const std::string params_dir = clean_params_dir("test_params_watch");
+  Params params(params_dir);
+  params.put("TestKey", "a");
+
+  std::mutex lock;
+  std::vector<std::string> values;
+  auto received = [&]() {
+    std::lock_guard lk(lock);
+    return values;
+  };
+  const int id = params.watch("TestKey", [&](const std::string &value) {
+    std::lock_guard lk(lock);
+    values.push_back(value);
+  });
+
+  params.put("TestKey", "b");
+  REQUIRE(eventually([&]() { return received() == std::vector<std::string>{"b"}; }));
+  // writing the same value again doesn't call back
+  params.put("TestKey", "b");
+  params.put("TestKeyOther", "b");
+  params.remove("TestKey");
+  REQUIRE(eventually([&]() { return received() == std::vector<std::string>{"b", ""}; }));
+
+  // nor does anything after unwatch. the next watcher's callback shows the watcher thread got there
+  params.unwatch(id);
+  std::atomic<bool> watched = false;
+  const int id2 = params.watch("TestKeyOther", [&](const std::string &) { watched = true; });
+  params.put("TestKey", "c");
+  params.put("TestKeyOther", "c");
+  REQUIRE(eventually([&]() { return (bool)watched; }));
+  REQUIRE(received() == std::vector<std::string>{"b", ""});
+  params.unwatch(id2);
+}
+
+TEST_CASE("ParamsCache stops caching in a forked child") {
+  const std::string params_dir = clean_params_dir("test_params_fork");
+  Params params(params_dir);
+  params.put("TestKey", "parent");
+  REQUIRE(params.get("TestKey") == "parent");  // cached
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the watcher thread isn't in the child, so the cache must not serve values it won't invalidate.
+    // the file is written behind its back, and a fresh Params of the child gets a working cache
+    const std::string path = params.getParamPath("TestKey");
+    bool ok = util::write_file(path.c_str(), "child1", 6) == 0 && params.get("TestKey") == "child1";
+    ok = ok && util::write_file(path.c_str(), "child2", 6) == 0 && params.get("TestKey") == "child2";
+    Params child(params_dir);
+    ok = ok && child.get("TestKey") == "child2";
+    ok = ok && child.put("TestKey", "child3") == 0 && child.get("TestKey") == "child3";
+    _exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WEXITSTATUS(status) == 0);
+  // the parent still caches, and sees the child's writes
+  REQUIRE(eventually([&]() { return params.get("TestKey") == "child3"; }));
+}
+
+TEST_CASE("A signal wakes a blocking get and reaches the process' own handler") {
+  const std::string params_dir = clean_params_dir("test_params_signal");
+  // in a child, the handlers it installs stay out of the other tests
+  pid_t pid = fork();
+  if (pid == 0) {
+    static volatile sig_atomic_t own_handler_calls = 0;
+    std::signal(SIGINT, [](int) { own_handler_calls++; });
+    Params params(params_dir);
+    std::thread([]() {
+      util::sleep_for(50);
+      kill(getpid(), SIGINT);
+    }).detach();
+    bool ok = params.get("TestKey", true).empty() && own_handler_calls == 1;
+    // still woken by the next signal, and without a blocking get it goes to the process' handler only
+    std::thread([]() {
+      util::sleep_for(50);
+      kill(getpid(), SIGINT);
+    }).detach();
+    ok = ok && params.get("TestKey", true).empty() && own_handler_calls == 2;
+    kill(getpid(), SIGINT);
+    ok = ok && own_handler_calls == 3;
+    _exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFEXITED(status));
+  REQUIRE(WEXITSTATUS(status) == 0);
+
+  // with the default action, a signal outside of a blocking get still terminates the process
+  pid = fork();
+  if (pid == 0) {
+    std::signal(SIGTERM, SIG_DFL);  // instead of catch's handler
+    Params params(params_dir);
+    params.get("TestKey", true, 10);
+    kill(getpid(), SIGTERM);
+    util::sleep_for(1000);
+    _exit(0);
+  }
+  REQUIRE(waitpid(pid, &status, 0) == pid);
+  REQUIRE(WIFSIGNALED(status));
+  REQUIRE(WTERMSIG(status) == SIGTERM);
+}
+
+TEST_CASE("Transaction commits puts and removes together") {
+  const std::string params_dir = clean_params_dir();
+  Params params(params_dir);
+  params.put("TestKeyKept", "kept");
+  params.put("TestKeyRemoved", "removed");
+  params.put("TestKeyChanged", "old");
+  REQUIRE(params.get("TestKeyChanged") == "old");  // cached
+
+  Params::Transaction tx(params);
+  tx.put("TestKeyChanged", "new");
+  tx.put("TestKeyAdded", "added");
+  tx.remove("TestKeyRemoved");
+  // nothing is visible before the commit
+  REQUIRE(params.get("TestKeyAdded").empty());
+  REQUIRE(params.get("TestKeyRemoved") == "removed");
+
+  REQUIRE(tx.commit() == 0);
+  REQUIRE(params.get("TestKeyKept") == "kept");
+  REQUIRE(params.get("TestKeyChanged") == "new");
+  REQUIRE(params.get("TestKeyAdded") == "added");
+  REQUIRE(params.get("TestKeyRemoved").empty());
+  // another process' view
+  REQUIRE(Params(params_dir).readAll() == std::map<std::string, std::string>{
+    {"TestKeyKept", "kept"}, {"TestKeyChanged", "new"}, {"TestKeyAdded", "added"}});
+  REQUIRE(stale_entries(params_dir) == 0);
+}
+
+TEST_CASE("Transaction of 50 keys vs individual puts", "[.][bench]") {
+  const int KEYS = 50, RUNS = 10;
+  const auto keys = test_keys(KEYS);
+  const std::string params_dir = clean_params_dir();
+  Params params(params_dir);
+
+  double puts_ms = 0, tx_ms = 0;
+  for (int run = 0; run < RUNS; ++run) {
+    const std::string value = "put" + std::to_string(run);
+    double start = millis_since_boot();
+    for (auto &key : keys) {
+      REQUIRE(params.put(key, value) == 0);
+    }
+    puts_ms += millis_since_boot() - start;
+    for (auto &key : keys) {
+      REQUIRE(params.get(key) == value);
+    }
+
+    const std::string tx_value = "tx" + std::to_string(run);
+    start = millis_since_boot();
+    Params::Transaction tx(params);
+    for (auto &key : keys) {
+      tx.put(key, tx_value);
+    }
+    REQUIRE(tx.commit() == 0);
+    tx_ms += millis_since_boot() - start;
+    for (auto &key : keys) {
+      REQUIRE(params.get(key) == tx_value);
+    }
+  }
+  REQUIRE(stale_entries(params_dir) == 0);
+
+  // on a tmpfs the fsyncs are free and both are about the same, so this only reports
+  WARN(KEYS << " keys: " << puts_ms / RUNS << " ms with individual puts, " << tx_ms / RUNS << " ms with one transaction");
+}
@@ -0,0 +1,118 @@
+#define CATCH_CONFIG_MAIN
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/common/queue.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+TEST_CASE("BoundedQueue push and pop") {
+  BoundedQueue<int> q(5);
+  REQUIRE(q.capacity() == 8);
+  REQUIRE(q.empty());
+
+  for (int i = 0; i < 8; ++i) {
+    REQUIRE(q.push(int(i)));
+  }
+  // full, nothing is dropped from the queue
+  REQUIRE_FALSE(q.push(8));
+  REQUIRE_FALSE(q.push(9));
+  REQUIRE(q.overflows() == 2);
+  REQUIRE(q.size() == 8);
+
+  int v = -1;
+  for (int i = 0; i < 8; ++i) {
+    REQUIRE(q.try_pop(v));
+    REQUIRE(v == i);
+  }
+  REQUIRE_FALSE(q.try_pop(v));
+
+  // waits for the timeout on an empty queue
+  const double start = millis_since_boot();
+  REQUIRE_FALSE(q.try_pop(v, 20));
+  REQUIRE(millis_since_boot() - start >= 19);
+
+  int batch[8] = {};
+  for (int i = 0; i < 3; ++i) q.push(int(i));
+  REQUIRE(q.pop_batch(batch, 8) == 3);
+  REQUIRE((batch[0] == 0 && batch[1] == 1 && batch[2] == 2));
+}
+
+TEST_CASE("BoundedQueue wakes a waiting consumer") {
+  BoundedQueue<int> q(4);
+  std::thread producer([&]() {
+    util::sleep_for(20);
+    q.push(1);
+  });
+  int v = 0;
+  REQUIRE(q.try_pop(v, -1));
+  REQUIRE(v == 1);
+  producer.join();
+}
+
+// every producer pushes its own increasing sequence, the consumers check that each element
+// arrives exactly once, and in order per producer
+static void test_mpmc(int producers, int consumers, int capacity, int per_producer) {
+  struct Element {
+    int producer;
+    int seq;
+  };
+  BoundedQueue<Element> q(capacity);
+  std::atomic<int> popped = 0;
+  const int total = producers * per_producer;
+
+  std::vector<std::thread> threads;
+  std::vector<std::vector<int>> received(consumers, std::vector<int>(producers, 0));
+  std::vector<int> in_order(consumers, true);  // not vector<bool>, the consumers write their own element
+  const double start = millis_since_boot();
+  for (int c = 0; c < consumers; ++c) {
+    threads.emplace_back([&, c]() {
+      std::vector<int> last(producers, -1);
+      Element batch[16];
+      while (popped < total) {
+        // alternate single pops and batches
+        size_t n = c % 2 ? q.pop_batch(batch, std::size(batch), 10) : q.try_pop(batch[0], 10);
+        for (size_t i = 0; i < n; ++i) {
+          auto &e = batch[i];
+          in_order[c] = in_order[c] && e.seq > last[e.producer];
+          last[e.producer] = e.seq;
+          received[c][e.producer]++;
+        }
+        popped += n;
+      }
+    });
+  }
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p]() {
+      for (int i = 0; i < per_producer; ++i) {
+        // the producer decides what to do with a full queue, here it retries
+        while (!q.push({p, i})) std::this_thread::yield();
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+  const double elapsed_ms = millis_since_boot() - start;
+
+  REQUIRE(popped == total);
+  REQUIRE(q.empty());
+  for (int p = 0; p < producers; ++p) {
+    int count = 0;
+    for (int c = 0; c < consumers; ++c) {
+      REQUIRE(in_order[c]);
+      count += received[c][p];
+    }
+    REQUIRE(count == per_producer);
+  }
+  WARN(producers << "P" << consumers << "C: " << total / elapsed_ms * 1000 << " elements/s, " << q.overflows() << " full pushes retried");
+}
+
+TEST_CASE("BoundedQueue 1 producer 1 consumer") {
+  test_mpmc(1, 1, 64, 200000);
+}
+
+TEST_CASE("BoundedQueue 4 producers 4 consumers") {
+  test_mpmc(4, 4, 64, 50000);
+}
@@ -0,0 +1,108 @@
+#define CATCH_CONFIG_MAIN
+
+#include <zmq.h>
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/common/statlog.h"
+
+// takes the place of statsd, returns the lines of the packets sent by a flush by metric name
+class StatsReceiver {
+public:
+  StatsReceiver() {
+    ctx = zmq_ctx_new();
+    sock = zmq_socket(ctx, ZMQ_PULL);
+    int timeout = 100;
+    zmq_setsockopt(sock, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    REQUIRE(zmq_bind(sock, "ipc:///tmp/stats") == 0);
+    // statlog drops the packets sent before it's connected
+    for (int i = 0; i < 10 && flush().count("test.connected") == 0; ++i) {
+      statlog_gauge("test.connected", 1);
+    }
+  }
+  ~StatsReceiver() {
+    zmq_close(sock);
+    zmq_ctx_destroy(ctx);
+  }
+
+  std::map<std::string, std::string> flush() {
+    statlog_flush();
+    std::map<std::string, std::string> metrics;
+    char buf[65536];
+    for (int len; (len = zmq_recv(sock, buf, sizeof(buf), 0)) > 0;) {
+      std::istringstream packet(std::string(buf, std::min<int>(len, sizeof(buf))));
+      for (std::string line; std::getline(packet, line);) {
+        metrics[line.substr(0, line.find(':'))] = line.substr(line.find(':') + 1);
+      }
+    }
+    return metrics;
+  }
+
+private:
+  void *ctx, *sock;
+};
+
+static StatsReceiver &receiver() {
+  static StatsReceiver r;
+  return r;
+}
+
+TEST_CASE("statlog merges the shards of all threads") {
+  receiver().flush();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([i]() {
+      for (int j = 0; j < 100; ++j) {
+        statlog_count("test.merge_counter", 1);
+        statlog_sample("test.merge_sample", (float)(i * 100 + j));
+      }
+    });
+  }
+  // the exiting threads hand their metrics over, to the next flush
+  for (auto &t : threads) t.join();
+  statlog_gauge("test.merge_gauge", 3);
+  statlog_gauge("test.merge_gauge", 4);
+
+  auto metrics = receiver().flush();
+  REQUIRE(metrics["test.merge_counter"] == "400.000000|c");
+  REQUIRE(metrics["test.merge_gauge"] == "4.000000|g");
+  // count;sum;min;max, 0..399
+  REQUIRE(metrics["test.merge_sample"].rfind("400;79800.000000;0.000000;399.000000;", 0) == 0);
+
+  // counters and samples start over, gauges are only sent again once they're set
+  statlog_count("test.merge_counter", 2);
+  metrics = receiver().flush();
+  REQUIRE(metrics["test.merge_counter"] == "2.000000|c");
+  REQUIRE(metrics.count("test.merge_sample") == 0);
+  REQUIRE(metrics.count("test.merge_gauge") == 0);
+}
+
+TEST_CASE("statlog histogram buckets") {
+  receiver().flush();
+  // bucket bounds are inclusive, the last bucket counts the samples above 10000
+  for (float v : {0.0f, 0.01f, 0.015f, 1.0f, 1.5f, 10000.0f, 20000.0f, -5.0f}) {
+    statlog_sample("test.buckets", v);
+  }
+  statlog_sample("test.buckets", 7);  // int overload
+
+  auto metrics = receiver().flush();
+  std::vector<std::string> fields;
+  std::istringstream value(metrics["test.buckets"]);
+  for (std::string f; std::getline(value, f, ';');) {
+    fields.push_back(f);
+  }
+  REQUIRE(fields.size() == 4 + 20);
+  REQUIRE(fields[0] == "9");
+  REQUIRE(fields[2] == "-5.000000");
+  REQUIRE(fields[3] == "20000.000000");
+  std::vector<std::string> buckets(fields.begin() + 4, fields.end());
+  REQUIRE(buckets.back() == "1|h");
+  buckets.back() = "1";
+  //                                    0.01 .02  .05  0.1  0.2  0.5   1    2    5   10   20   50  100  200  500   1k   2k   5k  10k  inf
+  REQUIRE(buckets == std::vector<std::string>{"3", "1", "0", "0", "0", "0", "1", "1", "0", "1", "0", "0", "0", "0", "0", "0", "0", "0", "1", "1"});
+}
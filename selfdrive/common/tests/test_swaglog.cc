@@ -0,0 +1,54 @@
+#define CATCH_CONFIG_MAIN
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/util.h"
+
+TEST_CASE("CloudlogRateLimit allows a burst per window") {
+  CloudlogRateLimit rl;
+  int suppressed = -1;
+  for (int i = 0; i < 2; ++i) {
+    REQUIRE(rl.allow(2, 100, suppressed));
+    REQUIRE(suppressed == 0);
+  }
+  for (int i = 0; i < 5; ++i) {
+    REQUIRE(!rl.allow(2, 100, suppressed));
+    REQUIRE(suppressed == 0);
+  }
+  // the first message of the next window reports the dropped ones, once
+  util::sleep_for(150);
+  REQUIRE(rl.allow(2, 100, suppressed));
+  REQUIRE(suppressed == 5);
+  REQUIRE(rl.allow(2, 100, suppressed));
+  REQUIRE(suppressed == 0);
+}
+
+TEST_CASE("CloudlogRateLimit shared between threads") {
+  const int threads = 8, calls = 1000, burst = 10;
+  CloudlogRateLimit rl;
+  std::atomic<int> allowed = 0, suppressed_total = 0;
+  std::vector<std::thread> ts;
+  for (int i = 0; i < threads; ++i) {
+    ts.emplace_back([&]() {
+      for (int j = 0; j < calls; ++j) {
+        int suppressed = 0;
+        allowed += rl.allow(burst, 10000, suppressed);
+        suppressed_total += suppressed;
+      }
+    });
+  }
+  for (auto &t : ts) t.join();
+  // one window: no more than the burst gets through, and every other call is counted as missed
+  REQUIRE(allowed == burst);
+  REQUIRE(suppressed_total == 0);
+
+  // the first call after the window reports every call the other threads missed
+  int suppressed = 0;
+  util::sleep_for(2);
+  REQUIRE(rl.allow(burst, 0, suppressed));
+  REQUIRE(suppressed == threads * calls - burst);
+}
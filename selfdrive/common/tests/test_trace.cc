@@ -0,0 +1,92 @@
+#define CATCH_CONFIG_MAIN
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/trace.h"
+
+static std::string buffer_path(pid_t pid) {
+  return TRACE_SHM_PREFIX + std::to_string(pid);
+}
+
+static bool exists(const std::string &path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+// a forked child traces into the buffer of its parent, so this runs before the test process traces
+TEST_CASE("trace buffers are left behind at exit only while traced runs") {
+  auto run_child = []() {
+    pid_t pid = fork();
+    if (pid == 0) {
+      { TRACE_SCOPE("child"); }
+      exit(exists(buffer_path(getpid())) ? 0 : 1);
+    }
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WEXITSTATUS(status) == 0);
+    return pid;
+  };
+
+  // hold the lock like traced does
+  int lock_fd = open(TRACED_LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+  REQUIRE(lock_fd >= 0);
+  REQUIRE(flock(lock_fd, LOCK_EX | LOCK_NB) == 0);
+  pid_t pid = run_child();
+  REQUIRE(exists(buffer_path(pid)));
+  unlink(buffer_path(pid).c_str());
+
+  close(lock_fd);
+  pid = run_child();
+  REQUIRE(!exists(buffer_path(pid)));
+}
+
+TEST_CASE("trace rings of exited threads are taken over by new threads") {
+  { TRACE_SCOPE("main"); }
+  int fd = open(buffer_path(getpid()).c_str(), O_RDONLY);
+  REQUIRE(fd >= 0);
+  void *p = mmap(nullptr, sizeof(TraceBuffer), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  REQUIRE(p != MAP_FAILED);
+  const TraceBuffer *b = (const TraceBuffer *)p;
+
+  // more threads than rings, one after the other
+  const int threads = TRACE_MAX_THREADS * 2;
+  for (int i = 0; i < threads; ++i) {
+    std::thread([]() { TRACE_SCOPE("thread"); }).join();
+  }
+  REQUIRE(b->num_threads == 2);
+  const TraceRing &ring = b->rings[1];
+  REQUIRE(ring.generation == threads * 2);
+  REQUIRE(ring.head == threads);
+  REQUIRE(ring.start == threads - 1);  // the last thread wrote one event
+  munmap(p, sizeof(TraceBuffer));
+}
+
+TEST_CASE("trace span overhead", "[.][bench]") {
+  const int spans = 1000000;
+  { TRACE_SCOPE("warmup"); }
+
+  uint64_t start = nanos_since_boot();
+  for (int i = 0; i < spans; ++i) {
+    TRACE_SCOPE("bench");
+  }
+  const double span_ns = (double)(nanos_since_boot() - start) / spans;
+
+  start = nanos_since_boot();
+  uint64_t sum = 0;
+  for (int i = 0; i < spans; ++i) {
+    sum += nanos_since_boot();
+  }
+  const double clock_ns = (double)(nanos_since_boot() - start) / spans;
+  printf("%.1f ns/span, of which clock reads %.1f ns (%lu)\n", span_ns, clock_ns * 2, sum & 1);
+  CHECK(span_ns < 50);
+}
@@ -0,0 +1,85 @@
+#define CATCH_CONFIG_MAIN
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/common/util.h"
+
+const std::string TEST_FILE = "/tmp/test_util_sysfs";
+
+TEST_CASE("util::read_file") {
+  SECTION("regular file") {
+    std::string data(10000, '\0');
+    for (size_t i = 0; i < data.size(); ++i) data[i] = 'a' + i % 26;
+    REQUIRE(util::write_file(TEST_FILE.c_str(), data.data(), data.size(), O_WRONLY | O_CREAT | O_TRUNC) == 0);
+    REQUIRE(util::read_file(TEST_FILE) == data);
+    unlink(TEST_FILE.c_str());
+    REQUIRE(util::read_file(TEST_FILE).empty());
+  }
+  SECTION("procfs files have no size") {
+    struct stat st;
+    REQUIRE(stat("/proc/self/status", &st) == 0);
+    REQUIRE(st.st_size == 0);
+    // read to the end, not up to a size
+    const std::string status = util::read_file("/proc/self/status");
+    REQUIRE(status.rfind("Name:", 0) == 0);
+    REQUIRE(status.find("nonvoluntary_ctxt_switches") != std::string::npos);
+    REQUIRE(status.back() == '\n');
+  }
+}
+
+TEST_CASE("util::SysfsReader") {
+  auto write = [](const std::string &s) {
+    // rewritten in place, like sysfs attributes change under an open file
+    REQUIRE(util::write_file(TEST_FILE.c_str(), s.data(), s.size(), O_WRONLY | O_CREAT | O_TRUNC) == 0);
+  };
+
+  SECTION("reads the current contents of an open file") {
+    write("42\n");
+    util::SysfsReader reader(TEST_FILE);
+    REQUIRE(reader.read() == "42\n");
+    REQUIRE(reader.readInt() == 42);
+    write("-7");
+    REQUIRE(reader.readInt() == -7);
+    write("3.5\n");
+    REQUIRE(reader.readFloat() == 3.5);
+    REQUIRE(reader.readInt() == 3);
+    write("abc\n");
+    REQUIRE(reader.readInt() == std::nullopt);
+    REQUIRE(reader.readFloat() == std::nullopt);
+    write("");
+    REQUIRE(reader.read().empty());
+    REQUIRE(reader.readInt() == std::nullopt);
+  }
+
+  SECTION("reopens the file after a failed read") {
+    unlink(TEST_FILE.c_str());
+    util::SysfsReader reader(TEST_FILE);
+    REQUIRE(reader.readInt() == std::nullopt);
+    write("1");
+    REQUIRE(reader.readInt() == 1);
+
+    // a read of a directory fails, and a file in its place is opened again
+    unlink(TEST_FILE.c_str());
+    REQUIRE(mkdir(TEST_FILE.c_str(), 0755) == 0);
+    util::SysfsReader dir_reader(TEST_FILE);
+    REQUIRE(dir_reader.read().empty());
+    REQUIRE(rmdir(TEST_FILE.c_str()) == 0);
+    write("2");
+    REQUIRE(dir_reader.readInt() == 2);
+  }
+
+  SECTION("procfs") {
+    util::SysfsReader reader("/proc/self/status");
+    const std::string status(reader.read());
+    REQUIRE(status.rfind("Name:", 0) == 0);
+    REQUIRE(status.find("nonvoluntary_ctxt_switches") != std::string::npos);
+    // contents that don't fit the buffer are cut off
+    util::SysfsReader small_reader("/proc/self/status", 16);
+    REQUIRE(small_reader.read() == status.substr(0, 15));
+  }
+  unlink(TEST_FILE.c_str());
+}
@@ -0,0 +1,130 @@
+#include "selfdrive/common/trace.h"
+
+#ifdef ENABLE_TRACE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "selfdrive/common/util.h"
+
+thread_local TraceRing *trace_ring = nullptr;
+static thread_local bool trace_ring_failed = false;
+
+static std::mutex trace_lock;
+static std::vector<uint32_t> &free_rings = *new std::vector<uint32_t>;  // of exited threads, outlives their destructors
+
+// hands the ring of a thread back when it exits
+struct TraceRingOwner {
+  uint32_t idx = TRACE_MAX_THREADS;
+  ~TraceRingOwner() {
+    if (idx < TRACE_MAX_THREADS) {
+      std::lock_guard lk(trace_lock);
+      free_rings.push_back(idx);
+    }
+    trace_ring = nullptr;
+    trace_ring_failed = true;  // spans of later thread_local destructors are dropped
+  }
+};
+static thread_local TraceRingOwner trace_ring_owner;
+
+static std::string trace_buffer_path() {
+  return TRACE_SHM_PREFIX + std::to_string(getpid());
+}
+
+// the file is left behind for traced to read the last events, if it's running
+static void trace_buffer_cleanup() {
+  int fd = open(TRACED_LOCK_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || flock(fd, LOCK_SH | LOCK_NB) == 0) {
+    unlink(trace_buffer_path().c_str());
+  }
+  if (fd >= 0) close(fd);
+}
+
+// created on first use
+static TraceBuffer *trace_buffer() {
+  static TraceBuffer *buffer = []() -> TraceBuffer * {
+    const std::string fn = trace_buffer_path();
+    int fd = open(fn.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0) return nullptr;
+
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, sizeof(TraceBuffer)) == 0) {
+      p = mmap(nullptr, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+      unlink(fn.c_str());
+      return nullptr;
+    }
+
+    // the file is zero filled, name 0 is for names that didn't fit
+    TraceBuffer *b = (TraceBuffer *)p;
+    b->pid = getpid();
+    std::string comm = util::read_file("/proc/self/comm");
+    comm.erase(std::remove(comm.begin(), comm.end(), '\n'), comm.end());
+    strncpy(b->process_name, comm.c_str(), sizeof(b->process_name) - 1);
+    strncpy(b->names[0], "unknown", TRACE_NAME_LEN - 1);
+    b->num_names.store(1, std::memory_order_release);
+    b->magic.store(TRACE_MAGIC, std::memory_order_release);
+    atexit(trace_buffer_cleanup);
+    return b;
+  }();
+  return buffer;
+}
+
+uint32_t trace_name_id(const char *name) {
+  TraceBuffer *b = trace_buffer();
+  if (!b) return 0;
+
+  std::lock_guard lk(trace_lock);
+  const uint32_t id = b->num_names.load(std::memory_order_relaxed);
+  if (id >= TRACE_MAX_NAMES) return 0;
+
+  strncpy(b->names[id], name, TRACE_NAME_LEN - 1);
+  b->num_names.store(id + 1, std::memory_order_release);
+  return id;
+}
+
+TraceRing *trace_thread_ring() {
+  if (trace_ring_failed) return nullptr;
+
+  TraceBuffer *b = trace_buffer();
+  std::lock_guard lk(trace_lock);
+  uint32_t idx = b ? b->num_threads.load(std::memory_order_relaxed) : TRACE_MAX_THREADS;
+  if (b && !free_rings.empty()) {
+    idx = free_rings.back();
+    free_rings.pop_back();
+  } else if (idx >= TRACE_MAX_THREADS) {
+    trace_ring_failed = true;
+    return nullptr;
+  }
+
+  TraceRing *ring = &b->rings[idx];
+  const uint32_t generation = ring->generation.load(std::memory_order_relaxed);
+  ring->generation.store(generation + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  ring->start = ring->head.load(std::memory_order_relaxed);
+  ring->tid = syscall(SYS_gettid);
+  memset(ring->thread_name, 0, sizeof(ring->thread_name));
+  pthread_getname_np(pthread_self(), ring->thread_name, sizeof(ring->thread_name));
+  ring->generation.store(generation + 2, std::memory_order_release);
+  if (idx == b->num_threads.load(std::memory_order_relaxed)) {
+    b->num_threads.store(idx + 1, std::memory_order_release);
+  }
+  trace_ring_owner.idx = idx;
+  trace_ring = ring;
+  return ring;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "selfdrive/common/timing.h"
+
+// Hot path tracing across processes. Spans are written to per thread rings in a shared memory
+// buffer per process (/dev/shm/trace_<pid>), selfdrive/traced collects them into a chrome trace.
+// the buffer is removed at exit, unless traced is running to read the last events.
+// Build with scons --trace to enable it, otherwise TRACE_SCOPE compiles to nothing.
+//
+//   bool CameraBuf::acquire() {
+//     TRACE_SCOPE("camera_acquire");
+//     ...
+//   }
+//
+// names must be string literals, each call site registers its name once.
+
+#define TRACE_SHM_PREFIX "/dev/shm/trace_"  // + <pid>
+#define TRACED_LOCK_PATH "/dev/shm/traced.lock"  // held by traced while it runs
+const uint32_t TRACE_MAGIC = 0x31435254;       // "TRC1"
+const int TRACE_MAX_THREADS = 64;
+const int TRACE_MAX_NAMES = 1024;
+const int TRACE_NAME_LEN = 48;
+const uint64_t TRACE_RING_SIZE = 4096;  // power of 2
+
+struct TraceEvent {
+  uint64_t start_ns;
+  uint32_t duration_ns;
+  uint32_t name_id;
+};
+
+// written by a single thread. head counts the events written, the event at head is
+// written before head is incremented, so readers drop the events the writer lapped.
+// the ring of an exited thread is taken over by the next new thread, which bumps generation
+// (odd while tid, thread_name and start are rewritten) and writes its events from head start on.
+struct TraceRing {
+  std::atomic<uint64_t> head;
+  std::atomic<uint32_t> generation;
+  uint64_t start;
+  int32_t tid;
+  char thread_name[16];
+  TraceEvent events[TRACE_RING_SIZE];
+};
+
+// rings and names are appended, readers only look at the first num_threads and num_names
+struct TraceBuffer {
+  std::atomic<uint32_t> magic;
+  int32_t pid;
+  char process_name[16];
+  std::atomic<uint32_t> num_threads;
+  std::atomic<uint32_t> num_names;
+  char names[TRACE_MAX_NAMES][TRACE_NAME_LEN];
+  TraceRing rings[TRACE_MAX_THREADS];
+};
+
+#ifdef ENABLE_TRACE
+
+// returns the id of name in this process' buffer. 0 if there is no room left
+uint32_t trace_name_id(const char *name);
+// returns the ring of the calling thread, nullptr if tracing isn't available
+TraceRing *trace_thread_ring();
+
+extern thread_local TraceRing *trace_ring;
+
+inline void trace_span(uint32_t name_id, uint64_t start_ns, uint64_t end_ns) {
+  TraceRing *ring = trace_ring ? trace_ring : trace_thread_ring();
+  if (!ring) return;
+
+  const uint64_t head = ring->head.load(std::memory_order_relaxed);
+  ring->events[head & (TRACE_RING_SIZE - 1)] = {start_ns, (uint32_t)(end_ns - start_ns), name_id};
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+class TraceScope {
+public:
+  explicit TraceScope(uint32_t name_id) : name_id(name_id), start_ns(nanos_since_boot()) {}
+  ~TraceScope() { trace_span(name_id, start_ns, nanos_since_boot()); }
+
+private:
+  const uint32_t name_id;
+  const uint64_t start_ns;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name)                                                                 \
+  static const uint32_t TRACE_CONCAT(trace_name_, __LINE__) = trace_name_id(name);       \
+  TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(TRACE_CONCAT(trace_name_, __LINE__))
+
+#else
+
+#define TRACE_SCOPE(name)
+
+#endif
@@ -59,26 +59,30 @@ int set_core_affinity(std::vector<int> cores) {
 }
 
 std::string read_file(const std::string& fn) {
-  std::ifstream f(fn, std::ios::binary | std::ios::in);
-  if (f.is_open()) {
-    f.seekg(0, std::ios::end);
-    int size = f.tellg();
-    if (f.good() && size > 0) {
-      std::string result(size, '\0');
-      f.seekg(0, std::ios::beg);
-      f.read(result.data(), size);
-      // return either good() or has reached end-of-file (e.g. /sys/power/wakeup_count)
-      if (f.good() || f.eof()) {
-        result.resize(f.gcount());
-        return result;
-      }
+  int fd = HANDLE_EINTR(open(fn.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd == -1) {
+    return std::string();
+  }
+
+  // files created on read, e.g. procfs, have no size. read those until eof
+  struct stat st;
+  const bool known_size = fstat(fd, &st) == 0 && st.st_size > 0;
+  std::string result(known_size ? st.st_size : 4096, '\0');
+  size_t len = 0;
+  while (true) {
+    ssize_t n = HANDLE_EINTR(read(fd, result.data() + len, result.size() - len));
+    if (n <= 0) break;
+
+    len += n;
+    if (len == result.size()) {
+      if (known_size) break;
+      result.resize(result.size() * 2);
     }
-    // fallback for files created on read, e.g. procfs
-    std::stringstream buffer;
-    buffer << f.rdbuf();
-    return buffer.str();
   }
-  return std::string();
+  close(fd);
+  // sysfs files report a size larger than their contents, e.g. /sys/power/wakeup_count
+  result.resize(len);
+  return result;
 }
 
 std::map<std::string, std::string> read_files_in_dir(const std::string &path) {
@@ -179,6 +183,58 @@ bool create_directories(const std::string& dir, mode_t mode) {
   return createDirectory(dir, mode);
 }
 
+SysfsReader::SysfsReader(const std::string &path, size_t buffer_size)
+    : path(path), buffer_size(buffer_size), buffer(std::make_unique<char[]>(buffer_size)) {}
+
+SysfsReader::~SysfsReader() {
+  if (fd != -1) close(fd);
+}
+
+std::string_view SysfsReader::read() {
+  if (fd == -1) {
+    fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) return {};
+  }
+
+  // sysfs and procfs generate the contents again on a read from offset 0.
+  // one byte is kept for the terminator of the parse helpers
+  size_t len = 0;
+  while (len < buffer_size - 1) {
+    ssize_t n = HANDLE_EINTR(pread(fd, buffer.get() + len, buffer_size - 1 - len, len));
+    if (n == 0) break;
+    if (n < 0) {
+      close(fd);
+      fd = -1;
+      return {};
+    }
+    len += n;
+  }
+  buffer[len] = '\0';
+  return std::string_view(buffer.get(), len);
+}
+
+std::optional<int64_t> SysfsReader::readInt() {
+  std::string_view s = read();
+  if (s.empty()) return std::nullopt;
+
+  char *end = nullptr;
+  errno = 0;
+  const int64_t v = strtoll(s.data(), &end, 10);
+  if (end == s.data() || errno != 0) return std::nullopt;
+  return v;
+}
+
+std::optional<double> SysfsReader::readFloat() {
+  std::string_view s = read();
+  if (s.empty()) return std::nullopt;
+
+  char *end = nullptr;
+  errno = 0;
+  const double v = strtod(s.data(), &end);
+  if (end == s.data() || errno != 0) return std::nullopt;
+  return v;
+}
+
 std::string getenv(const char* key, const char* default_val) {
   const char* val = ::getenv(key);
   return val ? val : default_val;
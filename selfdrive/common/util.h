@@ -13,7 +13,9 @@
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -90,6 +92,28 @@ std::string readlink(const std::string& path);
 bool file_exists(const std::string& fn);
 bool create_directories(const std::string &dir, mode_t mode);
 
+// Reads a sysfs or procfs file over and over, e.g. in a polling loop. The file stays open and
+// each read is a pread into a fixed buffer, so reads don't allocate. A file that can't be read
+// is reopened on the next read.
+class SysfsReader {
+public:
+  explicit SysfsReader(const std::string &path, size_t buffer_size = 4096);
+  ~SysfsReader();
+  SysfsReader(const SysfsReader &) = delete;
+  SysfsReader &operator=(const SysfsReader &) = delete;
+
+  // returns the current contents, valid until the next read. empty on error
+  std::string_view read();
+  std::optional<int64_t> readInt();
+  std::optional<double> readFloat();
+
+private:
+  const std::string path;
+  int fd = -1;
+  const size_t buffer_size;
+  std::unique_ptr<char[]> buffer;
+};
+
 std::string check_output(const std::string& command);
 
 inline void sleep_for(const int milliseconds) {
@@ -1,3 +1,29 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+
+// Processes kick the watchdog through a table in shared memory, with one slot per process.
+// A kick stores the time and counts the interval since the last kick in a histogram, so the
+// manager can see a process getting slow before it times out.
+// keep the layout in sync with selfdrive/manager/process.py
+
+#define WATCHDOG_TABLE_PATH "/dev/shm/wd_table"
+const int WATCHDOG_MAX_PROCESSES = 64;
+
+// inclusive upper bounds of the kick interval buckets in ms, the last bucket counts the intervals above.
+// 2500 is half of the ui's watchdog timeout, the manager warns about the kicks in the buckets above it
+const uint32_t WATCHDOG_INTERVAL_BOUNDS_MS[] = {10, 20, 50, 100, 200, 500, 1000, 2500, 5000};
+const int WATCHDOG_INTERVAL_BUCKETS = 10;
+
+struct alignas(64) WatchdogSlot {
+  std::atomic<int32_t> pid;  // 0 for a free slot
+  uint32_t reserved;
+  std::atomic<uint64_t> last_kick_ns;  // nanos_since_boot
+  std::atomic<uint64_t> kicks;
+  std::atomic<uint32_t> intervals[WATCHDOG_INTERVAL_BUCKETS];
+};
+static_assert(sizeof(WatchdogSlot) == 64);
+static_assert(sizeof(WATCHDOG_INTERVAL_BOUNDS_MS) / sizeof(WATCHDOG_INTERVAL_BOUNDS_MS[0]) + 1 == WATCHDOG_INTERVAL_BUCKETS);
+
 bool watchdog_kick();
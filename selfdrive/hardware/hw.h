@@ -27,7 +27,15 @@ inline std::string log_root() {
   return Hardware::PC() ? util::getenv("HOME") + "/.comma/media/0/realdata" : "/data/media/0/realdata";
 }
 inline std::string params() {
-  return Hardware::PC() ? util::getenv("HOME") + "/.comma/params" : "/data/params";
+  const std::string params = Hardware::PC() ? util::getenv("HOME") + "/.comma/params" : "/data/params";
+  // processes in a messaging namespace have their own params
+  if (const char *prefix = getenv("OPENPILOT_PREFIX")) {
+    return params + "/" + prefix;
+  }
+  return params;
+}
+inline std::string cl_cache() {
+  return Hardware::PC() ? util::getenv("HOME") + "/.comma/cl_cache" : "/data/cl_cache";
 }
 inline std::string rsa_file() {
   return Hardware::PC() ? util::getenv("HOME") + "/.comma/persist/comma/id_rsa" : "/persist/comma/id_rsa";
@@ -9,4 +9,8 @@ public:
                            int in_width, int in_height, uint64_t ts) = 0;
   virtual void encoder_open(const char* path) = 0;
   virtual void encoder_close() = 0;
+  virtual void set_bitrate(int bitrate) {}
+
+  // total bytes of encoded output, only touched by the thread currently using the encoder
+  uint64_t out_bytes = 0;
 };
@@ -0,0 +1,38 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "selfdrive/loggerd/logger.h"
+
+// Repairs logs left behind by a crash or power failure. Every log with a
+// leftover journal is truncated to its last intact frame, which only needs
+// a crc pass over the file instead of decompressing it.
+//   usage: logfsck [-f] [path...]
+// path is a log root or a segment, LOG_ROOT by default. Segments with a lock
+// file are being written and are skipped, -f repairs them too, for locks left
+// behind by a loggerd that isn't running anymore.
+
+static void print_result(const std::string &log_path, ssize_t size) {
+  if (size < 0) {
+    printf("%s: failed to repair\n", log_path.c_str());
+  } else {
+    printf("%s: truncated to %zd bytes\n", log_path.c_str(), size);
+  }
+}
+
+int main(int argc, char** argv) {
+  bool force = false;
+  int first = 1;
+  if (argc > 1 && strcmp(argv[1], "-f") == 0) {
+    force = true;
+    first++;
+  }
+
+  if (first == argc) {
+    logger_repair_all(LOG_ROOT, !force, print_result);
+  }
+  for (int i = first; i < argc; ++i) {
+    logger_repair_all(argv[i], !force, print_result);
+  }
+  return 0;
+}
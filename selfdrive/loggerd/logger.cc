@@ -1,5 +1,6 @@
 #include "selfdrive/loggerd/logger.h"
 
+#include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <ftw.h>
@@ -14,12 +15,15 @@
 #include <fstream>
 #include <iostream>
 #include <streambuf>
+
+#include <zlib.h>
 #ifdef QCOM
 #include <cutils/properties.h>
 #endif
 
 #include "selfdrive/common/params.h"
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/version.h"
 
 // ***** logging helpers *****
@@ -31,6 +35,70 @@ void append_property(const char* key, const char* value, void *cookie) {
   properties->push_back(std::make_pair(std::string(key), std::string(value)));
 }
 
+// ***** framed bz2 file *****
+
+BZFile::BZFile(const char* path, LogFileStats *stats) : stats(stats), journal_path(std::string(path) + ".journal") {
+  file = util::safe_fopen(path, "wb");
+  assert(file != nullptr);
+  journal = util::safe_fopen(journal_path.c_str(), "wb");
+  assert(journal != nullptr);
+  buf.reserve(LOG_FRAME_SIZE * 2);
+}
+
+BZFile::~BZFile() {
+  write_frame();
+  util::safe_fflush(file);
+  int err = fclose(file);
+  assert(err == 0);
+
+  // the log is complete, the journal is only needed to recover from a crash
+  fclose(journal);
+  unlink(journal_path.c_str());
+}
+
+void BZFile::write_frame() {
+  if (buf.empty()) return;
+
+  const uint64_t start_ns = nanos_since_boot();
+  // worst case bz2 output size is 1% larger than the input plus 600 bytes
+  unsigned int compressed_size = buf.size() + buf.size() / 100 + 600;
+  compressed.resize(compressed_size);
+  int bzerror = BZ2_bzBuffToBuffCompress((char *)compressed.data(), &compressed_size,
+                                         (char *)buf.data(), buf.size(), 9, 0, 30);
+  buf.clear();
+  if (bzerror != BZ_OK) {
+    if (!error_logged) {
+      LOGE("BZ2_bzBuffToBuffCompress error, bzerror=%d", bzerror);
+      error_logged = true;
+    }
+    return;
+  }
+
+  // the frame goes to the kernel before its journal entry, so a crash of loggerd never leaves an entry
+  // without its frame. neither is fsynced, after a power failure either one may be lost: an entry whose
+  // frame didn't make it to disk fails its crc and the repair stops there.
+  LogJournalEntry entry = {
+    .magic = LOG_JOURNAL_MAGIC,
+    .size = compressed_size,
+    .crc = (uint32_t)crc32(0, compressed.data(), compressed_size),
+  };
+  size_t written = util::safe_fwrite(compressed.data(), 1, compressed_size, file);
+  if (written != compressed_size || util::safe_fflush(file) != 0) {
+    if (!error_logged) {
+      LOGE("failed to write log frame, errno=%d", errno);
+      error_logged = true;
+    }
+    return;
+  }
+  util::safe_fwrite(&entry, sizeof(entry), 1, journal);
+  util::safe_fflush(journal);
+
+  if (stats) {
+    stats->bytes_written += compressed_size;
+    stats->stall_ns += nanos_since_boot() - start_ns;
+  }
+}
+
 // ***** log metadata *****
 kj::Array<capnp::word> logger_build_init_data() {
   MessageBuilder msg;
@@ -138,10 +206,10 @@ void logger_init(LoggerState *s, const char* log_name, bool has_qlog) {
   s->init_data = logger_build_init_data();
 }
 
-static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
+static LoggerHandle* logger_open(LoggerState *s, const char* root_path, int part) {
   LoggerHandle *h = NULL;
   for (int i=0; i<LOGGER_MAX_HANDLES; i++) {
-    if (s->handles[i].refcnt == 0) {
+    if (s->handles[i].refcnt.load(std::memory_order_acquire) == 0) {
       h = &s->handles[i];
       break;
     }
@@ -149,7 +217,7 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   assert(h);
 
   snprintf(h->segment_path, sizeof(h->segment_path),
-          "%s/%s--%d", root_path, s->route_name.c_str(), s->part);
+          "%s/%s--%d", root_path, s->route_name.c_str(), part);
 
   snprintf(h->log_path, sizeof(h->log_path), "%s/%s.bz2", h->segment_path, s->log_name);
   snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
@@ -163,13 +231,13 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
   if (lock_file == NULL) return NULL;
   fclose(lock_file);
 
-  h->log = std::make_unique<BZFile>(h->log_path);
+  h->log = std::make_unique<BZFile>(h->log_path, &s->log_stats);
   if (s->has_qlog) {
-    h->q_log = std::make_unique<BZFile>(h->qlog_path);
+    h->q_log = std::make_unique<BZFile>(h->qlog_path, &s->qlog_stats);
   }
 
   pthread_mutex_init(&h->lock, NULL);
-  h->refcnt++;
+  h->refcnt.store(1, std::memory_order_release);
   return h;
 }
 
@@ -178,18 +246,16 @@ int logger_next(LoggerState *s, const char* root_path,
                             int* out_part) {
   bool is_start_of_route = !s->cur_handle;
 
-  pthread_mutex_lock(&s->lock);
-  s->part++;
-
-  LoggerHandle* next_h = logger_open(s, root_path);
+  // open the next segment before taking the lock, so writers aren't stalled by file creation.
+  // only one thread rotates, so part can't change underneath us and slots can only become free.
+  LoggerHandle* next_h = logger_open(s, root_path, s->part + 1);
   if (!next_h) {
-    pthread_mutex_unlock(&s->lock);
     return -1;
   }
 
-  if (s->cur_handle) {
-    lh_close(s->cur_handle);
-  }
+  pthread_mutex_lock(&s->lock);
+  s->part++;
+  LoggerHandle* prev_h = s->cur_handle;
   s->cur_handle = next_h;
 
   if (out_segment_path) {
@@ -201,6 +267,10 @@ int logger_next(LoggerState *s, const char* root_path,
 
   pthread_mutex_unlock(&s->lock);
 
+  if (prev_h) {
+    lh_close(prev_h);
+  }
+
   // write beggining of log metadata
   log_init_data(s);
   lh_log_sentinel(s->cur_handle, is_start_of_route ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT);
@@ -227,6 +297,15 @@ void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_unlock(&s->lock);
 }
 
+// write a message that is already in the rlog to the qlog only
+void logger_log_qlog(LoggerState *s, uint8_t* data, size_t data_size) {
+  pthread_mutex_lock(&s->lock);
+  if (s->cur_handle) {
+    lh_log_qlog(s->cur_handle, data, data_size);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
 void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   pthread_mutex_lock(&s->lock);
   if (s->cur_handle) {
@@ -247,6 +326,15 @@ void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_unlock(&h->lock);
 }
 
+void lh_log_qlog(LoggerHandle* h, uint8_t* data, size_t data_size) {
+  pthread_mutex_lock(&h->lock);
+  assert(h->refcnt > 0);
+  if (h->q_log) {
+    h->q_log->write(data, data_size);
+  }
+  pthread_mutex_unlock(&h->lock);
+}
+
 void lh_close(LoggerHandle* h) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
@@ -256,16 +344,19 @@ void lh_close(LoggerHandle* h) {
     lh_log_sentinel(h, h->end_sentinel_type);
     pthread_mutex_lock(&h->lock);
   }
-  h->refcnt--;
-  if (h->refcnt == 0) {
-    h->log.reset(nullptr);
-    h->q_log.reset(nullptr);
-    unlink(h->lock_path);
+  if (h->refcnt > 1) {
+    h->refcnt--;
     pthread_mutex_unlock(&h->lock);
-    pthread_mutex_destroy(&h->lock);
     return;
   }
+
+  // tear down before releasing the slot, logger_open may reuse it as soon as refcnt is 0
+  h->log.reset(nullptr);
+  h->q_log.reset(nullptr);
+  unlink(h->lock_path);
   pthread_mutex_unlock(&h->lock);
+  pthread_mutex_destroy(&h->lock);
+  h->refcnt.store(0, std::memory_order_release);
 }
 
 int clear_locks_fn(const char* fpath, const struct stat *sb, int tyupeflag) {
@@ -279,3 +370,63 @@ int clear_locks_fn(const char* fpath, const struct stat *sb, int tyupeflag) {
 void clear_locks(const std::string log_root) {
   ftw(log_root.c_str(), clear_locks_fn, 16);
 }
+
+ssize_t logger_repair(const std::string &log_path) {
+  const std::string journal_path = log_path + ".journal";
+  unique_fd journal_fd(HANDLE_EINTR(open(journal_path.c_str(), O_RDONLY)));
+  unique_fd log_fd(HANDLE_EINTR(open(log_path.c_str(), O_RDWR)));
+  if (journal_fd < 0 || log_fd < 0) return -1;
+
+  // walk the journal and check each frame's crc, stopping at the first damaged one
+  std::vector<uint8_t> frame;
+  off_t good_size = 0;
+  LogJournalEntry entry;
+  while (HANDLE_EINTR(read(journal_fd, &entry, sizeof(entry))) == sizeof(entry)) {
+    if (entry.magic != LOG_JOURNAL_MAGIC) break;
+
+    frame.resize(entry.size);
+    if (HANDLE_EINTR(pread(log_fd, frame.data(), entry.size, good_size)) != entry.size) break;
+    if (crc32(0, frame.data(), entry.size) != entry.crc) break;
+    good_size += entry.size;
+  }
+
+  if (ftruncate(log_fd, good_size) != 0) return -1;
+  fsync(log_fd);
+  unlink(journal_path.c_str());
+  return good_size;
+}
+
+static bool ends_with(const std::string &s, const char *suffix) {
+  const size_t len = strlen(suffix);
+  return s.size() > len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+void logger_repair_all(const std::string &path, bool skip_locked, std::function<void(const std::string &, ssize_t)> done) {
+  DIR *d = opendir(path.c_str());
+  if (!d) return;
+
+  bool locked = false;
+  std::vector<std::string> logs, dirs;
+  while (struct dirent *de = readdir(d)) {
+    const std::string name = de->d_name;
+    if (name == "." || name == "..") continue;
+
+    if (de->d_type == DT_DIR) {
+      dirs.push_back(path + "/" + name);
+    } else if (ends_with(name, ".lock")) {
+      locked = true;
+    } else if (ends_with(name, ".journal")) {
+      logs.push_back(path + "/" + name.substr(0, name.size() - strlen(".journal")));
+    }
+  }
+  closedir(d);
+
+  if (!locked || !skip_locked) {
+    for (auto &log_path : logs) {
+      done(log_path, logger_repair(log_path));
+    }
+  }
+  for (auto &dir : dirs) {
+    logger_repair_all(dir, skip_locked, done);
+  }
+}
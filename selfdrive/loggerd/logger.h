@@ -3,9 +3,13 @@
 #include <cassert>
 #include <pthread.h>
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <functional>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <bzlib.h>
 #include <capnp/serialize.h>
@@ -20,42 +24,48 @@ const std::string LOG_ROOT = Path::log_root();
 
 #define LOGGER_MAX_HANDLES 16
 
+// Logs are written as a sequence of frames, each frame is a complete bz2 stream
+// holding whole messages, so the log is still a valid (multi-stream) bz2 file.
+// The size and crc32 of every frame is appended to a journal next to the log,
+// which is removed once the log is closed cleanly. After a crash, logger_repair
+// uses the journal to drop a damaged tail without decompressing anything.
+#define LOG_FRAME_SIZE (900 * 1024)
+#define LOG_JOURNAL_MAGIC 0x4c4a524eU  // "NRJL"
+
+struct LogJournalEntry {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t crc;
+};
+
+struct LogFileStats {
+  std::atomic<uint64_t> bytes_in = 0;
+  std::atomic<uint64_t> bytes_written = 0;
+  std::atomic<uint64_t> stall_ns = 0;
+};
+
 class BZFile {
  public:
-  BZFile(const char* path) {
-    file = util::safe_fopen(path, "wb");
-    assert(file != nullptr);
-    int bzerror;
-    bz_file = BZ2_bzWriteOpen(&bzerror, file, 9, 0, 30);
-    assert(bzerror == BZ_OK);
-  }
-  ~BZFile() {
-    int bzerror;
-    BZ2_bzWriteClose(&bzerror, bz_file, 0, nullptr, nullptr);
-    if (bzerror != BZ_OK) {
-      LOGE("BZ2_bzWriteClose error, bzerror=%d", bzerror);
-    }
-    util::safe_fflush(file);
-    int err = fclose(file);
-    assert(err == 0);
-  }
+  BZFile(const char* path, LogFileStats *stats = nullptr);
+  ~BZFile();
   inline void write(void* data, size_t size) {
-    int bzerror;
-    do {
-      BZ2_bzWrite(&bzerror, bz_file, data, size);
-    } while (bzerror == BZ_IO_ERROR && errno == EINTR);
-
-    if (bzerror != BZ_OK && !error_logged) {
-      LOGE("BZ2_bzWrite error, bzerror=%d", bzerror);
-      error_logged = true;
+    if (stats) stats->bytes_in += size;
+    buf.insert(buf.end(), (uint8_t *)data, (uint8_t *)data + size);
+    if (buf.size() >= LOG_FRAME_SIZE) {
+      write_frame();
     }
   }
   inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
 
  private:
+  void write_frame();
+
   bool error_logged = false;
+  LogFileStats *stats = nullptr;
+  std::string journal_path;
   FILE* file = nullptr;
-  BZFILE* bz_file = nullptr;
+  FILE* journal = nullptr;
+  std::vector<uint8_t> buf, compressed;
 };
 
 typedef cereal::Sentinel::SentinelType SentinelType;
@@ -64,7 +74,8 @@ typedef struct LoggerHandle {
   pthread_mutex_t lock;
   SentinelType end_sentinel_type;
   int exit_signal;
-  int refcnt;
+  // a slot is free once refcnt drops to 0, the rotation thread reuses it without taking any lock
+  std::atomic<int> refcnt;
   char segment_path[4096];
   char log_path[4096];
   char qlog_path[4096];
@@ -79,6 +90,7 @@ typedef struct LoggerState {
   std::string route_name;
   char log_name[64];
   bool has_qlog;
+  LogFileStats log_stats, qlog_stats;
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
   LoggerHandle* cur_handle;
@@ -93,7 +105,15 @@ int logger_next(LoggerState *s, const char* root_path,
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+void logger_log_qlog(LoggerState *s, uint8_t* data, size_t data_size);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
+void lh_log_qlog(LoggerHandle* h, uint8_t* data, size_t data_size);
 void lh_close(LoggerHandle* h);
 void clear_locks(const std::string log_root);
+
+// truncate a log to its last intact frame and remove the journal. returns the new size, or -1 on error
+ssize_t logger_repair(const std::string &log_path);
+// repair every log with a leftover journal under path, a log root or a segment. a segment with a lock
+// file is being written, or was when loggerd died, and is left alone if skip_locked is set.
+void logger_repair_all(const std::string &path, bool skip_locked, std::function<void(const std::string &, ssize_t)> done);
@@ -1,5 +1,9 @@
 #include "selfdrive/loggerd/loggerd.h"
 
+#include <sys/statvfs.h>
+
+#include <algorithm>
+
 ExitHandler do_exit;
 
 // Handle initial encoder syncing by waiting for all encoders to reach the same frame id
@@ -23,27 +27,178 @@ bool sync_encoders(LoggerdState *s, CameraType cam_type, uint32_t frame_id) {
   }
 }
 
+static inline uint32_t segment_start_frame(LoggerdState *s, int segment) {
+  return segment * SEGMENT_LENGTH * MAIN_FPS + s->start_frame_id;
+}
+
+void request_rotate(LoggerdState *s, int segment) {
+  if (s->rotate_request >= segment) return;
+  {
+    std::lock_guard lk(s->rotate_lock);
+    update_max_atomic(s->rotate_request, segment);
+  }
+  s->rotate_cv.notify_one();
+}
+
 bool trigger_rotate_if_needed(LoggerdState *s, int cur_seg, uint32_t frame_id) {
-  const int frames_per_seg = SEGMENT_LENGTH * MAIN_FPS;
-  if (cur_seg >= 0 && frame_id >= ((cur_seg + 1) * frames_per_seg) + s->start_frame_id) {
-    // trigger rotate and wait until the main logger has rotated to the new segment
-    ++s->ready_to_rotate;
-    std::unique_lock lk(s->rotate_lock);
-    s->rotate_cv.wait(lk, [&] {
-      return s->rotate_segment > cur_seg || do_exit;
-    });
-    return !do_exit;
+  if (cur_seg >= 0 && frame_id >= segment_start_frame(s, cur_seg + 1)) {
+    // ask the rotation thread for the next segment, the encoder keeps going meanwhile
+    request_rotate(s, cur_seg + 1);
+    return true;
   }
   return false;
 }
 
-void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
+bool encoder_should_rotate(LoggerdState *s, const LogCameraInfo &cam_info, int cur_seg, int segment, uint32_t frame_id) {
+  if (segment <= cur_seg) return false;
+  if (!cam_info.trigger_rotate || cur_seg < 0 || segment > cur_seg + 1) return true;
+
+  // start the new segment on its first frame, so all cameras stay aligned even if
+  // the logger rotated before this camera got there
+  return frame_id >= segment_start_frame(s, segment);
+}
+
+LogTier log_tier_for(LogTier cur, float free_percent) {
+  int tier = (int)LogTier::QLOG_ONLY;
+  while (tier > 0 && free_percent >= LOG_TIER_FREE_PERCENT[tier]) {
+    tier--;
+  }
+  // only go back up once there's some room above the threshold
+  if (tier < (int)cur && free_percent < LOG_TIER_FREE_PERCENT[(int)cur] + LOG_TIER_HYSTERESIS) {
+    return cur;
+  }
+  return (LogTier)tier;
+}
+
+void update_log_tier(LoggerdState *s) {
+  struct statvfs buf;
+  if (statvfs(s->log_root.c_str(), &buf) != 0 || buf.f_blocks == 0) return;
+
+  const float free_percent = 100. * buf.f_bavail / buf.f_blocks;
+  const LogTier tier = log_tier_for(s->log_tier, free_percent);
+  if (tier != s->log_tier) {
+    LOGW("log tier %d -> %d, %.1f%% free", (int)s->log_tier.load(), (int)tier, free_percent);
+    s->log_tier = tier;
+  }
+}
+
+// ***** double buffered encoders *****
+
+// called with rotate_lock held
+static bool spare_needs_rotate(const CameraEncoders &c, int segment) {
+  return c.spare_state == SpareState::RELEASED ||
+         (c.spare_state == SpareState::OPEN && c.spare_segment < segment) ||
+         (c.spare_state == SpareState::CLOSED && segment > c.cur_segment);
+}
+
+void register_encoders(LoggerdState *s, CameraType cam_type, std::vector<VideoEncoder *> sets[2]) {
+  {
+    std::lock_guard lk(s->rotate_lock);
+    CameraEncoders &c = s->camera_encoders[cam_type];
+    c.sets[0] = sets[0];
+    c.sets[1] = sets[1];
+    c.spare_state = SpareState::CLOSED;
+  }
+  s->rotate_cv.notify_one();
+}
+
+// the segment the spare encoders are open on, -1 if they aren't ready
+int spare_encoders_segment(LoggerdState *s, CameraType cam_type) {
+  std::lock_guard lk(s->rotate_lock);
+  const CameraEncoders &c = s->camera_encoders[cam_type];
+  return c.spare_state == SpareState::OPEN ? c.spare_segment : -1;
+}
+
+// makes the spare encoders active if they are still open on segment, the rotation thread closes the previous ones
+bool swap_encoders(LoggerdState *s, CameraType cam_type, int segment) {
+  {
+    std::lock_guard lk(s->rotate_lock);
+    CameraEncoders &c = s->camera_encoders[cam_type];
+    if (c.spare_state != SpareState::OPEN || c.spare_segment != segment) return false;
+
+    c.active ^= 1;
+    c.cur_segment = segment;
+    c.spare_state = SpareState::RELEASED;
+    c.spare_segment = -1;
+  }
+  s->rotate_cv.notify_one();
+  return true;
+}
+
+// closes the encoders swapped out by the encoder threads and opens the spare ones on the newest segment.
+// a spare set still open on an older segment is reopened, its camera skips ahead like the logger did.
+void rotate_encoders(LoggerdState *s) {
+  for (CameraEncoders &c : s->camera_encoders) {
+    std::unique_lock lk(s->rotate_lock);
+    if (!spare_needs_rotate(c, s->rotate_segment)) continue;
+
+    const bool close = c.spare_state != SpareState::CLOSED;
+    std::vector<VideoEncoder *> &spare = c.sets[c.active ^ 1];
+    const int cur_segment = c.cur_segment;
+    c.spare_state = SpareState::BUSY;
+    lk.unlock();
+
+    if (close) {
+      for (auto &e : spare) e->encoder_close();
+    }
+
+    int segment;
+    char segment_path[4096];
+    {
+      std::lock_guard seg_lk(s->segment_lock);
+      segment = s->rotate_segment;
+      snprintf(segment_path, sizeof(segment_path), "%s", s->segment_path);
+    }
+    const bool open = segment > cur_segment && !do_exit;
+    if (open) {
+      for (auto &e : spare) e->encoder_open(segment_path);
+    }
+
+    lk.lock();
+    c.spare_state = open ? SpareState::OPEN : SpareState::CLOSED;
+    c.spare_segment = open ? segment : -1;
+  }
+}
+
+// frames camerad sent that VisionIpc dropped before this encoder got to them
+void count_dropped_frames(CameraStats &stats, uint32_t last_frame_id, uint32_t frame_id) {
+  if (last_frame_id > 0 && frame_id > last_frame_id + 1) {
+    stats.dropped += frame_id - last_frame_id - 1;
+  }
+}
+
+static inline bool encoder_enabled(LogTier tier, bool is_qcamera) {
+  return tier < LogTier::QCAMERA_ONLY || (is_qcamera && tier == LogTier::QCAMERA_ONLY);
+}
+
+// hand off a log handle to the rotation thread, closing the last reference flushes the segment
+static void close_handle_async(LoggerdState *s, LoggerHandle *lh) {
+  {
+    std::lock_guard lk(s->rotate_lock);
+    s->close_handles.push_back(lh);
+  }
+  s->rotate_cv.notify_one();
+}
+
+VideoEncoder *create_encoder(const LogCameraInfo &info, int width, int height) {
+  return new Encoder(info.filename, width, height, info.fps, info.bitrate, info.is_h265, info.downscale, info.record);
+}
+
+void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info, EncoderFactory encoder_factory) {
   util::set_thread_name(cam_info.filename);
 
   int cur_seg = -1;
   int encode_idx = 0;
+  uint32_t last_frame_id = 0;
+  CameraStats &stats = s->camera_stats[cam_info.type];
   LoggerHandle *lh = NULL;
-  std::vector<Encoder *> encoders;
+
+  // the active set of encoders, the other one is opened and closed by the rotation thread
+  CameraEncoders &cam_encoders = s->camera_encoders[cam_info.type];
+  std::vector<VideoEncoder *> *encoders = nullptr;
+  int active = 0;
+  int bitrates[2] = {cam_info.bitrate, cam_info.bitrate};
+  uint64_t last_out_bytes[2] = {};
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
 
   while (!do_exit) {
@@ -53,19 +208,21 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
     }
 
     // init encoders
-    if (encoders.empty()) {
+    if (!encoders) {
       VisionBuf buf_info = vipc_client.buffers[0];
       LOGD("encoder init %dx%d", buf_info.width, buf_info.height);
 
-      // main encoder
-      encoders.push_back(new Encoder(cam_info.filename, buf_info.width, buf_info.height,
-                                     cam_info.fps, cam_info.bitrate, cam_info.is_h265,
-                                     cam_info.downscale, cam_info.record));
-      // qcamera encoder
-      if (cam_info.has_qcamera) {
-        encoders.push_back(new Encoder(qcam_info.filename, qcam_info.frame_width, qcam_info.frame_height,
-                                       qcam_info.fps, qcam_info.bitrate, qcam_info.is_h265, qcam_info.downscale));
+      std::vector<VideoEncoder *> sets[2];
+      for (auto &set : sets) {
+        // main encoder
+        set.push_back(encoder_factory(cam_info, buf_info.width, buf_info.height));
+        // qcamera encoder
+        if (cam_info.has_qcamera) {
+          set.push_back(encoder_factory(qcam_info, qcam_info.frame_width, qcam_info.frame_height));
+        }
       }
+      register_encoders(s, cam_info.type, sets);
+      encoders = &cam_encoders.sets[active];
     }
 
     while (!do_exit) {
@@ -73,6 +230,8 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
       VisionBuf* buf = vipc_client.recv(&extra);
       if (buf == nullptr) continue;
 
+      count_dropped_frames(stats, std::exchange(last_frame_id, extra.frame_id), extra.frame_id);
+
       if (cam_info.trigger_rotate) {
         s->last_camera_seen_tms = millis_since_boot();
         if (!sync_encoders(s, cam_info.type, extra.frame_id)) {
@@ -81,27 +240,38 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
 
         // check if we're ready to rotate
         trigger_rotate_if_needed(s, cur_seg, extra.frame_id);
-        if (do_exit) break;
       }
 
-      // rotate the encoder if the logger is on a newer segment
-      if (s->rotate_segment > cur_seg) {
-        cur_seg = s->rotate_segment;
-
-        LOGW("camera %d rotate encoder to %s", cam_info.type, s->segment_path);
-        for (auto &e : encoders) {
-          e->encoder_close();
-          e->encoder_open(s->segment_path);
+      // swap to the spare encoders once the rotation thread opened them on a newer segment,
+      // until then the current segment keeps growing
+      const int segment = spare_encoders_segment(s, cam_info.type);
+      if (encoder_should_rotate(s, cam_info, cur_seg, segment, extra.frame_id) &&
+          swap_encoders(s, cam_info.type, segment)) {
+        LOGW("camera %d rotate encoder to segment %d", cam_info.type, segment);
+        cur_seg = segment;
+        active ^= 1;
+        encoders = &cam_encoders.sets[active];
+        LoggerHandle *prev_lh = std::exchange(lh, logger_get_handle(&s->logger));
+        if (prev_lh) {
+          close_handle_async(s, prev_lh);
         }
-        if (lh) {
-          lh_close(lh);
-        }
-        lh = logger_get_handle(&s->logger);
+      }
+      if (cur_seg < 0) continue;
+
+      // degrade with the log tier, the main encoder lowers its bitrate first
+      const LogTier log_tier = s->log_tier;
+      const int bitrate = log_tier >= LogTier::LOW_BITRATE ? cam_info.bitrate / 2 : cam_info.bitrate;
+      if (bitrate != bitrates[active]) {
+        (*encoders)[0]->set_bitrate(bitrate);
+        bitrates[active] = bitrate;
       }
 
       // encode a frame
-      for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf->y, buf->u, buf->v,
+      const uint64_t encode_start_ns = nanos_since_boot();
+      for (int i = 0; i < encoders->size(); ++i) {
+        if (!encoder_enabled(log_tier, i > 0)) continue;
+
+        int out_id = (*encoders)[i]->encode_frame(buf->y, buf->u, buf->v,
                                                buf->width, buf->height, extra.timestamp_eof);
 
         if (out_id == -1) {
@@ -133,6 +303,14 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
         }
       }
 
+      const uint64_t encode_ns = nanos_since_boot() - encode_start_ns;
+      uint64_t out_bytes = 0;
+      for (auto &e : *encoders) out_bytes += e->out_bytes;
+      stats.out_bytes += out_bytes - std::exchange(last_out_bytes[active], out_bytes);
+      stats.encode_ns += encode_ns;
+      update_max_atomic(stats.max_encode_ns, encode_ns);
+      stats.frames++;
+
       encode_idx++;
     }
 
@@ -141,49 +319,171 @@ void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info) {
       lh = NULL;
     }
   }
-
-  LOG("encoder destroy");
-  for(auto &e : encoders) {
-    e->encoder_close();
-    delete e;
-  }
 }
 
 void logger_rotate(LoggerdState *s) {
+  int segment = -1;
+  char segment_path[4096];
+  int err = logger_next(&s->logger, s->log_root.c_str(), segment_path, sizeof(segment_path), &segment);
+  assert(err == 0);
   {
-    std::unique_lock lk(s->rotate_lock);
-    int segment = -1;
-    int err = logger_next(&s->logger, LOG_ROOT.c_str(), s->segment_path, sizeof(s->segment_path), &segment);
-    assert(err == 0);
+    std::lock_guard lk(s->segment_lock);
+    snprintf(s->segment_path, sizeof(s->segment_path), "%s", segment_path);
     s->rotate_segment = segment;
-    s->ready_to_rotate = 0;
-    s->last_rotate_tms = millis_since_boot();
   }
-  s->rotate_cv.notify_all();
-  LOGW((s->logger.part == 0) ? "logging to %s" : "rotated to %s", s->segment_path);
+  s->last_rotate_tms = millis_since_boot();
+  LOGW((s->logger.part == 0) ? "logging to %s" : "rotated to %s", segment_path);
 }
 
 void rotate_if_needed(LoggerdState *s) {
-  if (s->ready_to_rotate == s->max_waiting) {
-    logger_rotate(s);
-  }
-
   double tms = millis_since_boot();
   if ((tms - s->last_rotate_tms) > SEGMENT_LENGTH * 1000 &&
       (tms - s->last_camera_seen_tms) > NO_CAMERA_PATIENCE &&
+      s->rotate_request <= s->rotate_segment &&
       !LOGGERD_TEST) {
     LOGW("no camera packet seen. auto rotating");
-    logger_rotate(s);
+    request_rotate(s, s->rotate_segment + 1);
+  }
+}
+
+// opening and closing segments can be slow on a busy filesystem,
+// so it's done here instead of in the encoder and logger threads
+void rotate_thread(LoggerdState *s) {
+  util::set_thread_name("loggerd_rotate");
+
+  std::unique_lock lk(s->rotate_lock);
+  while (!do_exit) {
+    s->rotate_cv.wait_for(lk, std::chrono::milliseconds(100), [&] {
+      if (!s->close_handles.empty() || s->rotate_request > s->rotate_segment) return true;
+      return std::any_of(std::begin(s->camera_encoders), std::end(s->camera_encoders),
+                         [&](const CameraEncoders &c) { return spare_needs_rotate(c, s->rotate_segment); });
+    });
+    std::vector<LoggerHandle *> handles = std::move(s->close_handles);
+    s->close_handles.clear();
+    const bool rotate = s->rotate_request > s->rotate_segment;
+    lk.unlock();
+
+    if (rotate && !do_exit) {
+      logger_rotate(s);
+    }
+    rotate_encoders(s);
+    if (double tms = millis_since_boot(); (tms - s->last_tier_check_tms) > LOG_TIER_CHECK_INTERVAL) {
+      update_log_tier(s);
+      s->last_tier_check_tms = tms;
+    }
+    for (auto h : handles) {
+      lh_close(h);
+    }
+    lk.lock();
+  }
+}
+
+// fills the stats of the last interval and resets the per interval counters
+void fill_loggerd_stats(cereal::LoggerdStats::Builder stats, LoggerdState *s, const std::unordered_map<SubSocket*, QlogService> &qlog_states,
+                        std::unordered_map<SubSocket*, ServiceStats> &service_stats, double interval_ms) {
+  uint64_t *prev_bytes = s->prev_log_bytes, *prev_stall_ns = s->prev_log_stall_ns;
+
+  stats.setSegmentNum(s->rotate_segment);
+  stats.setIntervalMs(interval_ms);
+  stats.setLogTier(s->log_tier);
+
+  // log file counters are cumulative, the ratio is over the whole route to smooth out frame flushes
+  auto fill_log_file = [&](cereal::LoggerdStats::LogFile::Builder f, const LogFileStats &ls, int idx) {
+    const uint64_t bytes_in = ls.bytes_in, bytes_written = ls.bytes_written, stall_ns = ls.stall_ns;
+    f.setBytesIn(bytes_in - std::exchange(prev_bytes[idx * 2], bytes_in));
+    f.setBytesWritten(bytes_written - std::exchange(prev_bytes[idx * 2 + 1], bytes_written));
+    f.setStallTimeMs((stall_ns - std::exchange(prev_stall_ns[idx], stall_ns)) / 1e6);
+    const float ratio = bytes_written > 0 ? (float)bytes_in / bytes_written : 0.;
+    f.setCompressionRatio(ratio);
+    return ratio;
+  };
+  const float rlog_ratio = fill_log_file(stats.initRlog(), s->logger.log_stats, 0);
+  fill_log_file(stats.initQlog(), s->logger.qlog_stats, 1);
+
+  auto lservices = stats.initServices(service_stats.size());
+  int i = 0;
+  for (auto &[sock, ss] : service_stats) {
+    auto l = lservices[i++];
+    l.setName(qlog_states.at(sock).name);
+    l.setMsgCount(ss.msg_count);
+    l.setBytesIn(ss.bytes_in);
+    l.setBytesWritten(rlog_ratio > 0 ? ss.bytes_in / rlog_ratio : 0);
+    l.setCompressionRatio(rlog_ratio);
+    l.setQueueDepth(ss.max_drain);
+    l.setDrops(ss.drops);
+    l.setStallTimeMs(ss.stall_ns / 1e6);
+    ss = {};
+  }
+
+  std::vector<const LogCameraInfo *> cameras;
+  for (const auto &cam : cameras_logged) {
+    if (cam.enable) cameras.push_back(&cam);
+  }
+  auto lcameras = stats.initCameras(cameras.size());
+  for (int j = 0; j < cameras.size(); ++j) {
+    CameraStats &cs = s->camera_stats[cameras[j]->type];
+    const uint32_t frames = cs.frames.exchange(0);
+    const uint64_t encode_ns = cs.encode_ns.exchange(0);
+    auto l = lcameras[j];
+    l.setName(cameras[j]->filename);
+    l.setFrameCount(frames);
+    l.setDroppedFrames(cs.dropped.exchange(0));
+    l.setEncodeTimeMs(frames > 0 ? encode_ns / 1e6 / frames : 0.);
+    l.setMaxEncodeTimeMs(cs.max_encode_ns.exchange(0) / 1e6);
+    l.setBitrate(cs.out_bytes.exchange(0) * 8 / (interval_ms / 1000.));
+  }
+}
+
+static void publish_stats(PubMaster &pm, LoggerdState *s, const std::unordered_map<SubSocket*, QlogService> &qlog_states,
+                          std::unordered_map<SubSocket*, ServiceStats> &service_stats, double interval_ms) {
+  MessageBuilder msg;
+  fill_loggerd_stats(msg.initEvent().initLoggerdStats(), s, qlog_states, service_stats, interval_ms);
+  pm.send("loggerdStats", msg);
+}
+
+// engagement state changes open a qlog event window
+static bool is_qlog_event(AlignedBuffer &aligned_buf, Message *msg, bool &enabled) {
+  capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg));
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+  if (event.which() != cereal::Event::CONTROLS_STATE) return false;
+
+  bool prev_enabled = std::exchange(enabled, event.getControlsState().getEnabled());
+  return prev_enabled != enabled;
+}
+
+int drain_socket(LoggerdState *s, SubSocket *sock, QlogService &qs, ServiceStats &ss,
+                 const std::function<void(Message *msg, uint64_t ts)> &logged) {
+  int count = 0;
+  Message *msg = nullptr;
+  while (!do_exit && (msg = sock->receive(true))) {
+    const uint64_t ts = nanos_since_boot();
+    const bool in_qlog = qs.check(ts, (uint8_t *)msg->getData(), msg->getSize());
+    if (s->log_tier < LogTier::QLOG_ONLY) {
+      logger_log(&s->logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+    } else if (in_qlog) {
+      logger_log_qlog(&s->logger, (uint8_t *)msg->getData(), msg->getSize());
+    }
+    ss.stall_ns += nanos_since_boot() - ts;
+    ss.bytes_in += msg->getSize();
+    ss.msg_count++;
+
+    logged(msg, ts);
+    delete msg;
+
+    if (++count >= MAX_DRAIN) {
+      LOGD("large volume of '%s' messages", qs.name.c_str());
+      ss.drops++;
+      break;
+    }
   }
+  ss.max_drain = std::max<uint32_t>(ss.max_drain, count);
+  return count;
 }
 
 void loggerd_thread() {
   // setup messaging
-  typedef struct QlogState {
-    std::string name;
-    int counter, freq;
-  } QlogState;
-  std::unordered_map<SubSocket*, QlogState> qlog_states;
+  std::unordered_map<SubSocket*, QlogService> qlog_states;
+  std::unordered_map<SubSocket*, ServiceStats> service_stats;
 
   std::unique_ptr<Context> ctx(Context::create());
   std::unique_ptr<Poller> poller(Poller::create());
@@ -195,13 +495,13 @@ void loggerd_thread() {
     SubSocket * sock = SubSocket::create(ctx.get(), it.name);
     assert(sock != NULL);
     poller->registerSocket(sock);
-    qlog_states[sock] = {
-      .name = it.name,
-      .counter = 0,
-      .freq = it.decimation,
-    };
+    qlog_states.emplace(sock, QlogService(it.name, qlog_policy_for(it.name, it.decimation), it.frequency));
+    service_stats[sock] = {};
   }
 
+  // stats are logged through our own subscription
+  PubMaster pm({"loggerdStats"});
+
   LoggerdState s;
   // init logger
   logger_init(&s.logger, "rlog", true);
@@ -210,30 +510,34 @@ void loggerd_thread() {
 
   // init encoders
   s.last_camera_seen_tms = millis_since_boot();
+  std::thread rotator(rotate_thread, &s);
   std::vector<std::thread> encoder_threads;
   for (const auto &cam : cameras_logged) {
     if (cam.enable) {
-      encoder_threads.push_back(std::thread(encoder_thread, &s, cam));
+      encoder_threads.push_back(std::thread(encoder_thread, &s, cam, create_encoder));
       if (cam.trigger_rotate) s.max_waiting++;
     }
   }
 
+  AlignedBuffer aligned_buf;
+  bool controls_enabled = false;
   uint64_t msg_count = 0, bytes_count = 0;
   double start_ts = millis_since_boot();
+  double last_stats_ts = start_ts;
   while (!do_exit) {
     // poll for new messages on all sockets
     for (auto sock : poller->poll(1000)) {
       if (do_exit) break;
 
-      // drain socket
-      int count = 0;
-      QlogState &qs = qlog_states[sock];
-      Message *msg = nullptr;
-      while (!do_exit && (msg = sock->receive(true))) {
-        const bool in_qlog = qs.freq != -1 && (qs.counter++ % qs.freq == 0);
-        logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+      QlogService &qs = qlog_states.at(sock);
+      drain_socket(&s, sock, qs, service_stats[sock], [&](Message *msg, uint64_t ts) {
         bytes_count += msg->getSize();
-        delete msg;
+        if (qs.name == "controlsState" && is_qlog_event(aligned_buf, msg, controls_enabled)) {
+          LOGD("qlog event, controls %s", controls_enabled ? "engaged" : "disengaged");
+          for (auto &[_, q] : qlog_states) {
+            q.trigger(ts, [&](uint8_t *data, size_t size) { logger_log_qlog(&s.logger, data, size); });
+          }
+        }
 
         rotate_if_needed(&s);
 
@@ -241,19 +545,30 @@ void loggerd_thread() {
           double seconds = (millis_since_boot() - start_ts) / 1000.0;
           LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
         }
+      });
+    }
 
-        count++;
-        if (count >= 200) {
-          LOGD("large volume of '%s' messages", qs.name.c_str());
-          break;
-        }
-      }
+    if (double tms = millis_since_boot(); (tms - last_stats_ts) >= 1000.) {
+      publish_stats(pm, &s, qlog_states, service_stats, tms - last_stats_ts);
+      last_stats_ts = tms;
     }
   }
 
   LOGW("closing encoders");
-  s.rotate_cv.notify_all();
   for (auto &t : encoder_threads) t.join();
+  s.rotate_cv.notify_all();
+  rotator.join();
+  for (auto h : s.close_handles) lh_close(h);
+
+  LOG("encoder destroy");
+  for (auto &c : s.camera_encoders) {
+    for (auto &set : c.sets) {
+      for (auto &e : set) {
+        e->encoder_close();
+        delete e;
+      }
+    }
+  }
 
   LOGW("closing logger");
   logger_close(&s.logger, &do_exit);
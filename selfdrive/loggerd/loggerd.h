@@ -6,10 +6,12 @@
 #include <cassert>
 #include <cerrno>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "cereal/messaging/messaging.h"
 #include "cereal/services.h"
@@ -24,6 +26,7 @@
 
 #include "selfdrive/loggerd/encoder.h"
 #include "selfdrive/loggerd/logger.h"
+#include "selfdrive/loggerd/qlog_policy.h"
 #if defined(QCOM) || defined(QCOM2)
 #include "selfdrive/loggerd/omx_encoder.h"
 #define Encoder OmxEncoder
@@ -37,6 +40,14 @@ const int MAIN_BITRATE = Hardware::TICI() ? 10000000 : 5000000;
 const int DCAM_BITRATE = Hardware::TICI() ? MAIN_BITRATE : 2500000;
 
 #define NO_CAMERA_PATIENCE 500 // fall back to time-based rotation if all cameras are dead
+#define MAX_DRAIN 200 // messages logged from a socket at once, so a busy service can't starve the others
+
+// when the deleter can't keep up, loggerd drops to a cheaper tier as free space runs out
+typedef cereal::LoggerdStats::LogTier LogTier;
+// free space thresholds in percent, indexed by tier: FULL, LOW_BITRATE, QCAMERA_ONLY, QLOG_ONLY
+const float LOG_TIER_FREE_PERCENT[] = {100., 8., 5., 2.};
+#define LOG_TIER_HYSTERESIS 1.  // percent of free space above a threshold to go back up
+#define LOG_TIER_CHECK_INTERVAL 5000  // ms
 
 const bool LOGGERD_TEST = getenv("LOGGERD_TEST");
 const int SEGMENT_LENGTH = LOGGERD_TEST ? atoi(getenv("LOGGERD_SEGMENT_LENGTH")) : 60;
@@ -104,19 +115,78 @@ const LogCameraInfo qcam_info = {
   .is_h265 = false,
   .downscale = true,
   .frame_width = Hardware::TICI() ? 526 : 480,
-  .frame_height = Hardware::TICI() ? 330 : 360 // keep pixel count the same?
+  .frame_height = Hardware::TICI() ? 330 : 360, // keep pixel count the same?
+  .record = true,
+};
+
+// per service stats, only touched by the logger thread
+struct ServiceStats {
+  uint32_t msg_count = 0;
+  uint32_t max_drain = 0;
+  uint32_t drops = 0;
+  uint64_t bytes_in = 0;
+  uint64_t stall_ns = 0;
+};
+
+// per camera stats, updated by the encoder threads and reset when published
+struct CameraStats {
+  std::atomic<uint32_t> frames = 0;
+  std::atomic<uint32_t> dropped = 0;
+  std::atomic<uint64_t> out_bytes = 0;
+  std::atomic<uint64_t> encode_ns = 0;
+  std::atomic<uint64_t> max_encode_ns = 0;
+};
+
+// Each camera has two sets of encoders, so segment files are opened and closed on the rotation
+// thread while the encoder thread keeps encoding into the other set. The rotation thread opens the
+// spare set on the newest segment, the encoder thread swaps to it at the segment boundary and hands
+// the previous set back to be closed. The spare set belongs to whichever thread last moved its state.
+enum class SpareState {
+  NONE,      // encoders not created yet
+  CLOSED,
+  BUSY,      // being opened or closed by the rotation thread
+  OPEN,      // open on spare_segment, ready to be swapped in
+  RELEASED,  // swapped out by the encoder thread, waiting to be closed
+};
+
+struct CameraEncoders {
+  std::vector<VideoEncoder *> sets[2];
+  // guarded by LoggerdState::rotate_lock
+  int active = 0;
+  SpareState spare_state = SpareState::NONE;
+  int spare_segment = -1;
+  int cur_segment = -1;  // segment the active set writes to
 };
 
 struct LoggerdState {
   LoggerState logger = {};
+  std::string log_root = LOG_ROOT;
+
+  // the segment the logger is on is the rotation epoch. segment_path is only
+  // guarded by a short lock, encoders never wait for a rotation to happen.
+  std::mutex segment_lock;
   char segment_path[4096];
+  std::atomic<int> rotate_segment = -1;
+  std::atomic<double> last_rotate_tms = 0.;  // last rotate time in ms
+
+  // rotation helper thread: opens the next segment, opens and closes the spare encoders
+  // and closes handed off log handles
   std::mutex rotate_lock;
   std::condition_variable rotate_cv;
-  std::atomic<int> rotate_segment;
+  std::atomic<int> rotate_request = 0;
+  std::vector<LoggerHandle *> close_handles;
+  CameraEncoders camera_encoders[WideRoadCam + 1];
+
   std::atomic<double> last_camera_seen_tms;
-  std::atomic<int> ready_to_rotate;  // count of encoders ready to rotate
   int max_waiting = 0;
-  double last_rotate_tms = 0.;      // last rotate time in ms
+
+  std::atomic<LogTier> log_tier = LogTier::FULL;
+  double last_tier_check_tms = 0.;
+
+  CameraStats camera_stats[WideRoadCam + 1];
+  // cumulative rlog and qlog counters at the last stats publish
+  uint64_t prev_log_bytes[4] = {};
+  uint64_t prev_log_stall_ns[2] = {};
 
   // Sync logic for startup
   std::atomic<int> encoders_ready = 0;
@@ -125,7 +195,28 @@ struct LoggerdState {
   bool camera_synced[WideRoadCam + 1] = {};
 };
 
+// creates the encoder of a camera or qcamera stream, tests pass their own
+typedef std::function<VideoEncoder *(const LogCameraInfo &info, int width, int height)> EncoderFactory;
+VideoEncoder *create_encoder(const LogCameraInfo &info, int width, int height);
+
 bool sync_encoders(LoggerdState *s, CameraType cam_type, uint32_t frame_id);
 bool trigger_rotate_if_needed(LoggerdState *s, int cur_seg, uint32_t frame_id);
+bool encoder_should_rotate(LoggerdState *s, const LogCameraInfo &cam_info, int cur_seg, int segment, uint32_t frame_id);
+void request_rotate(LoggerdState *s, int segment);
+void register_encoders(LoggerdState *s, CameraType cam_type, std::vector<VideoEncoder *> sets[2]);
+int spare_encoders_segment(LoggerdState *s, CameraType cam_type);
+bool swap_encoders(LoggerdState *s, CameraType cam_type, int segment);
+void rotate_encoders(LoggerdState *s);
+void encoder_thread(LoggerdState *s, const LogCameraInfo &cam_info, EncoderFactory encoder_factory);
+void logger_rotate(LoggerdState *s);
 void rotate_if_needed(LoggerdState *s);
+void rotate_thread(LoggerdState *s);
+LogTier log_tier_for(LogTier cur, float free_percent);
+void update_log_tier(LoggerdState *s);
+void count_dropped_frames(CameraStats &stats, uint32_t last_frame_id, uint32_t frame_id);
+// logs the messages waiting on sock, at most MAX_DRAIN. logged is called after each message is written
+int drain_socket(LoggerdState *s, SubSocket *sock, QlogService &qs, ServiceStats &ss,
+                 const std::function<void(Message *msg, uint64_t ts)> &logged);
+void fill_loggerd_stats(cereal::LoggerdStats::Builder stats, LoggerdState *s, const std::unordered_map<SubSocket*, QlogService> &qlog_states,
+                        std::unordered_map<SubSocket*, ServiceStats> &service_stats, double interval_ms);
 void loggerd_thread();
@@ -14,6 +14,16 @@ int main(int argc, char** argv) {
     //assert(ret == 0);
   }
 
+  // logs of a previous run that didn't close cleanly still have their journal, the uploader
+  // skips them until they're repaired. nothing is being written yet, so stale locks are ignored
+  logger_repair_all(LOG_ROOT, false, [](const std::string &log_path, ssize_t size) {
+    if (size < 0) {
+      LOGE("failed to repair %s", log_path.c_str());
+    } else {
+      LOGW("repaired %s, truncated to %zd bytes", log_path.c_str(), size);
+    }
+  });
+
   loggerd_thread();
 
   return 0;
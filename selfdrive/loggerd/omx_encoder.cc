@@ -330,6 +330,7 @@ OmxEncoder::OmxEncoder(const char* filename, int width, int height, int fps, int
 void OmxEncoder::handle_out_buf(OmxEncoder *e, OMX_BUFFERHEADERTYPE *out_buf) {
   int err;
   uint8_t *buf_data = out_buf->pBuffer + out_buf->nOffset;
+  e->out_bytes += out_buf->nFilledLen;
 
   if (out_buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
     if (e->codec_config_len < out_buf->nFilledLen) {
@@ -570,6 +571,18 @@ void OmxEncoder::encoder_close() {
   this->is_open = false;
 }
 
+// change the target bitrate of a running encoder, takes effect on the next frames
+void OmxEncoder::set_bitrate(int bitrate) {
+  OMX_VIDEO_CONFIG_BITRATETYPE bitrate_config = {0};
+  bitrate_config.nSize = sizeof(bitrate_config);
+  bitrate_config.nPortIndex = (OMX_U32) PORT_INDEX_OUT;
+  bitrate_config.nEncodeBitrate = bitrate;
+  OMX_ERRORTYPE err = OMX_SetConfig(this->handle, OMX_IndexConfigVideoBitrate, (OMX_PTR) &bitrate_config);
+  if (err != OMX_ErrorNone) {
+    LOGE("%s: failed to set bitrate %d: %x", this->filename, bitrate, err);
+  }
+}
+
 OmxEncoder::~OmxEncoder() {
   assert(!this->is_open);
 
@@ -0,0 +1,56 @@
+#include "selfdrive/loggerd/qlog_policy.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// per service overrides, services not listed here keep their services.py decimation.
+// the pre/post roll windows capture everything around engagement changes.
+const QlogPolicyInfo qlog_policies[] = {
+  {"controlsState", {.decimation = 10, .pre_roll_ms = 5000, .post_roll_ms = 5000}},
+  {"carState", {.decimation = 10, .pre_roll_ms = 5000, .post_roll_ms = 5000}},
+  {"carControl", {.decimation = 10, .pre_roll_ms = 5000, .post_roll_ms = 5000}},
+  {"lateralPlan", {.decimation = 5, .pre_roll_ms = 5000, .post_roll_ms = 5000}},
+  {"longitudinalPlan", {.decimation = 5, .pre_roll_ms = 5000, .post_roll_ms = 5000}},
+  {"radarState", {.decimation = 5, .pre_roll_ms = 5000, .post_roll_ms = 5000}},
+  {"modelV2", {.interval_ms = 2000, .pre_roll_ms = 2000, .post_roll_ms = 2000}},
+  {"sensorEvents", {.interval_ms = 1000}},
+  {"gpsLocationExternal", {.interval_ms = 1000}},
+};
+
+QlogPolicy qlog_policy_for(const char *name, int decimation) {
+  for (const auto &p : qlog_policies) {
+    if (strcmp(p.name, name) == 0) return p.policy;
+  }
+  return {.decimation = decimation};
+}
+
+QlogService::QlogService(const std::string &name, const QlogPolicy &policy, float frequency)
+  : name(name), policy(policy) {
+  if (policy.pre_roll_ms > 0) {
+    // services without a fixed frequency get a small ring
+    const size_t size = frequency > 0 ? std::ceil(frequency * policy.pre_roll_ms / 1000.0) + 1 : 64;
+    ring.resize(size);
+  }
+}
+
+bool QlogService::check(uint64_t ts, const uint8_t *data, size_t size) {
+  bool keep = policy.decimation > 0 && (counter++ % policy.decimation == 0);
+  if (policy.interval_ms > 0 && ts >= next_interval_ts) {
+    next_interval_ts = ts + policy.interval_ms * 1000000ULL;
+    keep = true;
+  }
+  keep = keep || ts < post_roll_end;
+
+  if (!keep && !ring.empty()) {
+    Retained &r = ring[(ring_head + ring_count) % ring.size()];
+    if (ring_count == ring.size()) {
+      ring_head = (ring_head + 1) % ring.size();
+    } else {
+      ++ring_count;
+    }
+    r.ts = ts;
+    r.data.assign((const char *)data, size);
+  }
+  return keep;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A qlog policy decides which messages of a service go into the qlog.
+// A message is kept if any of the enabled rules match:
+//  - decimation: every Nth message (message count based, the services.py default)
+//  - interval: the first message after interval_ms has passed (time based)
+//  - event window: every message within pre_roll_ms before and post_roll_ms after an event
+struct QlogPolicy {
+  int decimation = -1;    // -1 disables count based sampling
+  int interval_ms = 0;    // 0 disables time based sampling
+  int pre_roll_ms = 0;
+  int post_roll_ms = 0;
+};
+
+struct QlogPolicyInfo {
+  const char *name;
+  QlogPolicy policy;
+};
+
+class QlogService {
+public:
+  QlogService(const std::string &name, const QlogPolicy &policy, float frequency);
+
+  // O(1): returns true if the message received at ts should be written to the qlog.
+  // messages that are not logged are kept in the pre-roll ring if the policy has one.
+  bool check(uint64_t ts, const uint8_t *data, size_t size);
+
+  // open an event window at ts. retained pre-roll messages are passed to write, oldest first.
+  // they are older than the messages of the service already in the qlog, so the qlog is not in
+  // logMonoTime order around events. readers that need the order sort by logMonoTime, like the
+  // replay LogReader and tools/lib LogReader(sort_by_time=True).
+  template <typename F>
+  void trigger(uint64_t ts, F &&write) {
+    if (policy.post_roll_ms > 0) {
+      post_roll_end = ts + policy.post_roll_ms * 1000000ULL;
+    }
+    const uint64_t pre_roll_start = ts - std::min<uint64_t>(ts, policy.pre_roll_ms * 1000000ULL);
+    for (size_t i = 0; i < ring_count; ++i) {
+      Retained &r = ring[(ring_head + i) % ring.size()];
+      if (r.ts >= pre_roll_start) {
+        write((uint8_t *)r.data.data(), r.data.size());
+      }
+    }
+    ring_count = 0;
+  }
+
+  const std::string name;
+  const QlogPolicy policy;
+
+private:
+  struct Retained {
+    uint64_t ts;
+    std::string data;
+  };
+
+  uint64_t counter = 0;
+  uint64_t next_interval_ts = 0;
+  uint64_t post_roll_end = 0;
+
+  // fixed size ring of the most recent messages not in the qlog.
+  // slots are reused, so there are no allocations once the ring is warm.
+  std::vector<Retained> ring;
+  size_t ring_head = 0, ring_count = 0;
+};
+
+// Returns the policy for a service, falling back to its decimation from services.py
+QlogPolicy qlog_policy_for(const char *name, int decimation);
@@ -163,6 +163,7 @@ int RawLogger::encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const ui
   } else if (got_output) {
     av_packet_rescale_ts(&pkt, codec_ctx->time_base, stream->time_base);
     pkt.stream_index = 0;
+    out_bytes += pkt.size;
 
     err = av_interleaved_write_frame(format_ctx, &pkt);
     if (err < 0) {
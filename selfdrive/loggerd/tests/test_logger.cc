@@ -0,0 +1,159 @@
+#include <sys/stat.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/loggerd/logger.h"
+#include "selfdrive/ui/replay/util.h"
+
+static std::string clean_log_root() {
+  const std::string log_root = "/tmp/test_logger";
+  system(("rm -rf " + log_root).c_str());
+  return log_root;
+}
+
+static void write_msg(LoggerHandle *h) {
+  MessageBuilder msg;
+  msg.initEvent().initClocks();
+  auto bytes = msg.toBytes();
+  lh_log(h, bytes.begin(), bytes.size(), true);
+}
+
+// returns the number of events in a log, checking it starts with initData and ends with the sentinel
+static int verify_segment(const std::string &log_path, SentinelType end_type) {
+  std::string log = decompressBZ2(util::read_file(log_path));
+  REQUIRE(!log.empty());
+
+  int events = 0;
+  cereal::Event::Which last = cereal::Event::INIT_DATA;
+  SentinelType last_sentinel;
+  kj::ArrayPtr<const capnp::word> words((const capnp::word *)log.data(), log.size() / sizeof(capnp::word));
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    auto event = reader.getRoot<cereal::Event>();
+    if (events == 0) {
+      REQUIRE(event.which() == cereal::Event::INIT_DATA);
+    }
+    last = event.which();
+    if (last == cereal::Event::SENTINEL) {
+      last_sentinel = event.getSentinel().getType();
+    }
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+    events++;
+  }
+  REQUIRE(last == cereal::Event::SENTINEL);
+  REQUIRE(last_sentinel == end_type);
+  return events;
+}
+
+TEST_CASE("logger_next reuses handles while writers hold them") {
+  const std::string log_root = clean_log_root();
+  const int SEGMENTS = LOGGER_MAX_HANDLES * 3;
+  const int WRITERS = 4;
+
+  LoggerState logger = {};
+  logger_init(&logger, "rlog", true);
+  REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+
+  // writers take the current handle like the encoder threads, and release it after a few messages
+  std::atomic<bool> done = false;
+  std::atomic<int> written = 0;
+  std::vector<std::thread> writers;
+  for (int i = 0; i < WRITERS; ++i) {
+    writers.emplace_back([&]() {
+      while (!done) {
+        LoggerHandle *h = logger_get_handle(&logger);
+        for (int j = 0; j < 10; ++j) {
+          write_msg(h);
+          written++;
+        }
+        lh_close(h);
+      }
+    });
+  }
+
+  for (int i = 1; i < SEGMENTS; ++i) {
+    util::sleep_for(2);
+    REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+  }
+  done = true;
+  for (auto &t : writers) t.join();
+  logger_close(&logger);
+
+  int events = 0;
+  for (int i = 0; i < SEGMENTS; ++i) {
+    const std::string segment_path = log_root + "/" + logger.route_name + "--" + std::to_string(i);
+    REQUIRE(!util::file_exists(segment_path + "/rlog.bz2.lock"));
+    REQUIRE(!util::file_exists(segment_path + "/rlog.bz2.journal"));
+    const int segment_events = verify_segment(segment_path + "/rlog.bz2", i == SEGMENTS - 1 ? SentinelType::END_OF_ROUTE : SentinelType::END_OF_SEGMENT);
+    // initData and the two sentinels
+    events += segment_events - 3;
+  }
+  REQUIRE(events == written);
+}
+
+// the log and journal as they are on disk while the log is being written
+static void write_crashed_log(const std::string &log_path, const std::string &data, int frames) {
+  std::string log, journal;
+  {
+    BZFile f((log_path + ".tmp").c_str());
+    for (int i = 0; i < frames; ++i) {
+      f.write((void *)data.data(), data.size());
+    }
+    log = util::read_file(log_path + ".tmp");
+    journal = util::read_file(log_path + ".tmp.journal");
+  }
+  unlink((log_path + ".tmp").c_str());
+  REQUIRE(util::write_file(log_path.c_str(), log.data(), log.size(), O_WRONLY | O_CREAT) == 0);
+  REQUIRE(util::write_file((log_path + ".journal").c_str(), journal.data(), journal.size(), O_WRONLY | O_CREAT) == 0);
+}
+
+TEST_CASE("logger_repair truncates a torn frame") {
+  const std::string log_root = clean_log_root();
+  REQUIRE(util::create_directories(log_root, 0775));
+  const std::string log_path = log_root + "/rlog.bz2";
+
+  std::string data(LOG_FRAME_SIZE, '\0');
+  for (int i = 0; i < data.size(); ++i) data[i] = "openpilot"[i % 9] + i % 7;
+  write_crashed_log(log_path, data, 2);
+  const size_t good_size = util::read_file(log_path).size();
+
+  // the frame loggerd was writing when it died, and its journal entry
+  std::string torn(1000, 'x');
+  LogJournalEntry entry = {.magic = LOG_JOURNAL_MAGIC, .size = 2000, .crc = 0};
+  REQUIRE(util::write_file(log_path.c_str(), torn.data(), torn.size(), O_WRONLY | O_APPEND) == 0);
+  REQUIRE(util::write_file((log_path + ".journal").c_str(), &entry, sizeof(entry), O_WRONLY | O_APPEND) == 0);
+
+  REQUIRE(logger_repair(log_path) == good_size);
+  REQUIRE(!util::file_exists(log_path + ".journal"));
+  REQUIRE(decompressBZ2(util::read_file(log_path)) == data + data);
+}
+
+TEST_CASE("logger_repair_all skips locked segments") {
+  const std::string log_root = clean_log_root();
+  const std::string data(1000, 'a');
+  for (auto segment : {"route--0", "route--1"}) {
+    REQUIRE(util::create_directories(log_root + "/" + segment, 0775));
+    write_crashed_log(log_root + "/" + segment + "/rlog.bz2", data, 1);
+  }
+  // the segment being written
+  REQUIRE(util::write_file((log_root + "/route--1/rlog.bz2.lock").c_str(), "", 0, O_WRONLY | O_CREAT) == 0);
+
+  std::vector<std::string> repaired;
+  auto done = [&](const std::string &log_path, ssize_t size) {
+    REQUIRE(size >= 0);
+    repaired.push_back(log_path);
+  };
+  logger_repair_all(log_root, true, done);
+  REQUIRE(repaired == std::vector<std::string>{log_root + "/route--0/rlog.bz2"});
+  REQUIRE(util::file_exists(log_root + "/route--1/rlog.bz2.journal"));
+
+  repaired.clear();
+  logger_repair_all(log_root, false, done);
+  REQUIRE(repaired == std::vector<std::string>{log_root + "/route--1/rlog.bz2"});
+}
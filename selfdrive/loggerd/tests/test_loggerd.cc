@@ -0,0 +1,268 @@
+#include <sys/mount.h>
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "catch2/catch.hpp"
+#include "cereal/visionipc/visionipc_server.h"
+#include "selfdrive/loggerd/loggerd.h"
+
+// an encoder on an artificially slow filesystem, opening and closing a segment file takes a while
+class SlowEncoder : public VideoEncoder {
+public:
+  SlowEncoder(int io_ms) : io_ms(io_ms) {}
+  int encode_frame(const uint8_t *y_ptr, const uint8_t *u_ptr, const uint8_t *v_ptr,
+                   int in_width, int in_height, uint64_t ts) override {
+    if (!is_open) {
+      closed_frames++;
+      return -1;
+    }
+    frames++;
+    return 0;
+  }
+  void encoder_open(const char *path) override {
+    util::sleep_for(io_ms);
+    segment_path = path;
+    is_open = true;
+  }
+  void encoder_close() override {
+    if (!is_open) return;
+    util::sleep_for(io_ms);
+    is_open = false;
+  }
+
+  const int io_ms;
+  std::atomic<bool> is_open = false;
+  std::string segment_path;
+  int frames = 0, closed_frames = 0;
+};
+
+extern ExitHandler do_exit;
+
+TEST_CASE("encoder_should_rotate") {
+  LoggerdState s;
+  s.start_frame_id = 100;
+  const LogCameraInfo &road_cam = cameras_logged[0];
+  const int segment_frames = SEGMENT_LENGTH * MAIN_FPS;
+
+  // nothing to rotate to
+  REQUIRE_FALSE(encoder_should_rotate(&s, road_cam, 0, -1, 100));
+  REQUIRE_FALSE(encoder_should_rotate(&s, road_cam, 1, 1, 100 + segment_frames));
+  // first segment and skipped segments start right away
+  REQUIRE(encoder_should_rotate(&s, road_cam, -1, 0, 0));
+  REQUIRE(encoder_should_rotate(&s, road_cam, 0, 2, 101));
+  // the next segment starts on its first frame
+  REQUIRE_FALSE(encoder_should_rotate(&s, road_cam, 0, 1, 99 + segment_frames));
+  REQUIRE(encoder_should_rotate(&s, road_cam, 0, 1, 100 + segment_frames));
+}
+
+TEST_CASE("encoders keep encoding through slow rotations") {
+  const int ROTATIONS = 20;
+  const int FRAMES_PER_SEGMENT = 20;
+  const int IO_MS = 20;
+  const int FRAME_MS = 5;
+
+  LoggerdState s;
+  s.log_root = "/tmp/test_loggerd";
+  system(("rm -rf " + s.log_root).c_str());
+  logger_init(&s.logger, "rlog", true);
+  logger_rotate(&s);
+
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_ROAD, 20, false, 100, 100);
+  server.start_listener();
+
+  // the real encoder and rotation threads, with encoders on an artificially slow filesystem.
+  // rotations are forced every FRAMES_PER_SEGMENT frames, a frame waiting on a 20 ms open or close
+  // would back up VisionIpc
+  std::vector<SlowEncoder *> encoders;
+  auto encoder_factory = [&](const LogCameraInfo &info, int width, int height) {
+    encoders.push_back(new SlowEncoder(IO_MS));
+    return encoders.back();
+  };
+  const LogCameraInfo cam_info = {
+    .type = RoadCam,
+    .stream_type = VISION_STREAM_ROAD,
+    .filename = "fcamera.hevc",
+    .has_qcamera = true,
+    .trigger_rotate = false,
+    .enable = true,
+    .record = true,
+  };
+  std::thread rotator(rotate_thread, &s);
+  std::thread encoder(encoder_thread, &s, cam_info, encoder_factory);
+
+  auto encoder_segment = [&]() {
+    std::lock_guard lk(s.rotate_lock);
+    return s.camera_encoders[RoadCam].cur_segment;
+  };
+  uint32_t frame_id = 1;
+  for (; encoder_segment() < ROTATIONS && frame_id < ROTATIONS * FRAMES_PER_SEGMENT * 10; ++frame_id) {
+    if (frame_id % FRAMES_PER_SEGMENT == 0 && s.rotate_segment < ROTATIONS) {
+      request_rotate(&s, s.rotate_segment + 1);
+    }
+    VisionBuf *buf = server.get_buffer(VISION_STREAM_ROAD);
+    buf->set_frame_id(frame_id);
+    VisionIpcBufExtra extra = {.frame_id = frame_id};
+    server.send(buf, &extra);
+    util::sleep_for(FRAME_MS);
+  }
+  REQUIRE(encoder_segment() == ROTATIONS);
+
+  do_exit = true;
+  encoder.join();
+  s.rotate_cv.notify_all();
+  rotator.join();
+  for (auto h : s.close_handles) lh_close(h);
+  logger_close(&s.logger);
+  do_exit = false;
+
+  // a main and a qcamera encoder in each set
+  REQUIRE(encoders.size() == 4);
+  int frames = 0, closed_frames = 0;
+  for (auto e : encoders) {
+    frames += e->frames;
+    closed_frames += e->closed_frames;
+    e->encoder_close();
+    delete e;
+  }
+  // every frame after the first segment opened went to an open encoder, and none was dropped
+  const CameraStats &stats = s.camera_stats[RoadCam];
+  REQUIRE(closed_frames == 0);
+  REQUIRE(stats.dropped == 0);
+  REQUIRE(stats.frames > 0);
+  REQUIRE(frames == stats.frames * 2);
+}
+
+TEST_CASE("loggerdStats accumulate over an interval") {
+  LoggerdState s;
+  s.log_root = "/tmp/test_loggerd";
+  system(("rm -rf " + s.log_root).c_str());
+  logger_init(&s.logger, "rlog", true);
+  logger_rotate(&s);
+
+  std::unique_ptr<Context> ctx(Context::create());
+  std::unique_ptr<SubSocket> sock(SubSocket::create(ctx.get(), "carState"));
+  std::unordered_map<SubSocket*, QlogService> qlog_states;
+  qlog_states.emplace(sock.get(), QlogService("carState", qlog_policy_for("carState", 10), 100.));
+  std::unordered_map<SubSocket*, ServiceStats> service_stats = {{sock.get(), {}}};
+
+  // more messages than one drain takes
+  const int MSGS = MAX_DRAIN + 50;
+  size_t msg_size = 0;
+  PubMaster pm({"carState"});
+  for (int i = 0; i < MSGS; ++i) {
+    MessageBuilder msg;
+    msg.initEvent().initCarState();
+    auto bytes = msg.toBytes();
+    msg_size = bytes.size();
+    pm.send("carState", bytes.begin(), bytes.size());
+  }
+  int logged = 0;
+  auto count_logged = [&](Message *msg, uint64_t ts) { logged++; };
+  REQUIRE(drain_socket(&s, sock.get(), qlog_states.at(sock.get()), service_stats[sock.get()], count_logged) == MAX_DRAIN);
+  REQUIRE(drain_socket(&s, sock.get(), qlog_states.at(sock.get()), service_stats[sock.get()], count_logged) == MSGS - MAX_DRAIN);
+  REQUIRE(logged == MSGS);
+
+  // frame id gaps are camera drops
+  CameraStats &cs = s.camera_stats[RoadCam];
+  count_dropped_frames(cs, 0, 100);
+  count_dropped_frames(cs, 100, 101);
+  count_dropped_frames(cs, 101, 105);
+  count_dropped_frames(cs, 105, 104);
+  cs.frames = 4;
+
+  // the compression ratio is over the whole route, the byte counters are per interval
+  s.logger.log_stats.bytes_in = 1000;
+  s.logger.log_stats.bytes_written = 250;
+  auto fill_stats = [&](MessageBuilder &msg) {
+    auto stats = msg.initEvent().initLoggerdStats();
+    fill_loggerd_stats(stats, &s, qlog_states, service_stats, 1000.);
+    return stats.asReader();
+  };
+
+  MessageBuilder msg1;
+  auto stats = fill_stats(msg1);
+  REQUIRE(stats.getRlog().getBytesIn() == 1000);
+  REQUIRE(stats.getRlog().getBytesWritten() == 250);
+  REQUIRE(stats.getRlog().getCompressionRatio() == 4.);
+  REQUIRE(stats.getServices().size() == 1);
+  auto service = stats.getServices()[0];
+  REQUIRE(service.getName() == "carState");
+  REQUIRE(service.getMsgCount() == MSGS);
+  REQUIRE(service.getBytesIn() == MSGS * msg_size);
+  REQUIRE(service.getBytesWritten() == MSGS * msg_size / 4);
+  REQUIRE(service.getCompressionRatio() == 4.);
+  REQUIRE(service.getQueueDepth() == MAX_DRAIN);
+  REQUIRE(service.getDrops() == 1);
+  auto camera = stats.getCameras()[0];
+  REQUIRE(camera.getName() == "fcamera.hevc");
+  REQUIRE(camera.getFrameCount() == 4);
+  REQUIRE(camera.getDroppedFrames() == 3);
+
+  // the next interval starts from zero
+  s.logger.log_stats.bytes_in = 1400;
+  s.logger.log_stats.bytes_written = 350;
+  MessageBuilder msg2;
+  stats = fill_stats(msg2);
+  REQUIRE(stats.getRlog().getBytesIn() == 400);
+  REQUIRE(stats.getRlog().getBytesWritten() == 100);
+  REQUIRE(stats.getRlog().getCompressionRatio() == 4.);
+  service = stats.getServices()[0];
+  REQUIRE(service.getMsgCount() == 0);
+  REQUIRE(service.getQueueDepth() == 0);
+  REQUIRE(service.getDrops() == 0);
+  REQUIRE(stats.getCameras()[0].getFrameCount() == 0);
+  REQUIRE(stats.getCameras()[0].getDroppedFrames() == 0);
+
+  logger_close(&s.logger);
+}
+
+TEST_CASE("log_tier_for") {
+  // thresholds going down
+  REQUIRE(log_tier_for(LogTier::FULL, 50.) == LogTier::FULL);
+  REQUIRE(log_tier_for(LogTier::FULL, 7.) == LogTier::LOW_BITRATE);
+  REQUIRE(log_tier_for(LogTier::FULL, 4.) == LogTier::QCAMERA_ONLY);
+  REQUIRE(log_tier_for(LogTier::FULL, 1.) == LogTier::QLOG_ONLY);
+  // back up only once there's room above the threshold
+  REQUIRE(log_tier_for(LogTier::QLOG_ONLY, 2.5) == LogTier::QLOG_ONLY);
+  REQUIRE(log_tier_for(LogTier::QLOG_ONLY, 3.5) == LogTier::QCAMERA_ONLY);
+  REQUIRE(log_tier_for(LogTier::LOW_BITRATE, 8.5) == LogTier::LOW_BITRATE);
+  REQUIRE(log_tier_for(LogTier::LOW_BITRATE, 50.) == LogTier::FULL);
+}
+
+TEST_CASE("log tier follows free space on a small tmpfs") {
+  const std::string log_root = "/tmp/test_loggerd_tmpfs";
+  const size_t FS_SIZE = 4 << 20;
+  util::create_directories(log_root, 0775);
+  if (mount("tmpfs", log_root.c_str(), "tmpfs", 0, ("size=" + std::to_string(FS_SIZE)).c_str()) != 0) {
+    WARN("can't mount a tmpfs, skipping: " << strerror(errno));
+    return;
+  }
+
+  // fill it up like a log that the deleter doesn't keep up with
+  LoggerdState s;
+  s.log_root = log_root;
+  const std::string fill_path = log_root + "/rlog";
+  std::vector<LogTier> tiers = {s.log_tier};
+  {
+    unique_fd fd(HANDLE_EINTR(open(fill_path.c_str(), O_WRONLY | O_CREAT, 0664)));
+    REQUIRE(fd >= 0);
+    const std::string chunk(FS_SIZE / 200, 'a');
+    while (HANDLE_EINTR(write(fd, chunk.data(), chunk.size())) == chunk.size()) {
+      update_log_tier(&s);
+      if (s.log_tier != tiers.back()) tiers.push_back(s.log_tier);
+    }
+  }
+  REQUIRE(tiers == std::vector<LogTier>{LogTier::FULL, LogTier::LOW_BITRATE, LogTier::QCAMERA_ONLY, LogTier::QLOG_ONLY});
+
+  // and back once the deleter made room
+  unlink(fill_path.c_str());
+  update_log_tier(&s);
+  REQUIRE(s.log_tier == LogTier::FULL);
+  umount(log_root.c_str());
+}
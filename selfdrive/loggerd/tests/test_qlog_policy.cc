@@ -0,0 +1,83 @@
+#include <string>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/loggerd/qlog_policy.h"
+
+const uint64_t MS = 1000000ULL;
+
+// feeds n messages every period_ms from start_ms, the data is the message index. returns the indexes kept
+static std::vector<int> feed(QlogService &qs, int n, int period_ms, uint64_t start_ms = 0, int first = 0) {
+  std::vector<int> kept;
+  for (int i = first; i < first + n; ++i) {
+    const std::string data = std::to_string(i);
+    if (qs.check((start_ms + (i - first) * period_ms) * MS, (const uint8_t *)data.data(), data.size())) {
+      kept.push_back(i);
+    }
+  }
+  return kept;
+}
+
+static std::vector<int> trigger(QlogService &qs, uint64_t ts_ms) {
+  std::vector<int> written;
+  qs.trigger(ts_ms * MS, [&](uint8_t *data, size_t size) { written.push_back(std::stoi(std::string((char *)data, size))); });
+  return written;
+}
+
+TEST_CASE("qlog_policy_for") {
+  REQUIRE(qlog_policy_for("controlsState", 1).decimation == 10);
+  REQUIRE(qlog_policy_for("modelV2", 1).interval_ms == 2000);
+  // services without an override keep their services.py decimation
+  const QlogPolicy p = qlog_policy_for("deviceState", 7);
+  REQUIRE((p.decimation == 7 && p.interval_ms == 0 && p.pre_roll_ms == 0 && p.post_roll_ms == 0));
+}
+
+TEST_CASE("QlogService decimation") {
+  QlogService qs("test", {.decimation = 4}, 100);
+  REQUIRE(feed(qs, 10, 10) == std::vector<int>{0, 4, 8});
+  // no ring without a pre-roll
+  REQUIRE(trigger(qs, 100).empty());
+
+  QlogService off("test", {.decimation = -1}, 100);
+  REQUIRE(feed(off, 10, 10).empty());
+}
+
+TEST_CASE("QlogService interval") {
+  QlogService qs("test", {.interval_ms = 100}, 0);
+  // the first message after each 100 ms, at 30 ms periods: 0, 120, 240, ...
+  REQUIRE(feed(qs, 10, 30) == std::vector<int>{0, 4, 8});
+  // a gap keeps the next message right away
+  REQUIRE(feed(qs, 2, 30, 1000, 10) == std::vector<int>{10});
+}
+
+TEST_CASE("QlogService pre-roll") {
+  // 10 Hz with 1 s pre-roll: an 11 message ring
+  QlogService qs("test", {.decimation = 5, .pre_roll_ms = 1000}, 10);
+  REQUIRE(feed(qs, 10, 100) == std::vector<int>{0, 5});
+
+  SECTION("only the messages not in the qlog, oldest first") {
+    REQUIRE(trigger(qs, 950) == std::vector<int>{1, 2, 3, 4, 6, 7, 8, 9});
+    // the ring is emptied
+    REQUIRE(trigger(qs, 960).empty());
+  }
+  SECTION("cutoff") {
+    // messages more than 1 s before the event are dropped
+    REQUIRE(trigger(qs, 1350) == std::vector<int>{4, 6, 7, 8, 9});
+  }
+  SECTION("ring wrap") {
+    // faster than the ring was sized for, it keeps the 11 newest messages not in the qlog
+    REQUIRE(feed(qs, 30, 10, 1000, 10) == std::vector<int>{10, 15, 20, 25, 30, 35});
+    REQUIRE(trigger(qs, 1300) == std::vector<int>{27, 28, 29, 31, 32, 33, 34, 36, 37, 38, 39});
+  }
+}
+
+TEST_CASE("QlogService post-roll") {
+  QlogService qs("test", {.decimation = 10, .pre_roll_ms = 500, .post_roll_ms = 300}, 10);
+  REQUIRE(feed(qs, 3, 100) == std::vector<int>{0});
+  trigger(qs, 250);
+  // everything up to 300 ms after the event, then back to decimation
+  REQUIRE(feed(qs, 7, 100, 300, 3) == std::vector<int>{3, 4, 5});
+  // a new event extends the window
+  trigger(qs, 1000);
+  REQUIRE(feed(qs, 5, 100, 1000, 10) == std::vector<int>{10, 11, 12});
+}
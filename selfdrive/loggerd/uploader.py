@@ -97,7 +97,8 @@ class Uploader():
       except OSError:
         continue
 
-      if any(name.endswith(".lock") for name in names):
+      # locked segments are being written, a leftover journal means loggerd hasn't repaired the log yet
+      if any(name.endswith(".lock") or name.endswith(".journal") for name in names):
         continue
 
       for name in sorted(names, key=self.get_upload_sort):
@@ -140,7 +141,7 @@ class Uploader():
 
       # then upload other files
       for name, key, fn in upload_files:
-        if not name.endswith('.lock') and not name.endswith(".tmp"):
+        if not name.endswith('.lock') and not name.endswith(".tmp") and not name.endswith(".journal"):
           return (key, fn)
 
     return None
@@ -1,4 +1,6 @@
 #!/usr/bin/env python3
+import json
+import struct
 import zmq
 from typing import NoReturn
 
@@ -6,6 +8,31 @@ import cereal.messaging as messaging
 from common.logging_extra import SwagLogFileFormatter
 from selfdrive.swaglog import get_file_handler
 
+# binary records of the C++ swaglog, see selfdrive/common/swaglog.cc
+SWAGLOG_BINARY_RECORD = 0xff
+SWAGLOG_RECORD_HEADER = struct.Struct("<BIdHHHI")
+
+
+def decode_binary_record(dat: bytes):
+  level, lineno, created, ctx_len, filename_len, funcname_len, msg_len = SWAGLOG_RECORD_HEADER.unpack_from(dat, 1)
+  offset = 1 + SWAGLOG_RECORD_HEADER.size
+  fields = []
+  for length in (ctx_len, filename_len, funcname_len, msg_len):
+    fields.append(dat[offset:offset + length].decode("utf-8", "replace"))
+    offset += length
+  ctx, filename, funcname, msg = fields
+
+  record = json.dumps({
+    "msg": msg,
+    "ctx": json.loads(ctx),
+    "levelnum": level,
+    "filename": filename,
+    "lineno": lineno,
+    "funcname": funcname,
+    "created": created,
+  }, sort_keys=True)
+  return level, record
+
 
 def main() -> NoReturn:
   log_handler = get_file_handler()
@@ -22,8 +49,11 @@ def main() -> NoReturn:
 
   while True:
     dat = b''.join(sock.recv_multipart())
-    level = dat[0]
-    record = dat[1:].decode("utf-8")
+    if dat[0] == SWAGLOG_BINARY_RECORD:
+      level, record = decode_binary_record(dat)
+    else:
+      level = dat[0]
+      record = dat[1:].decode("utf-8")
     if level >= log_level:
       log_handler.emit(record)
 
@@ -4,7 +4,7 @@ import signal
 import struct
 import time
 import subprocess
-from typing import Optional, List, ValuesView
+from typing import Dict, List, NamedTuple, Optional, Tuple, ValuesView
 from abc import ABC, abstractmethod
 from multiprocessing import Process
 
@@ -19,9 +19,36 @@ from selfdrive.swaglog import cloudlog
 from selfdrive.hardware import HARDWARE
 from cereal import log
 
-WATCHDOG_FN = "/dev/shm/wd_"
 ENABLE_WATCHDOG = os.getenv("NO_WATCHDOG") is None
 
+# shared memory table of selfdrive/common/watchdog.h, a 64 byte slot per process:
+# pid, reserved, last kick (nanos since boot), kicks, kick interval histogram
+WATCHDOG_TABLE_PATH = "/dev/shm/wd_table"
+WATCHDOG_SLOT = struct.Struct("<iIQQ10I")
+WATCHDOG_SLOT_SIZE = 64
+WATCHDOG_INTERVAL_BOUNDS_MS = [10, 20, 50, 100, 200, 500, 1000, 2500, 5000]
+
+
+class WatchdogState(NamedTuple):
+  last_kick_ns: int
+  kicks: int
+  intervals: Tuple[int, ...]
+
+
+def read_watchdog_table() -> Dict[int, WatchdogState]:
+  try:
+    with open(WATCHDOG_TABLE_PATH, "rb") as f:
+      dat = f.read()
+  except OSError:
+    return {}
+
+  table = {}
+  for i in range(0, len(dat) - WATCHDOG_SLOT_SIZE + 1, WATCHDOG_SLOT_SIZE):
+    pid, _, last_kick_ns, kicks, *intervals = WATCHDOG_SLOT.unpack_from(dat, i)
+    if pid != 0:
+      table[pid] = WatchdogState(last_kick_ns, kicks, tuple(intervals))
+  return table
+
 
 def launcher(proc: str, name: str) -> None:
   try:
@@ -78,6 +105,7 @@ class ManagerProcess(ABC):
   last_watchdog_time = 0
   watchdog_max_dt = None
   watchdog_seen = False
+  watchdog_intervals: Optional[Tuple[int, ...]] = None
   shutting_down = False
 
   @abstractmethod
@@ -92,16 +120,14 @@ class ManagerProcess(ABC):
     self.stop()
     self.start()
 
-  def check_watchdog(self, started: bool) -> None:
+  def check_watchdog(self, started: bool, watchdog_table: Dict[int, WatchdogState]) -> None:
     if self.watchdog_max_dt is None or self.proc is None:
       return
 
-    try:
-      fn = WATCHDOG_FN + str(self.proc.pid)
-      # TODO: why can't pylint find struct.unpack?
-      self.last_watchdog_time = struct.unpack('Q', open(fn, "rb").read())[0] # pylint: disable=no-member
-    except Exception:
-      pass
+    state = watchdog_table.get(self.proc.pid)
+    if state is not None:
+      self.last_watchdog_time = state.last_kick_ns
+      self.check_watchdog_jitter(state.intervals)
 
     dt = sec_since_boot() - self.last_watchdog_time / 1e9
 
@@ -113,6 +139,19 @@ class ManagerProcess(ABC):
     else:
       self.watchdog_seen = True
 
+  def check_watchdog_jitter(self, intervals: Tuple[int, ...]) -> None:
+    # warn about kicks that may be more than half of the timeout apart since the last check.
+    # a bucket counts if its upper bound is above, exact when half of the timeout is a bucket bound
+    if self.watchdog_intervals is not None and self.watchdog_max_dt is not None:
+      slow = 0
+      for i, (n, prev) in enumerate(zip(intervals, self.watchdog_intervals)):
+        upper_bound_ms = WATCHDOG_INTERVAL_BOUNDS_MS[i] if i < len(WATCHDOG_INTERVAL_BOUNDS_MS) else float("inf")
+        if upper_bound_ms > self.watchdog_max_dt * 1000 / 2:
+          slow += n - prev
+      if slow > 0:
+        cloudlog.warning(f"Watchdog jitter for {self.name}: {slow} kicks more than {self.watchdog_max_dt / 2}s apart, intervals {intervals}")
+    self.watchdog_intervals = intervals
+
   def stop(self, retry: bool=True, block: bool=True) -> Optional[int]:
     if self.proc is None:
       return None
@@ -209,6 +248,7 @@ class NativeProcess(ManagerProcess):
     self.proc = Process(name=self.name, target=nativelauncher, args=(self.cmdline, cwd, self.name))
     self.proc.start()
     self.watchdog_seen = False
+    self.watchdog_intervals = None
     self.shutting_down = False
 
 
@@ -240,6 +280,7 @@ class PythonProcess(ManagerProcess):
     self.proc = Process(name=self.name, target=launcher, args=(self.module, self.name))
     self.proc.start()
     self.watchdog_seen = False
+    self.watchdog_intervals = None
     self.shutting_down = False
 
 
@@ -288,6 +329,9 @@ def ensure_running(procs: ValuesView[ManagerProcess], started: bool, driverview:
   if not_run is None:
     not_run = []
 
+  # one read of the watchdog table for all processes
+  watchdog_table = read_watchdog_table()
+
   for p in procs:
     if p.name in not_run:
       p.stop(block=False)
@@ -302,5 +346,5 @@ def ensure_running(procs: ValuesView[ManagerProcess], started: bool, driverview:
     else:
       p.stop(block=False)
 
-    p.check_watchdog(started)
+    p.check_watchdog(started, watchdog_table)
 
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+import os
+import tempfile
+import unittest
+from unittest import mock
+
+import selfdrive.manager.process as process
+from selfdrive.manager.process import WATCHDOG_INTERVAL_BOUNDS_MS, WATCHDOG_SLOT, WATCHDOG_SLOT_SIZE, ManagerProcess
+
+
+class FakeProcess(ManagerProcess):
+  name = "fake"
+
+  def __init__(self, watchdog_max_dt):
+    self.watchdog_max_dt = watchdog_max_dt
+
+  def prepare(self):
+    pass
+
+  def start(self):
+    pass
+
+
+def intervals(**buckets):
+  # intervals(b7=1) counts one kick in the bucket with the upper bound WATCHDOG_INTERVAL_BOUNDS_MS[7]
+  return tuple(buckets.get(f"b{i}", 0) for i in range(len(WATCHDOG_INTERVAL_BOUNDS_MS) + 1))
+
+
+class TestWatchdog(unittest.TestCase):
+  def check_jitter(self, max_dt, prev, cur):
+    p = FakeProcess(max_dt)
+    with mock.patch.object(process.cloudlog, "warning") as warning:
+      p.check_watchdog_jitter(prev)
+      p.check_watchdog_jitter(cur)
+    return warning
+
+  def test_jitter_max_dt_5(self):
+    # the ui's timeout, 2.5 s is a bucket bound
+    self.assertEqual(WATCHDOG_INTERVAL_BOUNDS_MS[7], 2500)
+    base = intervals(b0=100, b7=3, b8=1)
+
+    # kicks up to 2.5 s apart are fine
+    self.assertFalse(self.check_jitter(5, base, intervals(b0=200, b6=2, b7=5, b8=1)).called)
+
+    # (2.5 s, 5 s] and above warn, with the kicks since the last check
+    warning = self.check_jitter(5, base, intervals(b0=100, b7=3, b8=3, b9=1))
+    self.assertTrue(warning.called)
+    self.assertIn("3 kicks more than 2.5s apart", warning.call_args[0][0])
+
+  def test_jitter_between_bounds(self):
+    # half of a 3 s timeout is within (1 s, 2.5 s], the kicks there may be slow
+    self.assertTrue(self.check_jitter(3, intervals(), intervals(b7=1)).called)
+    self.assertFalse(self.check_jitter(3, intervals(), intervals(b6=10)).called)
+
+  def test_jitter_first_check(self):
+    # no warning without a previous histogram to compare to
+    p = FakeProcess(5)
+    with mock.patch.object(process.cloudlog, "warning") as warning:
+      p.check_watchdog_jitter(intervals(b9=10))
+    self.assertFalse(warning.called)
+
+  def test_read_watchdog_table(self):
+    with tempfile.NamedTemporaryFile() as f:
+      slots = [(0, 0, 0, 0, *intervals()), (1234, 0, 5_000_000_000, 7, *intervals(b0=6, b8=1))]
+      for slot in slots:
+        f.write(WATCHDOG_SLOT.pack(*slot).ljust(WATCHDOG_SLOT_SIZE, b"\0"))
+      f.flush()
+
+      with mock.patch.object(process, "WATCHDOG_TABLE_PATH", f.name):
+        table = process.read_watchdog_table()
+    self.assertEqual(list(table.keys()), [1234])
+    self.assertEqual(table[1234], process.WatchdogState(5_000_000_000, 7, intervals(b0=6, b8=1)))
+
+    with mock.patch.object(process, "WATCHDOG_TABLE_PATH", os.path.join(tempfile.gettempdir(), "no_wd_table")):
+      self.assertEqual(process.read_watchdog_table(), {})
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -9,6 +9,7 @@
 #include "cereal/visionipc/visionipc_client.h"
 #include "selfdrive/common/clutil.h"
 #include "selfdrive/common/params.h"
+#include "selfdrive/common/statlog.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
@@ -148,6 +149,10 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client_main, VisionIpcCl
     ModelOutput *model_output = model_eval_frame(&model, buf_main, buf_extra, model_transform_main, model_transform_extra, vec_desire);
     double mt2 = millis_since_boot();
     float model_execution_time = (mt2 - mt1) / 1000.0;
+    statlog_sample("modeld.execution_time_ms", (float)(mt2 - mt1));
+    if (run_count > 10) {
+      statlog_count("modeld.dropped_frames", (int)vipc_dropped_frames);
+    }
 
     model_publish(pm, meta_main.frame_id, meta_extra.frame_id, frame_id, frame_drop_ratio, *model_output, meta_main.timestamp_eof, model_execution_time,
                   kj::ArrayPtr<const float>(model.output.data(), model.output.size()), live_calib_seen);
@@ -158,7 +158,9 @@ const double jiffy = sysconf(_SC_CLK_TCK);
 const size_t page_size = sysconf(_SC_PAGE_SIZE);
 
 void buildCPUTimes(cereal::ProcLog::Builder &builder) {
-  std::ifstream stream("/proc/stat");
+  // the cpu lines are at the start, the rest may be cut off
+  static util::SysfsReader reader("/proc/stat", 16384);
+  std::istringstream stream(std::string(reader.read()));
   std::vector<CPUTime> stats = Parser::cpuTimes(stream);
 
   auto log_cpu_times = builder.initCpuTimes(stats.size());
@@ -177,7 +179,8 @@ void buildCPUTimes(cereal::ProcLog::Builder &builder) {
 }
 
 void buildMemInfo(cereal::ProcLog::Builder &builder) {
-  std::ifstream stream("/proc/meminfo");
+  static util::SysfsReader reader("/proc/meminfo");
+  std::istringstream stream(std::string(reader.read()));
   auto mem_info = Parser::memInfo(stream);
 
   auto mem = builder.initMem();
@@ -6,9 +6,8 @@ FileSensor::FileSensor(std::string filename) : file(filename) {
 }
 
 int FileSensor::init() {
-  return file.is_open() ? 0 : 1;
+  return file.read().empty() ? 1 : 0;
 }
 
 FileSensor::~FileSensor() {
-  file.close();
 }
@@ -1,14 +1,14 @@
 #pragma once
 
-#include <fstream>
 #include <string>
 
 #include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/common/util.h"
 #include "selfdrive/sensord/sensors/sensor.h"
 
 class FileSensor : public Sensor {
 protected:
-  std::ifstream file;
+  util::SysfsReader file;
 
 public:
   FileSensor(std::string filename);
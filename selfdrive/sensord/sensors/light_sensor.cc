@@ -7,11 +7,7 @@
 
 void LightSensor::get_event(cereal::SensorEventData::Builder &event) {
   uint64_t start_time = nanos_since_boot();
-  file.clear();
-  file.seekg(0);
-
-  int value;
-  file >> value;
+  int value = file.readInt().value_or(0);
 
   event.setSource(cereal::SensorEventData::SensorSource::RPR0521);
   event.setVersion(1);
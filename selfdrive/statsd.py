@@ -4,7 +4,7 @@ import zmq
 import time
 from pathlib import Path
 from datetime import datetime, timezone
-from typing import NoReturn
+from typing import Dict, NoReturn, Optional
 
 from common.params import Params
 from cereal.messaging import SubMaster
@@ -17,6 +17,11 @@ from selfdrive.loggerd.config import STATS_DIR, STATS_DIR_FILE_LIMIT, STATS_SOCK
 
 class METRIC_TYPE:
   GAUGE = 'g'
+  COUNTER = 'c'
+  HISTOGRAM = 'h'
+
+# upper bounds of the histogram buckets of selfdrive/common/statlog.cc
+HISTOGRAM_BOUNDS = [0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000]
 
 class StatLog:
   def __init__(self):
@@ -43,13 +48,55 @@ class StatLog:
     self._send(f"{name}:{value}|{METRIC_TYPE.GAUGE}")
 
 
+def merge_histogram(h: Optional[list], value: str) -> list:
+  count, total, lo, hi, *buckets = value.split(';')
+  new = [int(count), float(total), float(lo), float(hi), [int(b) for b in buckets]]
+  if h is None:
+    return new
+  return [h[0] + new[0], h[1] + new[1], min(h[2], new[2]), max(h[3], new[3]), [a + b for a, b in zip(h[4], new[4])]]
+
+
+def get_histogram_fields(h: list) -> dict:
+  count, total, lo, hi, buckets = h
+  # cumulative bucket counts, le_inf is the count
+  fields = {"count": count, "sum": total, "min": lo, "max": hi}
+  cumulative = 0
+  for bound, n in zip(HISTOGRAM_BOUNDS + ["inf"], buckets):
+    cumulative += n
+    fields[f"le_{bound}"] = cumulative
+  return fields
+
+
+def update_metrics(packet: str, gauges: dict, counters: Dict[str, float], histograms: Dict[str, list]) -> None:
+  # native processes batch their metrics, one per line
+  for metric in packet.splitlines():
+    try:
+      metric_type = metric.split('|')[1]
+      metric_name = metric.split(':')[0]
+      metric_value = metric.split('|')[0].split(':')[1]
+
+      if metric_type == METRIC_TYPE.GAUGE:
+        gauges[metric_name] = metric_value
+      elif metric_type == METRIC_TYPE.COUNTER:
+        counters[metric_name] = counters.get(metric_name, 0) + float(metric_value)
+      elif metric_type == METRIC_TYPE.HISTOGRAM:
+        histograms[metric_name] = merge_histogram(histograms.get(metric_name), metric_value)
+      else:
+        cloudlog.event("unknown metric type", metric_type=metric_type)
+    except Exception:
+      cloudlog.event("malformed metric", metric=metric)
+
+
 def main() -> NoReturn:
   dongle_id = Params().get("DongleId", encoding='utf-8')
-  def get_influxdb_line(measurement: str, value: float, timestamp: datetime, tags: dict) -> str:
+  def get_influxdb_line(measurement: str, value: float, timestamp: datetime, tags: dict, fields: Optional[dict] = None) -> str:
     res = f"{measurement}"
     for k, v in tags.items():
       res += f",{k}={str(v)}"
-    res += f" value={value},dongle_id=\"{dongle_id}\" {int(timestamp.timestamp() * 1e9)}\n"
+    res += f" value={value},"
+    for k, v in (fields or {}).items():
+      res += f"{k}={v},"
+    res += f"dongle_id=\"{dongle_id}\" {int(timestamp.timestamp() * 1e9)}\n"
     return res
 
   # open statistics socket
@@ -75,6 +122,8 @@ def main() -> NoReturn:
 
   last_flush_time = time.monotonic()
   gauges = {}
+  counters: Dict[str, float] = {}
+  histograms: Dict[str, list] = {}
   while True:
     started_prev = sm['deviceState'].started
     sm.update()
@@ -82,21 +131,12 @@ def main() -> NoReturn:
     # Update metrics
     while True:
       try:
-        metric = sock.recv_string(zmq.NOBLOCK)
-        try:
-          metric_type = metric.split('|')[1]
-          metric_name = metric.split(':')[0]
-          metric_value = metric.split('|')[0].split(':')[1]
-
-          if metric_type == METRIC_TYPE.GAUGE:
-            gauges[metric_name] = metric_value
-          else:
-            cloudlog.event("unknown metric type", metric_type=metric_type)
-        except Exception:
-          cloudlog.event("malformed metric", metric=metric)
+        packet = sock.recv_string(zmq.NOBLOCK)
       except zmq.error.Again:
         break
 
+      update_metrics(packet, gauges, counters, histograms)
+
     # flush when started state changes or after FLUSH_TIME_S
     if (time.monotonic() > last_flush_time + STATS_FLUSH_TIME_S) or (sm['deviceState'].started != started_prev):
       result = ""
@@ -106,9 +146,17 @@ def main() -> NoReturn:
       for gauge_key in gauges:
         result += get_influxdb_line(f"gauge.{gauge_key}", gauges[gauge_key], current_time, tags)
 
+      for counter_key in counters:
+        result += get_influxdb_line(f"counter.{counter_key}", counters[counter_key], current_time, tags)
+
+      for histogram_key, h in histograms.items():
+        result += get_influxdb_line(f"histogram.{histogram_key}", h[1] / max(h[0], 1), current_time, tags, get_histogram_fields(h))
+
       # clear intermediate data
       idx = 0
       gauges = {}
+      counters = {}
+      histograms = {}
       last_flush_time = time.monotonic()
 
       # check that we aren't filling up the drive
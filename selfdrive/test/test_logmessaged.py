@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+import json
+import unittest
+
+from selfdrive.logmessaged import SWAGLOG_BINARY_RECORD, SWAGLOG_RECORD_HEADER, decode_binary_record
+
+# a record sent by the C++ swaglog, for LOGE("value %d %s", 7, "x") on line 4 of dump.cc
+CPP_RECORD = bytes.fromhex(
+  "ff280400000038d6c20d63b5da41320007000400090000007b22646576696365223a20227063222c20226469727479223a20747275652c2022"
+  "76657273696f6e223a20224f504b52227d64756d702e63636d61696e76616c756520372078")
+
+
+def make_record(level, lineno, created, ctx, filename, funcname, msg):
+  fields = [s.encode() for s in (ctx, filename, funcname, msg)]
+  header = SWAGLOG_RECORD_HEADER.pack(level, lineno, created, *(len(f) for f in fields))
+  return bytes([SWAGLOG_BINARY_RECORD]) + header + b"".join(fields)
+
+
+class TestLogmessaged(unittest.TestCase):
+  def test_decode_cpp_record(self):
+    level, record = decode_binary_record(CPP_RECORD)
+    self.assertEqual(level, 40)
+    record = json.loads(record)
+    self.assertEqual(record["msg"], "value 7 x")
+    self.assertEqual(record["ctx"], {"device": "pc", "dirty": True, "version": "OPKR"})
+    self.assertEqual(record["levelnum"], 40)
+    self.assertEqual(record["filename"], "dump.cc")
+    self.assertEqual(record["lineno"], 4)
+    self.assertEqual(record["funcname"], "main")
+    self.assertAlmostEqual(record["created"], 1792379959.044, places=3)
+
+  def test_decode_long_utf8_record(self):
+    msg = "ünïcode " * 1000
+    dat = make_record(20, 123, 1.5, json.dumps({"dongle_id": "abc"}), "file.cc", "func", msg)
+    level, record = decode_binary_record(dat)
+    self.assertEqual(level, 20)
+    self.assertEqual(json.loads(record), {
+      "msg": msg,
+      "ctx": {"dongle_id": "abc"},
+      "levelnum": 20,
+      "filename": "file.cc",
+      "lineno": 123,
+      "funcname": "func",
+      "created": 1.5,
+    })
+
+  def test_binary_marker(self):
+    # the utf-8 records of the python swaglog can't start with the marker
+    self.assertEqual(CPP_RECORD[0], SWAGLOG_BINARY_RECORD)
+    with self.assertRaises(UnicodeDecodeError):
+      bytes([SWAGLOG_BINARY_RECORD]).decode("utf-8")
+
+
+if __name__ == "__main__":
+  unittest.main()
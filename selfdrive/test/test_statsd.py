@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+import unittest
+
+from selfdrive.statsd import HISTOGRAM_BOUNDS, get_histogram_fields, update_metrics
+
+
+def histogram_line(name, samples):
+  buckets = [0] * (len(HISTOGRAM_BOUNDS) + 1)
+  for s in samples:
+    buckets[next((i for i, b in enumerate(HISTOGRAM_BOUNDS) if s <= b), len(HISTOGRAM_BOUNDS))] += 1
+  fields = [str(len(samples)), f"{sum(samples):f}", f"{min(samples):f}", f"{max(samples):f}"] + [str(b) for b in buckets]
+  return f"{name}:{';'.join(fields)}|h"
+
+
+class TestStatsd(unittest.TestCase):
+  def test_batched_packet(self):
+    # as flushed by selfdrive/common/statlog.cc, twice
+    packets = [
+      "\n".join(["modeld.gauge:1.000000|g", "modeld.counter:2.000000|c", histogram_line("modeld.latency", [0.01, 3, 12000]), ""]),
+      "\n".join(["modeld.gauge:5.000000|g", "modeld.counter:3.000000|c", histogram_line("modeld.latency", [0.5, 3]),
+                 "not a metric", "modeld.unknown:1|x", ""]),
+    ]
+    gauges, counters, histograms = {}, {}, {}
+    for packet in packets:
+      update_metrics(packet, gauges, counters, histograms)
+
+    self.assertEqual(gauges, {"modeld.gauge": "5.000000"})
+    self.assertEqual(counters, {"modeld.counter": 5.0})
+    self.assertEqual(list(histograms.keys()), ["modeld.latency"])
+    count, total, lo, hi, buckets = histograms["modeld.latency"]
+    self.assertEqual(count, 5)
+    self.assertAlmostEqual(total, 12006.51)
+    self.assertEqual((lo, hi), (0.01, 12000))
+    self.assertEqual(len(buckets), len(HISTOGRAM_BOUNDS) + 1)
+
+    fields = get_histogram_fields(histograms["modeld.latency"])
+    self.assertEqual(fields["count"], 5)
+    self.assertEqual(fields["le_0.01"], 1)
+    self.assertEqual(fields["le_0.2"], 1)
+    self.assertEqual(fields["le_0.5"], 2)
+    self.assertEqual(fields["le_2"], 2)
+    self.assertEqual(fields["le_5"], 4)
+    self.assertEqual(fields["le_10000"], 4)
+    self.assertEqual(fields["le_inf"], 5)
+
+
+if __name__ == "__main__":
+  unittest.main()
@@ -0,0 +1,218 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "json11.hpp"
+
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/trace.h"
+#include "selfdrive/common/util.h"
+
+// Collects the spans of the processes built with --trace and writes them as a chrome trace
+// on exit, which chrome://tracing and ui.perfetto.dev open.
+//   usage: traced [output.json] [seconds]
+
+const int POLL_INTERVAL_MS = 100;
+
+ExitHandler do_exit;
+
+struct Thread {
+  int32_t tid;
+  std::string name;
+  uint32_t generation = 0;  // of the ring, while the thread owns it
+  uint64_t read = 0;  // events read from the ring
+  uint64_t dropped = 0;
+  std::vector<TraceEvent> events;
+};
+
+struct Process {
+  int32_t pid;
+  std::string name;
+  std::string fn;
+  TraceBuffer *buffer = nullptr;
+  std::vector<std::string> names;
+  std::vector<Thread> threads;
+  std::vector<size_t> ring_threads;  // the thread in threads that currently owns each ring
+};
+
+static TraceBuffer *map_buffer(const std::string &fn) {
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+
+  void *p = MAP_FAILED;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size == sizeof(TraceBuffer)) {
+    p = mmap(nullptr, sizeof(TraceBuffer), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (p == MAP_FAILED) return nullptr;
+
+  TraceBuffer *b = (TraceBuffer *)p;
+  if (b->magic.load(std::memory_order_acquire) != TRACE_MAGIC) {
+    munmap(p, sizeof(TraceBuffer));
+    return nullptr;
+  }
+  return b;
+}
+
+// reads the events of ring from t.read up to end
+static void drain_ring(const TraceRing &ring, Thread &t, uint64_t end) {
+  const uint64_t head = std::min(end, ring.head.load(std::memory_order_acquire));
+  uint64_t start = std::max(t.read, head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0);
+  const size_t copied = t.events.size();
+  for (uint64_t idx = start; idx < head; ++idx) {
+    t.events.push_back(ring.events[idx & (TRACE_RING_SIZE - 1)]);
+  }
+
+  // the writer may have lapped the events while they were copied
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const uint64_t head_after = ring.head.load(std::memory_order_relaxed);
+  const uint64_t valid = head_after >= TRACE_RING_SIZE ? head_after - TRACE_RING_SIZE + 1 : 0;
+  if (start < valid) {
+    const uint64_t overwritten = std::min(valid, head) - start;
+    t.events.erase(t.events.begin() + copied, t.events.begin() + copied + overwritten);
+    start += overwritten;
+  }
+  t.dropped += start - t.read;
+  t.read = head;
+}
+
+static void drain(Process &p) {
+  TraceBuffer *b = p.buffer;
+  const uint32_t num_names = std::min<uint32_t>(b->num_names.load(std::memory_order_acquire), TRACE_MAX_NAMES);
+  for (uint32_t i = p.names.size(); i < num_names; ++i) {
+    p.names.push_back(std::string(b->names[i], strnlen(b->names[i], TRACE_NAME_LEN)));
+  }
+
+  const uint32_t num_threads = std::min<uint32_t>(b->num_threads.load(std::memory_order_acquire), TRACE_MAX_THREADS);
+  p.ring_threads.resize(num_threads, SIZE_MAX);
+  for (uint32_t i = 0; i < num_threads; ++i) {
+    const TraceRing &ring = b->rings[i];
+    const uint32_t generation = ring.generation.load(std::memory_order_acquire);
+    const size_t owner = p.ring_threads[i];
+    if (owner != SIZE_MAX && p.threads[owner].generation == generation) {
+      drain_ring(ring, p.threads[owner], UINT64_MAX);
+      continue;
+    }
+
+    // a new thread took over the ring. skipped while it's being taken over
+    Thread t = {.tid = ring.tid, .name = std::string(ring.thread_name, strnlen(ring.thread_name, sizeof(ring.thread_name))),
+                .generation = generation, .read = ring.start};
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (generation % 2 != 0 || ring.generation.load(std::memory_order_relaxed) != generation) continue;
+
+    // the events of the previous thread end where the new one starts. the ones of threads that came
+    // and went between two polls go to the previous thread, or are dropped if traced never saw one
+    if (owner != SIZE_MAX) {
+      drain_ring(ring, p.threads[owner], t.read);
+    } else {
+      t.dropped = t.read;
+    }
+    p.ring_threads[i] = p.threads.size();
+    p.threads.push_back(t);
+    drain_ring(ring, p.threads.back(), UINT64_MAX);
+  }
+}
+
+static void write_trace(const std::map<int32_t, Process> &processes, const char *output) {
+  FILE *f = fopen(output, "w");
+  if (!f) {
+    fprintf(stderr, "failed to open %s: %s\n", output, strerror(errno));
+    return;
+  }
+
+  size_t total = 0, dropped = 0;
+  const char *sep = "";
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (auto &[pid, p] : processes) {
+    fprintf(f, "%s\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":%s}}", sep, pid, json11::Json(p.name).dump().c_str());
+    sep = ",";
+    std::vector<std::string> names;
+    for (auto &n : p.names) {
+      names.push_back(json11::Json(n).dump());
+    }
+    for (auto &t : p.threads) {
+      fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":%s}}", pid, t.tid, json11::Json(t.name).dump().c_str());
+      for (auto &e : t.events) {
+        const char *name = e.name_id < names.size() ? names[e.name_id].c_str() : "\"unknown\"";
+        fprintf(f, ",\n{\"ph\":\"X\",\"name\":%s,\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                name, pid, t.tid, e.start_ns / 1e3, e.duration_ns / 1e3);
+      }
+      total += t.events.size();
+      dropped += t.dropped;
+    }
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  printf("wrote %zu spans of %zu processes to %s, %zu dropped\n", total, processes.size(), output, dropped);
+}
+
+int main(int argc, char *argv[]) {
+  const char *output = argc > 1 ? argv[1] : "trace.json";
+  const double duration = argc > 2 ? atof(argv[2]) : 0;
+  const double start = seconds_since_boot();
+
+  // processes leave their buffers behind at exit while it's held
+  int lock_fd = open(TRACED_LOCK_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0664);
+  if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    fprintf(stderr, "failed to lock %s, is traced already running?\n", TRACED_LOCK_PATH);
+    return 1;
+  }
+
+  std::map<int32_t, Process> processes;
+  const std::string dir = "/dev/shm";
+  const std::string prefix = std::string(TRACE_SHM_PREFIX).substr(dir.size() + 1);
+  while (!do_exit && (duration <= 0 || seconds_since_boot() - start < duration)) {
+    // pick up the buffers of new processes
+    if (DIR *d = opendir(dir.c_str())) {
+      while (struct dirent *de = readdir(d)) {
+        if (strncmp(de->d_name, prefix.c_str(), prefix.size()) != 0) continue;
+
+        const int32_t pid = atoi(de->d_name + prefix.size());
+        if (processes.count(pid) == 0) {
+          const std::string fn = dir + "/" + de->d_name;
+          if (TraceBuffer *b = map_buffer(fn)) {
+            processes[pid] = {.pid = pid, .name = std::string(b->process_name, strnlen(b->process_name, sizeof(b->process_name))),
+                              .fn = fn, .buffer = b};
+            printf("tracing %s (%d)\n", processes[pid].name.c_str(), pid);
+          }
+        }
+      }
+      closedir(d);
+    }
+
+    for (auto &[pid, p] : processes) {
+      if (!p.buffer) continue;
+
+      // check before draining, so the last events of a process that's gone are read
+      const bool alive = kill(pid, 0) == 0 || errno != ESRCH;
+      drain(p);
+      if (!alive) {
+        munmap(p.buffer, sizeof(TraceBuffer));
+        p.buffer = nullptr;
+        unlink(p.fn.c_str());
+      }
+    }
+    util::sleep_for(POLL_INTERVAL_MS);
+  }
+
+  for (auto &[pid, p] : processes) {
+    if (p.buffer) drain(p);
+  }
+  write_trace(processes, output);
+  return 0;
+}
@@ -0,0 +1,215 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QProcess>
+#include <QThreadPool>
+#include <QTimer>
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <deque>
+#include <memory>
+
+#include "selfdrive/ui/replay/replay.h"
+
+// Replays many routes at once. each route gets its own messaging namespace, so the
+// routes and the processes under test don't see each other. see OPENPILOT_PREFIX.
+
+struct Job {
+  int id;
+  QString route;
+  QString ns;
+  Replay *replay = nullptr;
+  QProcess *proc = nullptr;
+  QElapsedTimer timer;
+  bool done = false;
+};
+
+class BatchReplay {
+public:
+  BatchReplay(const QStringList &routes, int jobs, const QString &cmd, const QString &output,
+              const QStringList &allow, const QStringList &block, uint32_t flags, const QString &data_dir)
+      : jobs_(jobs), cmd_(cmd), output_(output), allow_(allow), block_(block), flags_(flags), data_dir_(data_dir),
+        pending_(routes.begin(), routes.end()), total_(routes.size()) {}
+
+  void start() {
+    while (running_ < jobs_ && !pending_.empty()) {
+      startJob(pending_.front());
+      pending_.pop_front();
+    }
+    if (running_ == 0) {
+      qInfo() << "batch replay finished," << (total_ - failed_) << "of" << total_ << "routes passed";
+      qApp->exit(failed_ > 0 ? 1 : 0);
+    }
+  }
+
+  void stop() {
+    pending_.clear();
+    for (auto &job : std::vector<std::shared_ptr<Job>>(jobs_running_)) {
+      finishJob(job.get(), false);
+    }
+  }
+
+private:
+  void startJob(const QString &route) {
+    auto job = std::make_shared<Job>();
+    job->id = next_id_++;
+    job->route = route;
+    job->ns = QString("replay_%1").arg(job->id);
+    job->timer.start();
+    jobs_running_.push_back(job);
+    ++running_;
+
+    // start the process first, so its subscribers exist before the first message is published
+    if (!cmd_.isEmpty()) {
+      job->proc = new QProcess();
+      QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+      env.insert("OPENPILOT_PREFIX", job->ns);
+      job->proc->setProcessEnvironment(env);
+      job->proc->setProcessChannelMode(QProcess::MergedChannels);
+      job->proc->setStandardOutputFile(QDir(output_).filePath(QString(route).replace('|', '_') + ".log"));
+      QObject::connect(job->proc, qOverload<int, QProcess::ExitStatus>(&QProcess::finished), qApp, [=](int code, QProcess::ExitStatus status) {
+        if (!job->done) {
+          qWarning() << "[" << job->route << "] process exited before the end of route with code" << code;
+          finishJob(job.get(), status == QProcess::NormalExit && code == 0);
+          start();
+        }
+      });
+      job->proc->start("/bin/sh", {"-c", cmd_});
+    }
+
+    job->replay = new Replay(route, allow_, block_, nullptr, flags_, data_dir_, job->ns);
+    // streamFinished is emitted by the stream thread, qApp queues it to the main thread
+    QObject::connect(job->replay, &Replay::streamFinished, qApp, [=]() {
+      if (!job->done) {
+        finishJob(job.get(), true);
+        start();
+      }
+    });
+    qInfo() << "[" << route << "] start in namespace" << job->ns;
+    if (job->replay->load()) {
+      job->replay->start();
+    } else {
+      finishJob(job.get(), false);
+    }
+  }
+
+  void finishJob(Job *job, bool success) {
+    if (job->done) return;
+
+    job->done = true;
+    job->replay->stop();
+    job->replay->deleteLater();
+    if (job->proc) {
+      job->proc->disconnect();
+      if (job->proc->state() != QProcess::NotRunning) {
+        job->proc->terminate();
+        if (!job->proc->waitForFinished(5000)) {
+          job->proc->kill();
+          job->proc->waitForFinished();
+        }
+      }
+      job->proc->deleteLater();
+    }
+    failed_ += !success;
+    --running_;
+    qInfo() << "[" << job->route << "]" << (success ? "finished" : "failed") << "in" << job->timer.elapsed() / 1000.0 << "s";
+
+    jobs_running_.erase(std::remove_if(jobs_running_.begin(), jobs_running_.end(),
+                                       [=](auto &j) { return j.get() == job; }),
+                        jobs_running_.end());
+  }
+
+  const int jobs_;
+  const QString cmd_, output_;
+  const QStringList allow_, block_;
+  const uint32_t flags_;
+  const QString data_dir_;
+  std::deque<QString> pending_;
+  const int total_;
+  std::vector<std::shared_ptr<Job>> jobs_running_;
+  int next_id_ = 0, running_ = 0, failed_ = 0;
+};
+
+// the handler only sets the flag, the jobs are stopped from the event loop. a second signal kills the batch
+std::atomic<bool> do_exit = false;
+
+void sigHandler(int s) {
+  std::signal(s, SIG_DFL);
+  do_exit = true;
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  std::signal(SIGINT, sigHandler);
+  std::signal(SIGTERM, sigHandler);
+
+  const std::tuple<QString, REPLAY_FLAGS, QString> flags[] = {
+      {"dcam", REPLAY_FLAG_DCAM, "load driver camera"},
+      {"ecam", REPLAY_FLAG_ECAM, "load wide road camera"},
+      {"no-cache", REPLAY_FLAG_NO_FILE_CACHE, "turn off local cache"},
+      {"qcam", REPLAY_FLAG_QCAMERA, "load qcamera"},
+      {"yuv", REPLAY_FLAG_SEND_YUV, "send yuv frame"},
+      {"no-cuda", REPLAY_FLAG_NO_CUDA, "disable CUDA"},
+  };
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Replay many routes concurrently, each in its own messaging namespace.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("routes", "the drives to replay", "route...");
+  parser.addOption({{"j", "jobs"}, "number of routes replayed at once (default 1)", "jobs", "1"});
+  parser.addOption({{"w", "workers"}, "number of threads shared by all routes for downloading and decoding", "workers"});
+  parser.addOption({{"c", "cmd"}, "command run against each route, with OPENPILOT_PREFIX set to its namespace", "cmd"});
+  parser.addOption({{"o", "output"}, "directory for the output of the commands", "output", "."});
+  parser.addOption({{"a", "allow"}, "whitelist of services to send", "allow"});
+  parser.addOption({{"b", "block"}, "blacklist of services to send", "block"});
+  parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({"real-time", "publish with the log's timing instead of as fast as the readers keep up"});
+  for (auto &[name, _, desc] : flags) {
+    parser.addOption({name, desc});
+  }
+
+  parser.process(app);
+  const QStringList routes = parser.positionalArguments();
+  if (routes.empty()) {
+    parser.showHelp();
+  }
+
+  QStringList allow = parser.value("allow").isEmpty() ? QStringList{} : parser.value("allow").split(",");
+  QStringList block = parser.value("block").isEmpty() ? QStringList{} : parser.value("block").split(",");
+
+  uint32_t replay_flags = REPLAY_FLAG_NO_LOOP;
+  if (!parser.isSet("real-time")) {
+    replay_flags |= REPLAY_FLAG_VIRTUAL_TIME;
+  }
+  for (const auto &[name, flag, _] : flags) {
+    if (parser.isSet(name)) {
+      replay_flags |= flag;
+    }
+  }
+  // segment loading of all routes runs on the global pool, so the routes share the workers
+  if (parser.isSet("workers")) {
+    QThreadPool::globalInstance()->setMaxThreadCount(std::max(1, parser.value("workers").toInt()));
+  }
+  QDir().mkpath(parser.value("output"));
+
+  auto batch = new BatchReplay(routes, std::max(1, parser.value("jobs").toInt()), parser.value("cmd"), parser.value("output"),
+                               allow, block, replay_flags, parser.value("data_dir"));
+  // exit() only works once the event loop is running
+  QTimer::singleShot(0, [=]() { batch->start(); });
+
+  QTimer exit_timer;
+  QObject::connect(&exit_timer, &QTimer::timeout, [&]() {
+    if (do_exit) {
+      exit_timer.stop();
+      batch->stop();
+      qApp->exit(1);
+    }
+  });
+  exit_timer.start(100);
+  int ret = app.exec();
+  delete batch;
+  return ret;
+}
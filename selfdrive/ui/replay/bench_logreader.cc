@@ -0,0 +1,65 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <capnp/dynamic.h>
+
+#include "selfdrive/common/timing.h"
+#include "selfdrive/ui/replay/route.h"
+
+// Compares loading the logs of a route in full against loading a few services in a time window.
+
+static void bench(Route &route, const char *name, const std::vector<cereal::Event::Which> &allow, int start_sec, int end_sec) {
+  const double start_ts = millis_since_boot();
+  auto logs = route.loadLogs(allow, start_sec, end_sec, true);
+  const double elapsed = millis_since_boot() - start_ts;
+
+  size_t events = 0, memory = 0;
+  for (const auto &log : logs) {
+    events += log->events.size();
+    memory += log->memoryUsage();
+  }
+  qInfo().nospace() << name << ": " << logs.size() << " logs, " << events << " events, "
+                    << memory / (1024 * 1024) << " MB in " << elapsed << " ms";
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Benchmark filtered log loading against a full load.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("route", "the drive to load");
+  parser.addOption({{"a", "allow"}, "services to load", "allow", "carState,controlsState"});
+  parser.addOption({{"s", "start"}, "start of the window in seconds", "seconds", "120"});
+  parser.addOption({{"e", "end"}, "end of the window in seconds", "seconds", "180"});
+  parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.process(app);
+  if (parser.positionalArguments().empty()) {
+    parser.showHelp();
+  }
+
+  Route route(parser.positionalArguments().first(), parser.value("data_dir"));
+  if (!route.load()) {
+    qCritical() << "failed to load route" << route.name();
+    return 1;
+  }
+
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  std::vector<cereal::Event::Which> allow;
+  for (const QString &name : parser.value("allow").split(",")) {
+    KJ_IF_MAYBE(field, event_struct.findFieldByName(name.toStdString())) {
+      allow.push_back((cereal::Event::Which)field->getProto().getDiscriminantValue());
+    } else {
+      qCritical() << "unknown service" << name;
+      return 1;
+    }
+  }
+  const int start_sec = parser.value("start").toInt(), end_sec = parser.value("end").toInt();
+
+  // the full load reads the whole segments of the window. the first one downloads the logs into the cache
+  const int seg_start_sec = start_sec / 60 * 60, seg_end_sec = (end_sec + 59) / 60 * 60;
+  bench(route, "full (cold)", {}, seg_start_sec, seg_end_sec);
+  bench(route, "full", {}, seg_start_sec, seg_end_sec);
+  bench(route, "filtered", allow, start_sec, end_sec);
+  return 0;
+}
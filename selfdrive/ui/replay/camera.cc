@@ -5,7 +5,7 @@
 
 const int YUV_BUF_COUNT = 50;
 
-CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS], bool send_yuv) : send_yuv(send_yuv) {
+CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS], bool send_yuv, const std::string &ns) : send_yuv(send_yuv), ns_(ns) {
   for (int i = 0; i < MAX_CAMERAS; ++i) {
     std::tie(cameras_[i].width, cameras_[i].height) = camera_size[i];
   }
@@ -15,24 +15,39 @@ CameraServer::CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS], bool se
 CameraServer::~CameraServer() {
   for (auto &cam : cameras_) {
     if (cam.thread.joinable()) {
-      cam.queue.push({});
+      // the exit marker waits for room in the queue
+      while (!cam.queue.push({})) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
       cam.thread.join();
     }
   }
+  for (auto &cam : cameras_) {
+    if (cam.decode_thread.joinable()) {
+      {
+        std::lock_guard lk(cam.lock);
+        cam.exit = true;
+      }
+      cam.cv.notify_all();
+      cam.decode_thread.join();
+    }
+  }
   vipc_server_.reset(nullptr);
 }
 
 void CameraServer::startVipcServer() {
-  vipc_server_.reset(new VisionIpcServer("camerad"));
+  vipc_server_.reset(new VisionIpcServer(ns_.empty() ? "camerad" : ns_ + "/camerad"));
   for (auto &cam : cameras_) {
     if (cam.width > 0 && cam.height > 0) {
       std::cout << "camera[" << cam.type << "] frame size " << cam.width << "x" << cam.height << std::endl;
-      vipc_server_->create_buffers(cam.rgb_type, UI_BUF_COUNT, true, cam.width, cam.height);
+      // frames decoded ahead hold a buffer until they are sent
+      vipc_server_->create_buffers(cam.rgb_type, UI_BUF_COUNT + FRAME_DECODE_AHEAD + 1, true, cam.width, cam.height);
       if (send_yuv) {
-        vipc_server_->create_buffers(cam.yuv_type, YUV_BUF_COUNT, false, cam.width, cam.height);
+        vipc_server_->create_buffers(cam.yuv_type, YUV_BUF_COUNT + FRAME_DECODE_AHEAD + 1, false, cam.width, cam.height);
       }
       if (!cam.thread.joinable()) {
         cam.thread = std::thread(&CameraServer::cameraThread, this, std::ref(cam));
+        cam.decode_thread = std::thread(&CameraServer::decodeThread, this, std::ref(cam));
       }
     }
   }
@@ -40,20 +55,13 @@ void CameraServer::startVipcServer() {
 }
 
 void CameraServer::cameraThread(Camera &cam) {
-  auto read_frame = [&](FrameReader *fr, int frame_id) {
-    VisionBuf *rgb_buf = vipc_server_->get_buffer(cam.rgb_type);
-    VisionBuf *yuv_buf = send_yuv ? vipc_server_->get_buffer(cam.yuv_type) : nullptr;
-    bool ret = fr->get(frame_id, (uint8_t *)rgb_buf->addr, yuv_buf ? (uint8_t *)yuv_buf->addr : nullptr);
-    return ret ? std::pair{rgb_buf, yuv_buf} : std::pair{nullptr, nullptr};
-  };
-
   while (true) {
-    const auto [fr, eidx] = cam.queue.pop();
+    std::pair<std::shared_ptr<FrameReader>, cereal::EncodeIndex::Reader> item;
+    cam.queue.try_pop(item, -1);
+    const auto &[fr, eidx] = item;
     if (!fr) break;
 
-    const int id = eidx.getSegmentId();
-    bool prefetched = (id == cam.cached_id && eidx.getSegmentNum() == cam.cached_seg);
-    auto [rgb, yuv] = prefetched ? cam.cached_buf : read_frame(fr, id);
+    auto [id, rgb, yuv] = getFrame(cam, fr, eidx.getSegmentId());
     if (rgb || yuv) {
       VisionIpcBufExtra extra = {
           .frame_id = eidx.getFrameId(),
@@ -66,23 +74,104 @@ void CameraServer::cameraThread(Camera &cam) {
       std::cout << "camera[" << cam.type << "] failed to get frame:" << eidx.getSegmentId() << std::endl;
     }
 
-    cam.cached_id = id + 1;
-    cam.cached_seg = eidx.getSegmentNum();
-    cam.cached_buf = read_frame(fr, cam.cached_id);
+    {
+      std::lock_guard lk(publish_lock_);
+      --publishing_;
+    }
+    publish_cv_.notify_all();
+  }
+}
+
+// keeps the ring filled with the frames following the last requested one.
+// frames are decoded in order, so FrameReader only seeks to a key frame after a reset.
+void CameraServer::decodeThread(Camera &cam) {
+  std::unique_lock lk(cam.lock);
+  while (true) {
+    cam.cv.wait(lk, [&]() {
+      return cam.exit || (cam.fr && cam.frames.size() < FRAME_DECODE_AHEAD && cam.next_id < cam.fr->getFrameCount());
+    });
+    if (cam.exit) break;
+
+    std::shared_ptr<FrameReader> fr = cam.fr;
+    const int id = cam.next_id, generation = cam.generation;
+    cam.decoding = true;
+    lk.unlock();
+
+    VisionBuf *rgb_buf = vipc_server_->get_buffer(cam.rgb_type);
+    VisionBuf *yuv_buf = send_yuv ? vipc_server_->get_buffer(cam.yuv_type) : nullptr;
+    bool ret = fr->get(id, (uint8_t *)rgb_buf->addr, yuv_buf ? (uint8_t *)yuv_buf->addr : nullptr);
+
+    lk.lock();
+    cam.decoding = false;
+    if (generation == cam.generation) {
+      cam.frames.push_back(ret ? Frame{id, rgb_buf, yuv_buf} : Frame{id, nullptr, nullptr});
+      ++cam.next_id;
+    }
+    cam.cv.notify_all();
+  }
+}
+
+CameraServer::Frame CameraServer::getFrame(Camera &cam, const std::shared_ptr<FrameReader> &fr, int id) {
+  if (id < 0 || id >= fr->getFrameCount()) return {id, nullptr, nullptr};
 
-    --publishing_;
+  std::unique_lock lk(cam.lock);
+  const int first_id = cam.frames.empty() ? cam.next_id : cam.frames.front().id;
+  if (cam.fr != fr || id < first_id || id > cam.next_id) {
+    // seeked, or skipped past the decoded frames
+    cam.generation++;
+    cam.frames.clear();
+    cam.fr = fr;
+    cam.next_id = id;
   }
+  // drop the frames skipped by the stream
+  while (!cam.frames.empty() && cam.frames.front().id < id) {
+    cam.frames.pop_front();
+  }
+  cam.cv.notify_all();
+
+  cam.cv.wait(lk, [&]() { return !cam.frames.empty(); });
+  Frame frame = cam.frames.front();
+  cam.frames.pop_front();
+  cam.cv.notify_all();
+  return frame;
 }
 
-void CameraServer::pushFrame(CameraType type, FrameReader *fr, const cereal::EncodeIndex::Reader &eidx) {
+void CameraServer::stopDecoding(Camera &cam) {
+  std::unique_lock lk(cam.lock);
+  cam.generation++;
+  cam.frames.clear();
+  cam.fr = nullptr;
+  cam.cv.wait(lk, [&]() { return !cam.decoding; });
+}
+
+void CameraServer::pushFrame(CameraType type, std::shared_ptr<FrameReader> fr, const cereal::EncodeIndex::Reader &eidx) {
   auto &cam = cameras_[type];
   if (cam.width != fr->width || cam.height != fr->height) {
     cam.width = fr->width;
     cam.height = fr->height;
     waitFinish();
+    // decoded frames are in the buffers of the old server
+    for (auto &c : cameras_) {
+      stopDecoding(c);
+    }
     startVipcServer();
   }
 
-  ++publishing_;
-  cam.queue.push({fr, eidx});
+  {
+    std::lock_guard lk(publish_lock_);
+    ++publishing_;
+  }
+  if (!cam.queue.push({fr, eidx})) {
+    std::cout << "camera[" << cam.type << "] queue full, dropped frame:" << eidx.getSegmentId() << std::endl;
+    {
+      std::lock_guard lk(publish_lock_);
+      --publishing_;
+    }
+    publish_cv_.notify_all();
+  }
+}
+
+void CameraServer::waitFinish() {
+  std::unique_lock lk(publish_lock_);
+  publish_cv_.wait(lk, [this]() { return publishing_ == 0; });
 }
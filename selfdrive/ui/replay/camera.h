@@ -1,42 +1,66 @@
 #pragma once
 
 #include <unistd.h>
+
+#include <deque>
+
 #include "cereal/visionipc/visionipc_server.h"
 #include "selfdrive/common/queue.h"
 #include "selfdrive/ui/replay/framereader.h"
 #include "selfdrive/ui/replay/logreader.h"
 
+// frames decoded ahead of the stream, per camera
+const int FRAME_DECODE_AHEAD = 4;
+
 class CameraServer {
 public:
-  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr, bool send_yuv = false);
+  CameraServer(std::pair<int, int> camera_size[MAX_CAMERAS] = nullptr, bool send_yuv = false, const std::string &ns = "");
   ~CameraServer();
-  void pushFrame(CameraType type, FrameReader* fr, const cereal::EncodeIndex::Reader& eidx);
-  inline void waitFinish() {
-    while (publishing_ > 0) usleep(0);
-  }
+  void pushFrame(CameraType type, std::shared_ptr<FrameReader> fr, const cereal::EncodeIndex::Reader& eidx);
+  void waitFinish();
 
 protected:
+  struct Frame {
+    int id;
+    VisionBuf *rgb;
+    VisionBuf *yuv;
+  };
   struct Camera {
     CameraType type;
-    VisionStreamType rgb_type; 
+    VisionStreamType rgb_type;
     VisionStreamType yuv_type;
     int width;
     int height;
     std::thread thread;
-    SafeQueue<std::pair<FrameReader*, const cereal::EncodeIndex::Reader>> queue;
-    int cached_id = -1;
-    int cached_seg = -1;
-    std::pair<VisionBuf *, VisionBuf*> cached_buf;
+    // frames to publish. a camera more than a few seconds behind drops frames instead of queueing them
+    BoundedQueue<std::pair<std::shared_ptr<FrameReader>, cereal::EncodeIndex::Reader>> queue{64};
+
+    // decode-ahead ring, filled by decode_thread. protected by lock
+    std::thread decode_thread;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::shared_ptr<FrameReader> fr;
+    std::deque<Frame> frames;  // consecutive frames of fr, up to next_id
+    int next_id = 0;           // next frame to decode
+    int generation = 0;        // bumped when the ring is reset
+    bool decoding = false;
+    bool exit = false;
   };
   void startVipcServer();
   void cameraThread(Camera &cam);
+  void decodeThread(Camera &cam);
+  Frame getFrame(Camera &cam, const std::shared_ptr<FrameReader> &fr, int id);
+  void stopDecoding(Camera &cam);
 
   Camera cameras_[MAX_CAMERAS] = {
       {.type = RoadCam, .rgb_type = VISION_STREAM_RGB_BACK, .yuv_type = VISION_STREAM_ROAD},
       {.type = DriverCam, .rgb_type = VISION_STREAM_RGB_FRONT, .yuv_type = VISION_STREAM_DRIVER},
       {.type = WideRoadCam, .rgb_type = VISION_STREAM_RGB_WIDE, .yuv_type = VISION_STREAM_WIDE_ROAD},
   };
-  std::atomic<int> publishing_ = 0;
+  std::mutex publish_lock_;
+  std::condition_variable publish_cv_;
+  int publishing_ = 0;
   std::unique_ptr<VisionIpcServer> vipc_server_;
   bool send_yuv;
+  std::string ns_;
 };
@@ -1,36 +1,61 @@
 #include "selfdrive/ui/replay/filereader.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 #include "selfdrive/common/util.h"
 #include "selfdrive/ui/replay/util.h"
 
-std::string cacheFilePath(const std::string &url) {
+static const std::string &cacheDir() {
   static std::string cache_path = [] {
     const std::string comma_cache = util::getenv("COMMA_CACHE", "/tmp/comma_download_cache/");
     util::create_directories(comma_cache, 0755);
     return comma_cache.back() == '/' ? comma_cache : comma_cache + "/";
   }();
+  return cache_path;
+}
 
-  return cache_path + sha256(getUrlWithoutQuery(url));
+std::string cacheFilePath(const std::string &url) {
+  return cacheDir() + sha256(getUrlWithoutQuery(url));
+}
+
+FileReader::~FileReader() {
+  for (const auto &path : pinned_) {
+    FileCache::instance().release(path);
+  }
 }
 
 std::string FileReader::read(const std::string &file, std::atomic<bool> *abort) {
   const bool is_remote = file.find("https://") == 0;
-  const std::string local_file = is_remote ? cacheFilePath(file) : file;
-  std::string result;
+  if (is_remote && !cache_to_local_) {
+    return download(file, abort);
+  }
 
-  if ((!is_remote || cache_to_local_) && util::file_exists(local_file)) {
-    result = util::read_file(local_file);
-  } else if (is_remote) {
-    result = download(file, abort);
-    if (cache_to_local_ && !result.empty()) {
-      std::ofstream fs(local_file, std::ios::binary | std::ios::out);
-      fs.write(result.data(), result.size());
-    }
+  std::string local_file = localFile(file, abort);
+  return local_file.empty() ? "" : util::read_file(local_file);
+}
+
+std::string FileReader::localFile(const std::string &file, std::atomic<bool> *abort) {
+  const bool is_remote = file.find("https://") == 0;
+  if (!is_remote) {
+    return util::file_exists(file) ? file : "";
+  }
+  if (!cache_to_local_) return "";
+
+  std::string path = FileCache::instance().get(file, max_retries_, abort);
+  if (!path.empty()) {
+    pinned_.push_back(path);
   }
-  return result;
+  return path;
 }
 
 std::string FileReader::download(const std::string &url, std::atomic<bool> *abort) {
@@ -45,3 +70,191 @@ std::string FileReader::download(const std::string &url, std::atomic<bool> *abor
   }
   return {};
 }
+
+// class FileCache
+
+FileCache &FileCache::instance() {
+  static FileCache cache(cacheDir(), util::getenv("COMMA_CACHE_SIZE_MB", 10 * 1024) * 1024ULL * 1024ULL);
+  return cache;
+}
+
+FileCache::FileCache(const std::string &dir, size_t max_size, size_t range_size)
+    : dir_(dir), max_size_(max_size), range_size_(range_size) {
+  std::lock_guard lk(lock_);
+  loadManifest();
+  evict();
+}
+
+FileCache::~FileCache() {
+  std::lock_guard lk(lock_);
+  if (manifest_dirty_) {
+    saveManifest();
+  }
+}
+
+std::string FileCache::get(const std::string &url, int retries, std::atomic<bool> *abort) {
+  const std::string name = sha256(getUrlWithoutQuery(url));
+  {
+    // wait for a download of the same file by another segment loader
+    std::unique_lock lk(lock_);
+    while (downloading_.count(name) && !(abort && *abort)) {
+      cv_.wait_for(lk, std::chrono::milliseconds(100));
+    }
+    if (abort && *abort) return {};
+
+    if (cached(name)) {
+      // a hit only moves the file up the LRU order, which is not worth a write of the manifest
+      auto &e = entries_[name];
+      e.last_access = ++access_counter_;
+      e.pins++;
+      manifest_dirty_ = true;
+      return dir_ + name;
+    } else if (struct stat st = {}; stat((dir_ + name).c_str(), &st) == 0) {
+      // cached by a version without the manifest
+      entries_[name].pins++;
+      add(name, st.st_size);
+      return dir_ + name;
+    }
+    downloading_.insert(name);
+  }
+
+  bool success = download(url, name, retries, abort);
+  {
+    // it's pinned before it's no longer kept as downloading
+    std::lock_guard lk(lock_);
+    if (success) entries_[name].pins++;
+    downloading_.erase(name);
+  }
+  cv_.notify_all();
+  return success ? dir_ + name : "";
+}
+
+void FileCache::release(const std::string &path) {
+  std::lock_guard lk(lock_);
+  auto it = entries_.find(path.substr(dir_.size()));
+  if (it != entries_.end() && it->second.pins > 0) {
+    it->second.pins--;
+  }
+  // files pinned past the size limit are evicted once released
+  if (total_size_ > max_size_) {
+    evict();
+    saveManifest();
+  }
+}
+
+bool FileCache::download(const std::string &url, const std::string &name, int retries, std::atomic<bool> *abort) {
+  const size_t size = getRemoteFileSize(url);
+  if (size == 0) return false;
+
+  // read the ranges cached by an interrupted download, the others are downloaded
+  std::string result(size, '\0');
+  std::vector<std::pair<size_t, size_t>> missing;
+  auto range_name = [&](size_t begin, size_t end) { return util::string_format("%s.%zu-%zu", name.c_str(), begin, end); };
+  for (size_t begin = 0; begin < size; begin += range_size_) {
+    const size_t end = std::min(begin + range_size_, size);
+    bool range_cached = false;
+    {
+      std::lock_guard lk(lock_);
+      range_cached = cached(range_name(begin, end));
+    }
+    // ranges of a file that is downloading are not evicted, so they can be read without the lock
+    std::string data = range_cached ? util::read_file(dir_ + range_name(begin, end)) : "";
+    if (data.size() == end - begin) {
+      memcpy(result.data() + begin, data.data(), data.size());
+    } else {
+      missing.push_back({begin, end});
+    }
+  }
+
+  auto on_range = [&](size_t begin, size_t end) {
+    const std::string range = range_name(begin, end);
+    if (util::write_file((dir_ + range).c_str(), result.data() + begin, end - begin, O_WRONLY | O_CREAT | O_TRUNC) == 0) {
+      std::lock_guard lk(lock_);
+      add(range, end - begin);
+    }
+    missing.erase(std::find(missing.begin(), missing.end(), std::pair{begin, end}));
+  };
+  for (int i = 0; i <= retries && !missing.empty() && !(abort && *abort); ++i) {
+    if (i > 0) {
+      std::cout << "download failed, retrying " << i << std::endl;
+    }
+    httpGetRanges(url, result, std::vector(missing), on_range, abort);
+  }
+  if (!missing.empty()) return false;
+
+  // replace the ranges with the complete file
+  const std::string tmp_file = dir_ + name + ".tmp";
+  if (util::write_file(tmp_file.c_str(), result.data(), result.size(), O_WRONLY | O_CREAT | O_TRUNC) != 0 ||
+      ::rename(tmp_file.c_str(), (dir_ + name).c_str()) != 0) {
+    return false;
+  }
+  std::lock_guard lk(lock_);
+  for (size_t begin = 0; begin < size; begin += range_size_) {
+    remove(range_name(begin, std::min(begin + range_size_, size)));
+  }
+  add(name, size);
+  return true;
+}
+
+bool FileCache::cached(const std::string &name) {
+  return entries_.count(name) && util::file_exists(dir_ + name);
+}
+
+void FileCache::add(const std::string &name, size_t size) {
+  auto &e = entries_[name];
+  total_size_ += size - e.size;
+  e.size = size;
+  e.last_access = ++access_counter_;
+  evict();
+  saveManifest();
+}
+
+void FileCache::remove(const std::string &name) {
+  if (auto it = entries_.find(name); it != entries_.end()) {
+    total_size_ -= it->second.size;
+    entries_.erase(it);
+  }
+  ::unlink((dir_ + name).c_str());
+}
+
+void FileCache::evict() {
+  while (total_size_ > max_size_) {
+    // files that are downloading, and their ranges, are kept, and so are the files being read
+    auto lru = entries_.end();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->second.pins == 0 && !downloading_.count(it->first.substr(0, it->first.find('.'))) &&
+          (lru == entries_.end() || it->second.last_access < lru->second.last_access)) {
+        lru = it;
+      }
+    }
+    if (lru == entries_.end()) break;
+
+    std::string name = lru->first;
+    remove(name);
+  }
+}
+
+// the manifest has a line of "name size last_access" per cached file
+void FileCache::loadManifest() {
+  std::istringstream manifest(util::read_file(dir_ + "manifest"));
+  std::string name;
+  size_t size = 0;
+  uint64_t last_access = 0;
+  while (manifest >> name >> size >> last_access) {
+    entries_[name] = {.size = size, .last_access = last_access};
+    total_size_ += size;
+    access_counter_ = std::max(access_counter_, last_access);
+  }
+}
+
+void FileCache::saveManifest() {
+  std::string manifest;
+  for (const auto &[name, e] : entries_) {
+    manifest += util::string_format("%s %zu %llu\n", name.c_str(), e.size, (unsigned long long)e.last_access);
+  }
+  const std::string tmp_file = dir_ + "manifest.tmp";
+  if (util::write_file(tmp_file.c_str(), manifest.data(), manifest.size(), O_WRONLY | O_CREAT | O_TRUNC) == 0) {
+    ::rename(tmp_file.c_str(), (dir_ + "manifest").c_str());
+    manifest_dirty_ = false;
+  }
+}
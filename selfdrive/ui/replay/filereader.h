@@ -1,20 +1,75 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 class FileReader {
 public:
   FileReader(bool cache_to_local, size_t chunk_size = 0, int retries = 3)
       : cache_to_local_(cache_to_local), chunk_size_(chunk_size), max_retries_(retries) {}
-  virtual ~FileReader() {}
+  virtual ~FileReader();
   std::string read(const std::string &file, std::atomic<bool> *abort = nullptr);
+  // path of a local copy of file, downloaded to the cache if needed. empty if there is none.
+  // a cached copy is not evicted until the FileReader is destroyed
+  std::string localFile(const std::string &file, std::atomic<bool> *abort = nullptr);
 
 private:
   std::string download(const std::string &url, std::atomic<bool> *abort);
   size_t chunk_size_;
   int max_retries_;
   bool cache_to_local_;
+  std::vector<std::string> pinned_;
 };
 
 std::string cacheFilePath(const std::string &url);
+
+// bytes per cached range of a file that is still downloading
+const size_t FILE_CACHE_RANGE_SIZE = 10 * 1024 * 1024;
+
+// The download cache in COMMA_CACHE, bounded to COMMA_CACHE_SIZE_MB with least recently used eviction.
+// Files are downloaded in ranges that are cached as they complete, so an interrupted download resumes
+// where it stopped. Entries are kept in a manifest next to the cached files.
+class FileCache {
+public:
+  static FileCache &instance();
+  // dir ends with a '/'. instance() is the cache in COMMA_CACHE, tests make their own
+  FileCache(const std::string &dir, size_t max_size, size_t range_size = FILE_CACHE_RANGE_SIZE);
+  ~FileCache();
+  // path of the cached copy of url, downloading it first if needed. empty if the download failed.
+  // concurrent calls for the same url share one download. the file is pinned until release(path)
+  std::string get(const std::string &url, int retries, std::atomic<bool> *abort = nullptr);
+  void release(const std::string &path);
+
+private:
+  struct Entry {
+    size_t size = 0;
+    uint64_t last_access = 0;
+    int pins = 0;  // readers of the file, it's not evicted while they hold it
+  };
+
+  bool download(const std::string &url, const std::string &name, int retries, std::atomic<bool> *abort);
+  bool cached(const std::string &name);
+  void add(const std::string &name, size_t size);
+  void remove(const std::string &name);
+  void evict();
+  void loadManifest();
+  void saveManifest();
+
+  const std::string dir_;
+  const size_t max_size_;
+  const size_t range_size_;
+  // the following variables must be protected with lock_
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::set<std::string> downloading_;
+  size_t total_size_ = 0;
+  uint64_t access_counter_ = 0;
+  // only the access times changed since the manifest was saved, it's saved on exit
+  bool manifest_dirty_ = false;
+};
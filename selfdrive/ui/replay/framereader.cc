@@ -1,9 +1,16 @@
 #include "selfdrive/ui/replay/framereader.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <cassert>
 #include "libyuv.h"
 
 #include "cereal/visionipc/visionbuf.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/ui/replay/util.h"
 
 namespace {
 
@@ -35,6 +42,22 @@ enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *
   return AV_PIX_FMT_YUV420P;
 }
 
+// Table 7-1
+enum HevcNalType {
+  HEVC_NAL_TYPE_BLA_W_LP = 16,
+  HEVC_NAL_TYPE_CRA_NUT = 21,
+  HEVC_NAL_TYPE_RSV_IRAP_VCL23 = 23,
+  HEVC_NAL_TYPE_VPS_NUT = 32,
+  HEVC_NAL_TYPE_PPS_NUT = 34,
+};
+
+const uint8_t *findStartCode(const uint8_t *p, const uint8_t *end) {
+  for (; p + 3 <= end; ++p) {
+    if (p[0] == 0 && p[1] == 0 && p[2] == 1) return p;
+  }
+  return end;
+}
+
 }  // namespace
 
 FrameReader::FrameReader() {}
@@ -52,10 +75,19 @@ FrameReader::~FrameReader() {
     av_freep(&avio_ctx_->buffer);
     avio_context_free(&avio_ctx_);
   }
+  if (map_) munmap(map_, map_size_);
 }
 
 bool FrameReader::load(const std::string &url, bool no_cuda, std::atomic<bool> *abort, bool local_cache, int chunk_size, int retries) {
   FileReader f(local_cache, chunk_size, retries);
+  // local and cached raw hevc files are mapped instead of read and demuxed
+  const std::string path = getUrlWithoutQuery(url);
+  if (path.size() > 5 && path.compare(path.size() - 5, 5, ".hevc") == 0) {
+    if (std::string file = f.localFile(url, abort); !file.empty()) {
+      return loadMapped(file, no_cuda);
+    }
+  }
+
   std::string data = f.read(url, abort);
   if (data.empty()) return false;
 
@@ -99,20 +131,7 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_cuda, std::at
   ret = avcodec_parameters_to_context(decoder_ctx, video->codecpar);
   if (ret != 0) return false;
 
-  width = (decoder_ctx->width + 3) & ~3;
-  height = decoder_ctx->height;
-  visionbuf_compute_aligned_width_and_height(width, height, &aligned_width, &aligned_height);
-
-  if (has_cuda_device && !no_cuda) {
-    if (!initHardwareDecoder(AV_HWDEVICE_TYPE_CUDA)) {
-      printf("No CUDA capable device was found. fallback to CPU decoding.\n");
-    } else {
-      nv12toyuv_buffer.resize(getYUVSize());
-    }
-  }
-
-  ret = avcodec_open2(decoder_ctx, decoder, nullptr);
-  if (ret < 0) return false;
+  if (!openDecoder(decoder, no_cuda)) return false;
 
   packets.reserve(60 * 20);  // 20fps, one minute
   while (!(abort && *abort)) {
@@ -124,6 +143,7 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_cuda, std::at
       break;
     }
     packets.push_back(pkt);
+    memory_usage_ += sizeof(AVPacket) + pkt->size;
     // some stream seems to contian no keyframes
     key_frames_count_ += pkt->flags & AV_PKT_FLAG_KEY;
   }
@@ -131,6 +151,91 @@ bool FrameReader::load(const std::byte *data, size_t size, bool no_cuda, std::at
   return valid_;
 }
 
+bool FrameReader::loadMapped(const std::string &file, bool no_cuda) {
+  int fd = HANDLE_EINTR(open(file.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) return false;
+
+  struct stat st = {};
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map_ = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    map_size_ = st.st_size;
+  }
+  close(fd);
+  if (map_ == nullptr || map_ == MAP_FAILED) {
+    map_ = nullptr;
+    printf("failed to map %s\n", file.c_str());
+    return false;
+  }
+
+  // split the stream into frames at the first slice of each picture, the same as tools/lib/vidindex.
+  // the parameter sets before the first frame are passed to the decoder as extradata.
+  const uint8_t *data = (const uint8_t *)map_, *end = data + map_size_;
+  std::vector<std::pair<size_t, bool>> frames;  // offset, key frame
+  std::string extradata;
+  for (const uint8_t *nal = findStartCode(data, end); nal < end;) {
+    const uint8_t *next = findStartCode(nal + 3, end);
+    if (next - nal < 6) break;
+
+    const int nal_type = (nal[3] >> 1) & 0x3f;
+    if (nal_type >= HEVC_NAL_TYPE_VPS_NUT && nal_type <= HEVC_NAL_TYPE_PPS_NUT && frames.empty()) {
+      extradata.append((const char *)nal, next - nal);
+    } else if (nal_type <= HEVC_NAL_TYPE_CRA_NUT && (nal[5] & 0x80)) {  // first_slice_segment_in_pic_flag
+      frames.push_back({nal - data, nal_type >= HEVC_NAL_TYPE_BLA_W_LP && nal_type <= HEVC_NAL_TYPE_RSV_IRAP_VCL23});
+    }
+    nal = next;
+  }
+  if (frames.empty() || extradata.empty()) {
+    printf("no frames in %s\n", file.c_str());
+    return false;
+  }
+
+  AVCodec *decoder = avcodec_find_decoder(AV_CODEC_ID_HEVC);
+  if (!decoder) return false;
+
+  decoder_ctx = avcodec_alloc_context3(decoder);
+  decoder_ctx->extradata = (uint8_t *)av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+  decoder_ctx->extradata_size = extradata.size();
+  memcpy(decoder_ctx->extradata, extradata.data(), extradata.size());
+  if (!openDecoder(decoder, no_cuda)) return false;
+
+  // the packets are not reference counted, they point into the mapping.
+  // avcodec_send_packet copies a packet only while it is being decoded.
+  packets.reserve(frames.size());
+  for (int i = 0; i < frames.size(); ++i) {
+    const size_t frame_end = i + 1 < frames.size() ? frames[i + 1].first : map_size_;
+    AVPacket *pkt = av_packet_alloc();
+    pkt->data = (uint8_t *)data + frames[i].first;
+    pkt->size = frame_end - frames[i].first;
+    pkt->flags = frames[i].second ? AV_PKT_FLAG_KEY : 0;
+    packets.push_back(pkt);
+    // pages of the mapping are resident once decoded
+    memory_usage_ += sizeof(AVPacket) + pkt->size;
+    key_frames_count_ += frames[i].second;
+  }
+  valid_ = true;
+  return valid_;
+}
+
+bool FrameReader::openDecoder(AVCodec *decoder, bool no_cuda) {
+  if (has_cuda_device && !no_cuda) {
+    if (!initHardwareDecoder(AV_HWDEVICE_TYPE_CUDA)) {
+      printf("No CUDA capable device was found. fallback to CPU decoding.\n");
+    }
+  }
+
+  int ret = avcodec_open2(decoder_ctx, decoder, nullptr);
+  if (ret < 0) return false;
+
+  // for a raw stream, the size is known once the decoder has parsed the parameter sets
+  width = (decoder_ctx->width + 3) & ~3;
+  height = decoder_ctx->height;
+  visionbuf_compute_aligned_width_and_height(width, height, &aligned_width, &aligned_height);
+  if (hw_pix_fmt != AV_PIX_FMT_NONE) {
+    nv12toyuv_buffer.resize(getYUVSize());
+  }
+  return width > 0 && height > 0;
+}
+
 bool FrameReader::initHardwareDecoder(AVHWDeviceType hw_device_type) {
   for (int i = 0;; i++) {
     const AVCodecHWConfig *config = avcodec_get_hw_config(decoder_ctx->codec, i);
@@ -21,16 +21,21 @@ public:
   ~FrameReader();
   bool load(const std::string &url, bool no_cuda = false, std::atomic<bool> *abort = nullptr, bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, bool no_cuda = false, std::atomic<bool> *abort = nullptr);
+  // decodes a local raw hevc file straight from a mapping of it, without demuxing
+  bool loadMapped(const std::string &file, bool no_cuda = false);
   bool get(int idx, uint8_t *rgb, uint8_t *yuv);
   int getRGBSize() const { return aligned_width * aligned_height * 3; }
   int getYUVSize() const { return width * height * 3 / 2; }
   size_t getFrameCount() const { return packets.size(); }
+  // bytes held by the packets, safe to call while loading
+  size_t memoryUsage() const { return memory_usage_; }
   bool valid() const { return valid_; }
 
   int width = 0, height = 0;
   int aligned_width = 0, aligned_height = 0;
 
 private:
+  bool openDecoder(AVCodec *decoder, bool no_cuda);
   bool initHardwareDecoder(AVHWDeviceType hw_device_type);
   bool decode(int idx, uint8_t *rgb, uint8_t *yuv);
   AVFrame * decodeFrame(AVPacket *pkt);
@@ -41,8 +46,12 @@ private:
   AVFormatContext *input_ctx = nullptr;
   AVCodecContext *decoder_ctx = nullptr;
   int key_frames_count_ = 0;
+  std::atomic<size_t> memory_usage_ = 0;
   bool valid_ = false;
   AVIOContext *avio_ctx_ = nullptr;
+  // mapped raw hevc file, the packets point into it
+  void *map_ = nullptr;
+  size_t map_size_ = 0;
 
   AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
   AVBufferRef *hw_device_ctx = nullptr;
@@ -1,7 +1,14 @@
 #include "selfdrive/ui/replay/logreader.h"
 
+#include <bzlib.h>
+#include <capnp/schema.h>
+
 #include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <iostream>
+#include <tuple>
+
 #include "selfdrive/ui/replay/util.h"
 
 Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(amsg), frame(frame) {
@@ -25,15 +32,83 @@ Event::Event(const kj::ArrayPtr<const capnp::word> &amsg, bool frame) : reader(a
   }
 }
 
+// reads the union tag and logMonoTime of an Event message without building a reader.
+// returns false for messages it can't read this way, e.g. with far pointers
+static bool peekEvent(const kj::ArrayPtr<const capnp::word> &msg, uint16_t &which, uint64_t &mono_time) {
+  static const auto [which_offset, mono_time_offset] = []() {
+    auto schema = capnp::Schema::from<cereal::Event>().asStruct();
+    // in units of the field size
+    return std::pair{schema.getProto().getStruct().getDiscriminantOffset() * sizeof(uint16_t),
+                     schema.getFieldByName("logMonoTime").getProto().getSlot().getOffset() * sizeof(uint64_t)};
+  }();
+
+  // a single segment message is the segment table (segment count - 1, size), the root pointer and the root struct
+  uint32_t segments = 0;
+  uint64_t root = 0;
+  if (msg.size() < 2) return false;
+  memcpy(&segments, msg.begin(), sizeof(segments));
+  memcpy(&root, msg.begin() + 1, sizeof(root));
+  if (segments != 0 || root == 0 || (root & 3) != 0) return false;
+
+  const int32_t offset = (int32_t)(root & 0xffffffff) >> 2;
+  const size_t data_size = ((root >> 32) & 0xffff) * sizeof(capnp::word);
+  const capnp::byte *data = (const capnp::byte *)(msg.begin() + 2 + offset);
+  if (offset < 0 || msg.begin() + 2 + offset + data_size / sizeof(capnp::word) > msg.end()) return false;
+
+  // fields past the end of the data section are 0
+  which = 0;
+  mono_time = 0;
+  if (which_offset + sizeof(which) <= data_size) memcpy(&which, data + which_offset, sizeof(which));
+  if (mono_time_offset + sizeof(mono_time) <= data_size) memcpy(&mono_time, data + mono_time_offset, sizeof(mono_time));
+  return true;
+}
+
+// events are parsed almost in time order, so they are sorted by merging the ascending runs
+void sortEvents(std::vector<Event *> &events) {
+  std::vector<size_t> runs = {0};
+  for (size_t i = 1; i < events.size(); ++i) {
+    if (Event::lessThan()(events[i], events[i - 1])) runs.push_back(i);
+  }
+  runs.push_back(events.size());
+
+  // merge adjacent runs pairwise until one is left
+  while (runs.size() > 2) {
+    std::vector<size_t> merged = {0};
+    size_t i = 2;
+    for (; i < runs.size(); i += 2) {
+      std::inplace_merge(events.begin() + runs[i - 2], events.begin() + runs[i - 1], events.begin() + runs[i], Event::lessThan());
+      merged.push_back(runs[i]);
+    }
+    if (i - 1 < runs.size()) {
+      merged.push_back(runs.back());
+    }
+    runs.swap(merged);
+  }
+}
+
 // class LogReader
 
-LogReader::LogReader(size_t memory_pool_block_size) {
+LogReader::LogReader(size_t memory_pool_block_size) : pool_block_size_(memory_pool_block_size) {
 #ifdef HAS_MEMORY_RESOURCE
   const size_t buf_size = sizeof(Event) * memory_pool_block_size;
   pool_buffer_ = ::operator new(buf_size);
   mbr_ = new std::pmr::monotonic_buffer_resource(pool_buffer_, buf_size);
 #endif
   events.reserve(memory_pool_block_size);
+  memory_usage_ = memory_pool_block_size * (sizeof(Event) + sizeof(Event *));
+}
+
+void LogReader::setFilter(const LogFilter &filter) {
+  filtered_ = true;
+  filter_allow_.clear();
+  if (!filter.allow.empty()) {
+    filter_allow_.resize(capnp::Schema::from<cereal::Event>().asStruct().getUnionFields().size());
+    for (auto which : filter.allow) {
+      filter_allow_[which] = true;
+    }
+  }
+  filter_start_ns_ = filter.start_ns;
+  filter_end_ns_ = filter.end_ns;
 }
 
 LogReader::~LogReader() {
@@ -56,20 +131,166 @@ bool LogReader::load(const std::string &url, std::atomic<bool> *abort, bool loca
 }
 
 bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abort) {
-  raw_ = decompressBZ2(data, size);
-  if (raw_.empty()) {
-    std::cout << "failed to decompress log" << std::endl;
+  if (size == 0) return false;
+
+  bool parse_error = false;
+  size_t offset = 0, skip = 0;
+  {
+    // logs made of several bz2 streams or blocks are decompressed in parallel, on the pool shared by all the readers
+    BZ2StreamDecoder decoder(data, size, 0, abort);
+    std::string piece;
+    while (decoder.pieces() > 1 && !parse_error && !(abort && *abort) && decoder.next(piece)) {
+      for (size_t pos = 0; pos < piece.size() && !parse_error;) {
+        auto out = chunkBuffer();
+        const size_t len = std::min(out.size(), piece.size() - pos);
+        memcpy(out.begin(), piece.data() + pos, len);
+        pos += len;
+        parse_error = !chunkWritten(len);
+      }
+    }
+    std::tie(offset, skip) = decoder.resumePoint();
+  }
+
+  // logs that can't be split, and the rest of a log after a piece that failed, are decompressed serially
+  int bzerror = BZ_STREAM_END;
+  if (!parse_error && offset < size) {
+    bz_stream strm = {};
+    bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+    assert(bzerror == BZ_OK);
+    strm.next_in = (char *)data + offset;
+    strm.avail_in = size - offset;
+
+    // the output of the stream that the parallel path already handed over is dropped
+    std::string skipped(std::min(skip, LOG_CHUNK_SIZE), '\0');
+    while (skip > 0 && bzerror == BZ_OK) {
+      strm.next_out = skipped.data();
+      strm.avail_out = std::min(skip, skipped.size());
+      bzerror = BZ2_bzDecompress(&strm);
+      const size_t len = strm.next_out - skipped.data();
+      if (len == 0) break;
+      skip -= len;
+    }
+
+    // decompress a chunk at a time and parse the messages completed so far,
+    // so events are available before the whole log is decompressed
+    while (skip == 0 && bzerror == BZ_OK && !(abort && *abort)) {
+      auto out = chunkBuffer();
+      strm.next_out = out.begin();
+      strm.avail_out = out.size();
+      const unsigned int prev_avail_in = strm.avail_in;
+      bzerror = BZ2_bzDecompress(&strm);
+      const size_t len = strm.next_out - out.begin();
+      if (!chunkWritten(len)) {
+        parse_error = true;
+        break;
+      }
+
+      // logs are written as a sequence of bz2 streams, continue with the next one
+      if (bzerror == BZ_STREAM_END && strm.avail_in > 0) {
+        char *next_in = strm.next_in;
+        unsigned int avail_in = strm.avail_in;
+        BZ2_bzDecompressEnd(&strm);
+        strm = {};
+        bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+        assert(bzerror == BZ_OK);
+        strm.next_in = next_in;
+        strm.avail_in = avail_in;
+      } else if (bzerror == BZ_OK && len == 0 && strm.avail_in == prev_avail_in) {
+        // truncated
+        break;
+      }
+    }
+    BZ2_bzDecompressEnd(&strm);
+  }
+
+  std::lock_guard lk(lock_);
+  if (bzerror != BZ_STREAM_END || parse_error) {
+    if (events.empty()) {
+      std::cout << "failed to decompress log" << std::endl;
+      return false;
+    }
+    std::cout << "read " << events.size() << " events from corrupt log" << std::endl;
+  }
+
+  sortEvents(events);
+  return true;
+}
+
+// free space at the end of the current chunk to decompress into.
+// when the chunk is full, the incomplete message at its end is moved to a new chunk.
+kj::ArrayPtr<char> LogReader::chunkBuffer() {
+  if (chunks_.empty() || chunk_filled_ == chunks_.back().size() * sizeof(capnp::word)) {
+    kj::ArrayPtr<const capnp::word> tail;
+    size_t chunk_words = LOG_CHUNK_SIZE / sizeof(capnp::word);
+    if (!chunks_.empty()) {
+      tail = chunks_.back().slice(chunk_parsed_, chunks_.back().size());
+      chunk_words = std::max(chunk_words, (size_t)capnp::expectedSizeInWordsFromPrefix(tail) * 2);
+    }
+    if (filtered_ && !chunks_.empty() && chunks_.back().size() >= chunk_words) {
+      // the parsed messages were copied out, so the chunk is reused
+      memmove(chunks_.back().begin(), tail.begin(), tail.size() * sizeof(capnp::word));
+    } else {
+      auto chunk = kj::heapArray<capnp::word>(chunk_words);
+      memcpy(chunk.begin(), tail.begin(), tail.size() * sizeof(capnp::word));
+      std::lock_guard lk(lock_);
+      memory_usage_ += chunk.size() * sizeof(capnp::word);
+      if (filtered_ && !chunks_.empty()) {
+        memory_usage_ -= chunks_.back().size() * sizeof(capnp::word);
+        chunks_.pop_back();
+      }
+      chunks_.push_back(std::move(chunk));
+    }
+    chunk_filled_ = tail.size() * sizeof(capnp::word);
+    chunk_parsed_ = 0;
+  }
+  auto bytes = chunks_.back().asBytes();
+  return kj::arrayPtr((char *)bytes.begin() + chunk_filled_, (char *)bytes.end());
+}
+
+// parses the messages completed by the len bytes written to chunkBuffer()
+bool LogReader::chunkWritten(size_t len) {
+  chunk_filled_ += len;
+  auto &chunk = chunks_.back();
+  try {
+    chunk_parsed_ += parseChunk(chunk.slice(chunk_parsed_, chunk_filled_ / sizeof(capnp::word)));
+  } catch (const kj::Exception &e) {
+    std::cout << "failed to parse log : " << e.getDescription().cStr() << std::endl;
     return false;
   }
+  if (on_progress) on_progress();
+  return true;
+}
 
+// parse the complete messages at the start of words, returns the number of words consumed
+size_t LogReader::parseChunk(const kj::ArrayPtr<const capnp::word> &words) {
+  std::vector<Event *> new_events;
+  auto add_events = [&]() {
+    std::lock_guard lk(lock_);
+    // the first pool_block_size_ events are in the preallocated pool
+    const size_t prev_size = std::max(events.size(), pool_block_size_);
+    events.insert(events.end(), new_events.begin(), new_events.end());
+    if (events.size() > prev_size) {
+      memory_usage_ += (events.size() - prev_size) * (sizeof(Event) + sizeof(Event *));
+    }
+  };
+
+  size_t offset = 0;
   try {
-    kj::ArrayPtr<const capnp::word> words((const capnp::word *)raw_.data(), raw_.size() / sizeof(capnp::word));
-    while (words.size() > 0) {
+    while (offset < words.size()) {
+      auto msg = words.slice(offset, words.size());
+      const size_t msg_size = capnp::expectedSizeInWordsFromPrefix(msg);
+      if (msg_size > msg.size()) break;
+      msg = msg.slice(0, msg_size);
+      offset += msg_size;
+      if (filtered_) {
+        if (!filterAccepts(msg)) continue;
+        msg = keepMessage(msg);
+      }
 
 #ifdef HAS_MEMORY_RESOURCE
-      Event *evt = new (mbr_) Event(words);
+      Event *evt = new (mbr_) Event(msg);
 #else
-      Event *evt = new Event(words);
+      Event *evt = new Event(msg);
 #endif
 
       // Add encodeIdx packet again as a frame packet for the video stream
@@ -78,24 +299,101 @@ bool LogReader::load(const std::byte *data, size_t size, std::atomic<bool> *abor
           evt->which == cereal::Event::WIDE_ROAD_ENCODE_IDX) {
 
 #ifdef HAS_MEMORY_RESOURCE
-        Event *frame_evt = new (mbr_) Event(words, true);
+        Event *frame_evt = new (mbr_) Event(msg, true);
 #else
-        Event *frame_evt = new Event(words, true);
+        Event *frame_evt = new Event(msg, true);
 #endif
 
-        events.push_back(frame_evt);
+        new_events.push_back(frame_evt);
       }
-
-      words = kj::arrayPtr(evt->reader.getEnd(), words.end());
-      events.push_back(evt);
+      new_events.push_back(evt);
     }
   } catch (const kj::Exception &e) {
-    std::cout << "failed to parse log : " << e.getDescription().cStr() << std::endl;
-    if (events.empty()) return false;
+    // keep the events before the corrupt message
+    add_events();
+    throw;
+  }
 
-    std::cout << "read " << events.size() << " events from corrupt log" << std::endl;
+  add_events();
+  return offset;
+}
+
+bool LogReader::filterAccepts(const kj::ArrayPtr<const capnp::word> &msg) {
+  uint16_t which = 0;
+  uint64_t mono_time = 0;
+  if (!peekEvent(msg, which, mono_time)) {
+    capnp::FlatArrayMessageReader reader(msg);
+    auto event = reader.getRoot<cereal::Event>();
+    which = event.which();
+    mono_time = event.getLogMonoTime();
   }
 
-  std::sort(events.begin(), events.end(), Event::lessThan());
-  return true;
+  if (first_mono_time_ == 0) first_mono_time_ = mono_time;
+  const uint64_t t = mono_time - std::min(mono_time, first_mono_time_);
+  if (t < filter_start_ns_ || t >= filter_end_ns_) return false;
+  return filter_allow_.empty() || (which < filter_allow_.size() && filter_allow_[which]);
+}
+
+// copies a message out of the chunk, into blocks that are only allocated for the kept messages
+kj::ArrayPtr<const capnp::word> LogReader::keepMessage(const kj::ArrayPtr<const capnp::word> &msg) {
+  if (kept_.empty() || kept_used_ + msg.size() > kept_.back().size()) {
+    auto block = kj::heapArray<capnp::word>(std::max(FILTERED_LOG_BLOCK_SIZE / sizeof(capnp::word), msg.size()));
+    memory_usage_ += block.size() * sizeof(capnp::word);
+    kept_.push_back(std::move(block));
+    kept_used_ = 0;
+  }
+  capnp::word *dst = kept_.back().begin() + kept_used_;
+  memcpy(dst, msg.begin(), msg.size() * sizeof(capnp::word));
+  kept_used_ += msg.size();
+  return kj::arrayPtr((const capnp::word *)dst, msg.size());
+}
+
+std::vector<Event *> LogReader::loadedEvents() {
+  std::vector<Event *> result;
+  {
+    std::lock_guard lk(lock_);
+    result = events;
+  }
+  sortEvents(result);
+  return result;
+}
+
+const std::vector<Event *> &LogReader::eventsOf(cereal::Event::Which which) {
+  std::lock_guard lk(lock_);
+  auto [it, inserted] = index_.try_emplace(which);
+  if (inserted) {
+    std::copy_if(events.begin(), events.end(), std::back_inserter(it->second), [=](auto e) { return e->which == which; });
+  }
+  return it->second;
+}
+
+// class EventMerger
+
+EventMerger::EventMerger(const std::vector<const std::vector<Event *> *> &segments, const Event *after) {
+  for (auto events : segments) {
+    auto it = std::upper_bound(events->begin(), events->end(), after, Event::lessThan());
+    if (it != events->end()) {
+      cursors_.push_back({it, events->end()});
+    }
+  }
+  findNext();
+}
+
+EventMerger &EventMerger::operator++() {
+  if (++cur_->first == cur_->second) {
+    cursors_.erase(cursors_.begin() + (cur_ - cursors_.data()));
+  }
+  findNext();
+  return *this;
+}
+
+void EventMerger::findNext() {
+  // there are only a few segments, a linear scan is cheaper than a heap.
+  // on equal events the earlier segment goes first, the same as a stable merge
+  cur_ = nullptr;
+  for (auto &c : cursors_) {
+    if (!cur_ || Event::lessThan()(*c.first, *cur_->first)) {
+      cur_ = &c;
+    }
+  }
 }
@@ -5,6 +5,10 @@
 #include <memory_resource>
 #endif
 
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
 #include "cereal/gen/cpp/log.capnp.h"
 #include "selfdrive/camerad/cameras/camera_common.h"
 #include "selfdrive/ui/replay/filereader.h"
@@ -12,6 +16,19 @@
 const CameraType ALL_CAMERAS[] = {RoadCam, DriverCam, WideRoadCam};
 const int MAX_CAMERAS = std::size(ALL_CAMERAS);
 const int DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE = 65000;
+const size_t LOG_CHUNK_SIZE = 4 * 1024 * 1024;  // bytes of decompressed log per chunk
+const size_t FILTERED_LOG_BLOCK_SIZE = 1024 * 1024;  // bytes of kept messages per block, with a LogFilter
+
+// Loads only some of the events of a log. The other messages are skipped by peeking at their
+// union tag and logMonoTime, without building a reader, and nothing is allocated for them.
+struct LogFilter {
+  // empty allows all types
+  std::vector<cereal::Event::Which> allow;
+  // window of logMonoTime in ns. it counts from the first message of this log, not from the start of the route,
+  // so Route::loadLogs gives each segment's log the window relative to that segment
+  uint64_t start_ns = 0;
+  uint64_t end_ns = UINT64_MAX;
+};
 
 class Event {
 public:
@@ -50,15 +67,66 @@ class LogReader {
 public:
   LogReader(size_t memory_pool_block_size = DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE);
   ~LogReader();
+  // must be set before load(). pass a small memory_pool_block_size to the constructor if few events are expected
+  void setFilter(const LogFilter &filter);
   bool load(const std::string &url, std::atomic<bool> *abort = nullptr, bool local_cache = false, int chunk_size = -1, int retries = 0);
   bool load(const std::byte *data, size_t size, std::atomic<bool> *abort = nullptr);
+  // sorted copy of the events parsed so far, safe to call while loading
+  std::vector<Event*> loadedEvents();
+  // events of one type in time order, indexed on first use. only valid once load() returned
+  const std::vector<Event*> &eventsOf(cereal::Event::Which which);
+  // bytes held by the decompressed log and the events, safe to call while loading
+  inline size_t memoryUsage() const { return memory_usage_; }
 
+  // called from the loading thread whenever another chunk of events is available
+  std::function<void()> on_progress;
+  // sorted once load() returns
   std::vector<Event*> events;
 
 private:
-  std::string raw_;
+  kj::ArrayPtr<char> chunkBuffer();
+  bool chunkWritten(size_t len);
+  size_t parseChunk(const kj::ArrayPtr<const capnp::word> &words);
+  bool filterAccepts(const kj::ArrayPtr<const capnp::word> &msg);
+  kj::ArrayPtr<const capnp::word> keepMessage(const kj::ArrayPtr<const capnp::word> &msg);
+
+  std::mutex lock_;
+  // decompressed log, events point into these
+  std::vector<kj::Array<capnp::word>> chunks_;
+  size_t chunk_filled_ = 0, chunk_parsed_ = 0;  // in bytes, words of the last chunk
+  std::unordered_map<int, std::vector<Event*>> index_;
+  const size_t pool_block_size_;
+  // with a filter the messages kept are copied out of the chunk, which is then reused
+  bool filtered_ = false;
+  std::vector<bool> filter_allow_;
+  uint64_t filter_start_ns_ = 0, filter_end_ns_ = UINT64_MAX;
+  uint64_t first_mono_time_ = 0;
+  std::vector<kj::Array<capnp::word>> kept_;
+  size_t kept_used_ = 0;  // words of the last block
+  std::atomic<size_t> memory_usage_ = 0;
 #ifdef HAS_MEMORY_RESOURCE
   std::pmr::monotonic_buffer_resource *mbr_ = nullptr;
   void *pool_buffer_ = nullptr;
 #endif
 };
+
+// stable sort by Event::lessThan, fast on events that are almost in order
+void sortEvents(std::vector<Event*> &events);
+
+// Iterates the sorted events of several segments in time order.
+// The segments are merged lazily instead of being copied into one sorted list.
+class EventMerger {
+public:
+  // starts at the first event after `after`
+  EventMerger(const std::vector<const std::vector<Event*> *> &segments, const Event *after);
+  inline bool end() const { return cur_ == nullptr; }
+  inline const Event *operator*() const { return *cur_->first; }
+  EventMerger &operator++();
+
+private:
+  void findNext();
+
+  typedef std::vector<Event*>::const_iterator Iterator;
+  std::vector<std::pair<Iterator, Iterator>> cursors_;
+  std::pair<Iterator, Iterator> *cur_ = nullptr;
+};
@@ -9,7 +9,6 @@
 
 #include "selfdrive/ui/replay/replay.h"
 
-const QString DEMO_ROUTE = "4cf7a6ad03080c90|2021-09-29--13-46-36";
 struct termios oldt = {};
 Replay *replay = nullptr;
 
@@ -71,6 +70,11 @@ void keyboardThread(Replay *replay_) {
       replay_->seekTo(0, true);
     } else if (c == ' ') {
       replay_->pause(!replay_->isPaused());
+    } else if (c == 'i') {
+      auto stats = replay_->memoryStats();
+      qInfo() << "memory" << stats.used / (1024 * 1024) << "/" << stats.budget / (1024 * 1024) << "MB,"
+              << stats.segments_loaded << "segments loaded," << stats.segments_loading << "loading, prefetching segments"
+              << stats.window_first << "-" << stats.window_last;
     }
   }
 }
@@ -103,6 +107,7 @@ int main(int argc, char *argv[]) {
       {"qcam", REPLAY_FLAG_QCAMERA, "load qcamera"},
       {"yuv", REPLAY_FLAG_SEND_YUV, "send yuv frame"},
       {"no-cuda", REPLAY_FLAG_NO_CUDA, "disable CUDA"},
+      {"virtual-time", REPLAY_FLAG_VIRTUAL_TIME, "publish as fast as the readers keep up, with the log's clock. run the readers with VIRTUAL_TIME=1"},
   };
 
   QCommandLineParser parser;
@@ -114,6 +119,8 @@ int main(int argc, char *argv[]) {
   parser.addOption({{"s", "start"}, "start from <seconds>", "seconds"});
   parser.addOption({"demo", "use a demo route instead of providing your own"});
   parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({"memory", "memory budget for the segments prefetched ahead, in MB", "memory"});
+  parser.addOption({"ns", "publish in the messaging namespace <ns>, see OPENPILOT_PREFIX", "ns"});
   for (auto &[name, _, desc] : flags) {
     parser.addOption({name, desc});
   }
@@ -134,7 +141,10 @@ int main(int argc, char *argv[]) {
       replay_flags |= flag;
     }
   }
-  replay = new Replay(route, allow, block, nullptr, replay_flags, parser.value("data_dir"), &app);
+  replay = new Replay(route, allow, block, nullptr, replay_flags, parser.value("data_dir"), parser.value("ns"), &app);
+  if (parser.isSet("memory")) {
+    replay->setMemoryBudget(parser.value("memory").toULongLong() * 1024 * 1024);
+  }
   if (!replay->load()) {
     return 0;
   }
@@ -10,8 +10,8 @@
 #include "selfdrive/hardware/hw.h"
 #include "selfdrive/ui/replay/util.h"
 
-Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *sm_, uint32_t flags, QString data_dir, QObject *parent)
-    : sm(sm_), flags_(flags), QObject(parent) {
+Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *sm_, uint32_t flags, QString data_dir, QString ns, QObject *parent)
+    : sm(sm_), flags_(flags), ns_(ns.toStdString()), QObject(parent) {
   std::vector<const char *> s;
   auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
   sockets_.resize(event_struct.getUnionFields().size());
@@ -25,11 +25,9 @@ Replay::Replay(QString route, QStringList allow, QStringList block, SubMaster *s
   qDebug() << "services " << s;
 
   if (sm == nullptr) {
-    pm = std::make_unique<PubMaster>(s);
+    pm = std::make_unique<PubMaster>(s, ns_);
   }
   route_ = std::make_unique<Route>(route, data_dir);
-  events_ = std::make_unique<std::vector<Event *>>();
-  new_events_ = std::make_unique<std::vector<Event *>>();
 
   connect(this, &Replay::seekTo, this, &Replay::doSeek);
   connect(this, &Replay::segmentChanged, this, &Replay::queueSegment);
@@ -56,6 +54,10 @@ void Replay::stop() {
 }
 
 bool Replay::load() {
+  if ((flags_ & REPLAY_FLAG_VIRTUAL_TIME) && sm == nullptr && messaging_use_zmq()) {
+    qCritical() << "virtual time needs msgq, zmq can't tell when the readers are done";
+    return false;
+  }
   if (!route_->load()) {
     qCritical() << "failed to load route" << route_->name() << "from server";
     return false;
@@ -128,33 +130,60 @@ void Replay::setCurrentSegment(int n) {
   }
 }
 
-void Replay::segmentLoadFinished(bool success) {
+void Replay::segmentLoadFinished(int seg_num, bool success) {
   if (!success) {
-    Segment *seg = qobject_cast<Segment *>(sender());
-    qWarning() << "failed to load segment " << seg->seg_num << ", removing it from current replay list";
-    segments_.erase(seg->seg_num);
+    qWarning() << "failed to load segment " << seg_num << ", removing it from current replay list";
+    segments_.erase(seg_num);
   }
   queueSegment();
 }
 
+void Replay::segmentLogProgress(int seg_num) {
+  // only the current segment is streamed while loading
+  auto it = segments_.find(seg_num);
+  if (seg_num == current_segment_ && it != segments_.end() && it->second && !it->second->isLoaded()) {
+    queueSegment();
+  }
+}
+
 void Replay::queueSegment() {
   if (segments_.empty()) return;
 
   SegmentMap::iterator cur, end;
   cur = end = segments_.lower_bound(std::min(current_segment_.load(), segments_.rbegin()->first));
-  for (int i = 0; end != segments_.end() && i <= FORWARD_SEGS; ++i) {
-    ++end;
+
+  // segments not loaded yet are as large as the average loaded one
+  size_t loaded_size = 0;
+  int loaded = 0;
+  for (auto &[n, seg] : segments_) {
+    if (seg && seg->isLoaded()) {
+      loaded_size += seg->memoryUsage();
+      ++loaded;
+    }
+  }
+  const size_t estimate = loaded > 0 ? loaded_size / loaded : SEGMENT_SIZE_ESTIMATE;
+  auto segment_size = [=](const std::unique_ptr<Segment> &seg) -> size_t {
+    if (!seg) return estimate;
+    return seg->isLoaded() ? seg->memoryUsage() : std::max(estimate, seg->memoryUsage());
+  };
+
+  // prefetch ahead of the playhead until the budget is reached, at least the current and the next segment
+  size_t window_size = 0;
+  for (int i = 0; end != segments_.end() && (i < 2 || window_size + segment_size(end->second) <= memory_budget_); ++i, ++end) {
+    window_size += segment_size(end->second);
   }
-  // load one segment at a time
+
+  // the current segment is loaded alone, the ones after it in parallel once it's ready
+  const int max_loading = cur->second && cur->second->isLoaded() ? MAX_PARALLEL_SEGMENT_LOADS : 1;
+  int loading = std::count_if(cur, end, [](auto &e) { return e.second && !e.second->isLoaded(); });
   for (auto it = cur; it != end; ++it) {
-    if (!it->second) {
-      if (it == cur || std::prev(it)->second->isLoaded()) {
-        auto &[n, seg] = *it;
-        seg = std::make_unique<Segment>(n, route_->at(n), flags_);
-        QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
-        qDebug() << "loading segment" << n << "...";
-      }
-      break;
+    if (!it->second && (it == cur || loading < max_loading)) {
+      auto &[n, seg] = *it;
+      seg = std::make_unique<Segment>(n, route_->at(n), flags_);
+      QObject::connect(seg.get(), &Segment::loadFinished, this, &Replay::segmentLoadFinished);
+      QObject::connect(seg.get(), &Segment::logProgress, this, &Replay::segmentLogProgress);
+      qDebug() << "loading segment" << n << "...";
+      ++loading;
     }
   }
   const auto &cur_segment = cur->second;
@@ -164,59 +193,105 @@ void Replay::queueSegment() {
   auto begin = segments_.find(cur_segment->seg_num - 1);
   if (begin == segments_.end() || !(begin->second && begin->second->isLoaded())) {
     begin = cur;
+  } else {
+    window_size += segment_size(begin->second);
   }
   mergeSegments(begin, end);
 
-  // free segments out of current semgnt window.
-  std::for_each(segments_.begin(), begin, [](auto &e) { e.second.reset(nullptr); });
+  // free the segments after the window, and the farthest ones behind the playhead that don't fit in
+  // what's left of the budget. segments behind that are still loading were left by a seek, they are freed too.
   std::for_each(end, segments_.end(), [](auto &e) { e.second.reset(nullptr); });
+  size_t behind_size = window_size;
+  for (auto it = std::make_reverse_iterator(begin); it != segments_.rend(); ++it) {
+    if (auto &seg = it->second) {
+      behind_size += segment_size(seg);
+      if (!seg->isLoaded() || behind_size > memory_budget_) {
+        seg.reset(nullptr);
+      }
+    }
+  }
+
+  {
+    std::lock_guard lk(stats_lock_);
+    stats_ = {.budget = memory_budget_, .window_first = cur->first, .window_last = std::prev(end)->first};
+    for (auto &[n, seg] : segments_) {
+      if (seg) {
+        stats_.used += seg->memoryUsage();
+        if (seg->isLoaded()) {
+          ++stats_.segments_loaded;
+        } else {
+          ++stats_.segments_loading;
+        }
+      }
+    }
+  }
 
   // start stream thread
-  if (stream_thread_ == nullptr && cur_segment->isLoaded()) {
-    startStream(cur_segment.get());
+  if (stream_thread_ == nullptr && isSegmentMerged(cur_segment->seg_num)) {
+    startStream();
   }
 }
 
+ReplayMemoryStats Replay::memoryStats() {
+  std::lock_guard lk(stats_lock_);
+  return stats_;
+}
+
 void Replay::mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end) {
-  // merge 3 segments in sequence.
+  // merge 3 segments in sequence. the stream thread iterates them in time order without copying.
   std::vector<int> segments_need_merge;
-  size_t new_events_size = 0;
-  for (auto it = begin; it != end && it->second->isLoaded() && segments_need_merge.size() < 3; ++it) {
+  std::vector<Event *> partial_events;
+  int partial_segment = -1;
+  for (auto it = begin; it != end && it->second && segments_need_merge.size() < 3; ++it) {
+    if (!it->second->isLoaded()) {
+      // merge the events parsed so far of a segment that is still loading.
+      // in virtual time only complete segments are played, so no event is skipped
+      if (!(flags_ & REPLAY_FLAG_VIRTUAL_TIME) && (partial_events = it->second->log->loadedEvents()).size() > 0) {
+        partial_segment = it->first;
+        segments_need_merge.push_back(it->first);
+      }
+      break;
+    }
     segments_need_merge.push_back(it->first);
-    new_events_size += it->second->log->events.size();
   }
 
-  if (segments_need_merge != segments_merged_) {
-    qDebug() << "merge segments" << segments_need_merge;
-    new_events_->clear();
-    new_events_->reserve(new_events_size);
-    for (int n : segments_need_merge) {
-      const auto &e = segments_[n]->log->events;
-      auto middle = new_events_->insert(new_events_->end(), e.begin(), e.end());
-      std::inplace_merge(new_events_->begin(), middle, new_events_->end(), Event::lessThan());
-    }
-
+  if (segments_need_merge != segments_merged_ || partial_segment != -1 || partial_segment_ != -1) {
+    qDebug() << "merge segments" << segments_need_merge << (partial_segment != -1 ? "(partial)" : "");
     updateEvents([&]() {
-      events_.swap(new_events_);
       segments_merged_ = segments_need_merge;
+      partial_segment_ = partial_segment;
+      partial_events_.swap(partial_events);
       return true;
     });
   }
 }
 
-void Replay::startStream(const Segment *cur_segment) {
-  const auto &events = cur_segment->log->events;
+const std::vector<Event *> &Replay::segmentEvents(int n) {
+  return n == partial_segment_ ? partial_events_ : segments_[n]->log->events;
+}
+
+void Replay::startStream() {
+  // the stream thread isn't running yet, so the merged segments can be read without the lock
+  const Segment *cur_segment = segments_[segments_merged_[0]].get();
+  auto find_event = [&](cereal::Event::Which which) -> const Event * {
+    if (cur_segment->isLoaded()) {
+      const auto &events = cur_segment->log->eventsOf(which);
+      return events.empty() ? nullptr : events[0];
+    }
+    const auto &events = segmentEvents(cur_segment->seg_num);
+    auto it = std::find_if(events.begin(), events.end(), [=](auto e) { return e->which == which; });
+    return it != events.end() ? *it : nullptr;
+  };
 
   // get route start time from initData
-  auto it = std::find_if(events.begin(), events.end(), [](auto e) { return e->which == cereal::Event::Which::INIT_DATA; });
-  route_start_ts_ = it != events.end() ? (*it)->mono_time : events[0]->mono_time;
+  const Event *init_data = find_event(cereal::Event::Which::INIT_DATA);
+  route_start_ts_ = init_data ? init_data->mono_time : segmentEvents(cur_segment->seg_num)[0]->mono_time;
   cur_mono_time_ += route_start_ts_;
 
   // write CarParams
-  it = std::find_if(events.begin(), events.end(), [](auto e) { return e->which == cereal::Event::Which::CAR_PARAMS; });
-  if (it != events.end()) {
-    auto bytes = (*it)->bytes();
-    Params().put("CarParams", (const char *)bytes.begin(), bytes.size());
+  if (const Event *car_params = find_event(cereal::Event::Which::CAR_PARAMS)) {
+    auto bytes = car_params->bytes();
+    Params(ns_.empty() ? "" : Path::params() + "/" + ns_).put("CarParams", (const char *)bytes.begin(), bytes.size());
   } else {
     qWarning() << "failed to read CarParams from current segment";
   }
@@ -224,11 +299,12 @@ void Replay::startStream(const Segment *cur_segment) {
   // start camera server
   std::pair<int, int> camera_size[MAX_CAMERAS] = {};
   for (auto type : ALL_CAMERAS) {
-    if (auto &fr = cur_segment->frames[type]) {
+    if (cur_segment->isFrameLoaded(type)) {
+      auto &fr = cur_segment->frames[type];
       camera_size[type] = {fr->width, fr->height};
     }
   }
-  camera_server_ = std::make_unique<CameraServer>(camera_size, flags_ & REPLAY_FLAG_SEND_YUV);
+  camera_server_ = std::make_unique<CameraServer>(camera_size, flags_ & REPLAY_FLAG_SEND_YUV, ns_);
 
   // start stream thread
   stream_thread_ = new QThread();
@@ -246,7 +322,8 @@ void Replay::publishMessage(const Event *e) {
       sockets_[e->which] = nullptr;
     }
   } else {
-    sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], e->event}});
+    const uint64_t current_time = flags_ & REPLAY_FLAG_VIRTUAL_TIME ? e->mono_time : nanos_since_boot();
+    sm->update_msgs(current_time, {{sockets_[e->which], e->event}});
   }
 }
 
@@ -263,7 +340,28 @@ void Replay::publishFrame(const Event *e) {
   auto eidx = capnp::AnyStruct::Reader(e->event).getPointerSection()[0].getAs<cereal::EncodeIndex>();
   if (eidx.getType() == cereal::EncodeIndex::Type::FULL_H_E_V_C && isSegmentMerged(eidx.getSegmentNum())) {
     CameraType cam = cam_types.at(e->which);
-    camera_server_->pushFrame(cam, segments_[eidx.getSegmentNum()]->frames[cam].get(), eidx);
+    // frames of a segment that is still loading are skipped
+    const auto &seg = segments_[eidx.getSegmentNum()];
+    if (seg->isFrameLoaded(cam)) {
+      camera_server_->pushFrame(cam, seg->frames[cam], eidx);
+    }
+  }
+}
+
+// in virtual time, the next event is published once all readers are done with this one,
+// that is once they asked for their next message or exited
+void Replay::waitForReaders(const Event *e) {
+  if (e->frame) {
+    camera_server_->waitFinish();
+    return;
+  }
+  if (sm != nullptr || sockets_[e->which] == nullptr) return;
+
+  bool warned = false;
+  while (!pm->wait_readers_done(sockets_[e->which], VIRTUAL_TIME_READER_TIMEOUT_MS) && !updating_events_) {
+    if (!std::exchange(warned, true)) {
+      qWarning() << "waiting for the readers of" << sockets_[e->which];
+    }
   }
 }
 
@@ -279,8 +377,12 @@ void Replay::stream() {
     if (exit_) break;
 
     Event cur_event(cur_which, cur_mono_time_);
-    auto eit = std::upper_bound(events_->begin(), events_->end(), &cur_event, Event::lessThan());
-    if (eit == events_->end()) {
+    std::vector<const std::vector<Event *> *> segment_events;
+    for (int n : segments_merged_) {
+      segment_events.push_back(&segmentEvents(n));
+    }
+    EventMerger eit(segment_events, &cur_event);
+    if (eit.end()) {
       qDebug() << "waiting for events...";
       continue;
     }
@@ -288,14 +390,15 @@ void Replay::stream() {
     uint64_t evt_start_ts = cur_mono_time_;
     uint64_t loop_start_ts = nanos_since_boot();
 
-    for (auto end = events_->end(); !updating_events_ && eit != end; ++eit) {
-      const Event *evt = (*eit);
+    for (; !updating_events_ && !eit.end(); ++eit) {
+      const Event *evt = *eit;
       cur_which = evt->which;
       cur_mono_time_ = evt->mono_time;
       const int current_ts = currentSeconds();
       if (last_print > current_ts || (current_ts - last_print) > 5.0) {
         last_print = current_ts;
-        qInfo() << "at " << current_ts << "s";
+        auto stats = memoryStats();
+        qInfo() << "at " << current_ts << "s, memory" << stats.used / (1024 * 1024) << "/" << stats.budget / (1024 * 1024) << "MB";
       }
       setCurrentSegment(current_ts / 60);
 
@@ -309,7 +412,7 @@ void Replay::stream() {
       }
 
       if (cur_which < sockets_.size() && sockets_[cur_which] != nullptr) {
-        // keep time
+        // keep time. in virtual time, publish as fast as the readers keep up
         long etime = cur_mono_time_ - evt_start_ts;
         long rtime = nanos_since_boot() - loop_start_ts;
         long behind_ns = etime - rtime;
@@ -318,7 +421,7 @@ void Replay::stream() {
           // reset start times
           evt_start_ts = cur_mono_time_;
           loop_start_ts = nanos_since_boot();
-        } else if (behind_ns > 0) {
+        } else if (behind_ns > 0 && !(flags_ & REPLAY_FLAG_VIRTUAL_TIME)) {
           precise_nano_sleep(behind_ns);
         }
 
@@ -327,16 +430,24 @@ void Replay::stream() {
         } else {
           publishMessage(evt);
         }
+        if (flags_ & REPLAY_FLAG_VIRTUAL_TIME) {
+          waitForReaders(evt);
+        }
       }
     }
-    // wait for frame to be sent before unlock.(frameReader may be deleted after unlock)
+    // wait for frame to be sent before unlock.(the encodeIdx events may be deleted after unlock)
     camera_server_->waitFinish();
 
-    if (eit == events_->end() && !(flags_ & REPLAY_FLAG_NO_LOOP)) {
+    if (eit.end()) {
       int last_segment = segments_.rbegin()->first;
       if (current_segment_ >= last_segment && isSegmentMerged(last_segment)) {
-        qInfo() << "reaches the end of route, restart from beginning";
-        emit seekTo(0, false);
+        if (flags_ & REPLAY_FLAG_NO_LOOP) {
+          qInfo() << "reaches the end of route";
+          emit streamFinished();
+        } else {
+          qInfo() << "reaches the end of route, restart from beginning";
+          emit seekTo(0, false);
+        }
       }
     }
   }
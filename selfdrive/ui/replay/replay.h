@@ -5,8 +5,16 @@
 #include "selfdrive/ui/replay/camera.h"
 #include "selfdrive/ui/replay/route.h"
 
-// one segment uses about 100M of memory
-constexpr int FORWARD_SEGS = 5;
+const QString DEMO_ROUTE = "4cf7a6ad03080c90|2021-09-29--13-46-36";
+
+// segments are prefetched ahead of the playhead until their memory reaches the budget
+constexpr size_t DEFAULT_MEMORY_BUDGET_MB = 1024;
+// until a segment is loaded, its size is estimated from the loaded ones, or this before any is loaded
+constexpr size_t SEGMENT_SIZE_ESTIMATE = 100 * 1024 * 1024;
+// segments loaded at once, once the current segment is loaded
+constexpr int MAX_PARALLEL_SEGMENT_LOADS = 3;
+// in virtual time, readers that take longer than this on a message are warned about. replay keeps waiting for them
+constexpr int VIRTUAL_TIME_READER_TIMEOUT_MS = 100;
 
 enum REPLAY_FLAGS {
   REPLAY_FLAG_NONE = 0x0000,
@@ -17,6 +25,16 @@ enum REPLAY_FLAGS {
   REPLAY_FLAG_QCAMERA = 0x0040,
   REPLAY_FLAG_SEND_YUV = 0x0080,
   REPLAY_FLAG_NO_CUDA = 0x0100,
+  REPLAY_FLAG_VIRTUAL_TIME = 0x0200,
+};
+
+struct ReplayMemoryStats {
+  size_t used = 0;
+  size_t budget = 0;
+  int segments_loaded = 0;
+  int segments_loading = 0;
+  // the segments prefetched, [first, last]
+  int window_first = 0, window_last = 0;
 };
 
 class Replay : public QObject {
@@ -24,33 +42,41 @@ class Replay : public QObject {
 
 public:
   Replay(QString route, QStringList allow, QStringList block, SubMaster *sm = nullptr,
-          uint32_t flags = REPLAY_FLAG_NONE, QString data_dir = "", QObject *parent = 0);
+          uint32_t flags = REPLAY_FLAG_NONE, QString data_dir = "", QString ns = "", QObject *parent = 0);
   ~Replay();
   bool load();
   void start(int seconds = 0);
   void stop();
   void pause(bool pause);
   bool isPaused() const { return paused_; }
+  inline void setMemoryBudget(size_t bytes) { memory_budget_ = bytes; }
+  // thread safe
+  ReplayMemoryStats memoryStats();
 
 signals:
   void segmentChanged();
   void seekTo(int seconds, bool relative);
+  // the end of the route is reached with REPLAY_FLAG_NO_LOOP
+  void streamFinished();
 
 protected slots:
   void queueSegment();
   void doSeek(int seconds, bool relative);
-  void segmentLoadFinished(bool sucess);
+  void segmentLoadFinished(int seg_num, bool sucess);
+  void segmentLogProgress(int seg_num);
 
 protected:
   typedef std::map<int, std::unique_ptr<Segment>> SegmentMap;
-  void startStream(const Segment *cur_segment);
+  void startStream();
   void stream();
   void setCurrentSegment(int n);
   void mergeSegments(const SegmentMap::iterator &begin, const SegmentMap::iterator &end);
   void updateEvents(const std::function<bool()>& lambda);
   void publishMessage(const Event *e);
   void publishFrame(const Event *e);
+  void waitForReaders(const Event *e);
   inline int currentSeconds() const { return (cur_mono_time_ - route_start_ts_) / 1e9; }
+  const std::vector<Event *> &segmentEvents(int n);
   inline bool isSegmentMerged(int n) {
     return std::find(segments_merged_.begin(), segments_merged_.end(), n) != segments_merged_.end();
   }
@@ -69,9 +95,15 @@ protected:
   bool events_updated_ = false;
   uint64_t route_start_ts_ = 0;
   uint64_t cur_mono_time_ = 0;
-  std::unique_ptr<std::vector<Event *>> events_;
-  std::unique_ptr<std::vector<Event *>> new_events_;
   std::vector<int> segments_merged_;
+  // events parsed so far of the last merged segment, if it is still loading
+  int partial_segment_ = -1;
+  std::vector<Event *> partial_events_;
+
+  // memory
+  std::atomic<size_t> memory_budget_ = DEFAULT_MEMORY_BUDGET_MB * 1024 * 1024;
+  std::mutex stats_lock_;
+  ReplayMemoryStats stats_;
 
   // messaging
   SubMaster *sm = nullptr;
@@ -80,4 +112,6 @@ protected:
   std::unique_ptr<Route> route_;
   std::unique_ptr<CameraServer> camera_server_;
   uint32_t flags_ = REPLAY_FLAG_NONE;
+  // messages, frames and params are published in this namespace, see PubMaster
+  std::string ns_;
 };
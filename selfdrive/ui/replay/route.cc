@@ -1,5 +1,7 @@
 #include "selfdrive/ui/replay/route.h"
 
+#include <sys/resource.h>
+
 #include <QDir>
 #include <QEventLoop>
 #include <QJsonArray>
@@ -7,6 +9,7 @@
 #include <QRegExp>
 #include <QtConcurrent>
 
+#include "selfdrive/common/timing.h"
 #include "selfdrive/hardware/hw.h"
 #include "selfdrive/ui/qt/api.h"
 #include "selfdrive/ui/replay/replay.h"
@@ -87,6 +90,46 @@ void Route::addFileToSegment(int n, const QString &file) {
   }
 }
 
+std::vector<std::unique_ptr<LogReader>> Route::loadLogs(const std::vector<cereal::Event::Which> &allow, int start_sec,
+                                                        int end_sec, bool local_cache, bool qlog) {
+  std::vector<std::unique_ptr<LogReader>> logs;
+  std::vector<std::string> files;
+  for (const auto &[n, f] : segments_) {
+    const QString &file = qlog || f.rlog.isEmpty() ? f.qlog : f.rlog;
+    if (file.isEmpty() || (n + 1) * 60 <= start_sec || n * 60 >= end_sec) continue;
+
+    // the window relative to the start of the segment
+    LogFilter filter = {.allow = allow};
+    if (start_sec > n * 60) {
+      filter.start_ns = (start_sec - n * 60) * 1e9;
+    }
+    if (end_sec < (n + 1) * 60) {
+      filter.end_ns = (end_sec - n * 60) * 1e9;
+    }
+    // few events are expected, don't preallocate the pool for a whole segment
+    logs.push_back(std::make_unique<LogReader>(allow.empty() ? DEFAULT_EVENT_MEMORY_POOL_BLOCK_SIZE : 1024));
+    if (!allow.empty() || filter.start_ns > 0 || filter.end_ns < UINT64_MAX) {
+      logs.back()->setFilter(filter);
+    }
+    files.push_back(file.toStdString());
+  }
+
+  QFutureSynchronizer<void> synchronizer;
+  std::vector<char> success(logs.size());
+  for (int i = 0; i < logs.size(); ++i) {
+    synchronizer.addFuture(QtConcurrent::run([&, i]() { success[i] = logs[i]->load(files[i], nullptr, local_cache, 0, 3); }));
+  }
+  synchronizer.waitForFinished();
+
+  for (int i = logs.size() - 1; i >= 0; --i) {
+    if (!success[i]) {
+      qWarning() << "failed to load log" << files[i].c_str();
+      logs.erase(logs.begin() + i);
+    }
+  }
+  return logs;
+}
+
 // class Segment
 
 Segment::Segment(int n, const SegmentFile &files, uint32_t flags) : seg_num(n), flags(flags) {
@@ -97,8 +140,13 @@ Segment::Segment(int n, const SegmentFile &files, uint32_t flags) : seg_num(n),
       flags & REPLAY_FLAG_ECAM ? files.wide_road_cam : "",
       files.rlog.isEmpty() ? files.qlog : files.rlog,
   };
+  // the readers are used while still loading, so they must exist before the loading threads start
+  log = std::make_unique<LogReader>();
   for (int i = 0; i < std::size(file_list); i++) {
     if (!file_list[i].isEmpty()) {
+      if (i < MAX_CAMERAS) {
+        frames[i] = std::make_shared<FrameReader>();
+      }
       loading_++;
       synchronizer_.addFuture(QtConcurrent::run([=] { loadFile(i, file_list[i].toStdString()); }));
     }
@@ -112,23 +160,45 @@ Segment::~Segment() {
   synchronizer_.waitForFinished();
 }
 
+size_t Segment::memoryUsage() const {
+  size_t size = log->memoryUsage();
+  for (const auto &fr : frames) {
+    if (fr) size += fr->memoryUsage();
+  }
+  return size;
+}
+
 void Segment::loadFile(int id, const std::string file) {
   const bool local_cache = !(flags & REPLAY_FLAG_NO_FILE_CACHE);
+  const double start_ts = millis_since_boot();
   bool success = false;
   if (id < MAX_CAMERAS) {
-    frames[id] = std::make_unique<FrameReader>();
     success = frames[id]->load(file, flags & REPLAY_FLAG_NO_CUDA, &abort_, local_cache, 20 * 1024 * 1024, 3);
+    qDebug().nospace() << "segment " << seg_num << " camera " << id << ": " << frames[id]->getFrameCount()
+                       << " frames loaded in " << (millis_since_boot() - start_ts) << " ms";
   } else {
-    log = std::make_unique<LogReader>();
+    double first_events_ts = 0;
+    log->on_progress = [&]() {
+      if (first_events_ts == 0) first_events_ts = millis_since_boot();
+      emit logProgress(seg_num);
+    };
     success = log->load(file, &abort_, local_cache, 0, 3);
+    log->on_progress = nullptr;
+
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    qDebug().nospace() << "segment " << seg_num << " log: first events after " << (first_events_ts - start_ts)
+                       << " ms, loaded in " << (millis_since_boot() - start_ts) << " ms, peak RSS " << usage.ru_maxrss / 1024 << " MB";
   }
 
-  if (!success) {
+  if (success) {
+    loaded_files_ |= 1 << id;
+  } else {
     // abort all loading jobs.
     abort_ = true;
   }
 
   if (--loading_ == 0) {
-    emit loadFinished(!abort_);
+    emit loadFinished(seg_num, !abort_);
   }
 }
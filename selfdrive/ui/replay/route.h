@@ -1,6 +1,7 @@
 #pragma once
 
 #include <QFutureSynchronizer>
+#include <climits>
 
 #include "selfdrive/ui/replay/framereader.h"
 #include "selfdrive/ui/replay/logreader.h"
@@ -31,6 +32,10 @@ public:
   inline const std::map<int, SegmentFile> &segments() const { return segments_; }
   inline const SegmentFile &at(int n) { return segments_.at(n); }
   static RouteIdentifier parseRoute(const QString &str);
+  // loads the events of the allowed types between start_sec and end_sec of the route, a segment being a minute.
+  // the segments are loaded in parallel. returns a reader per segment, their events can be merged with EventMerger
+  std::vector<std::unique_ptr<LogReader>> loadLogs(const std::vector<cereal::Event::Which> &allow, int start_sec = 0,
+                                                   int end_sec = INT_MAX, bool local_cache = true, bool qlog = false);
 
 protected:
   bool loadFromLocal();
@@ -49,19 +54,26 @@ public:
   Segment(int n, const SegmentFile &files, uint32_t flags);
   ~Segment();
   inline bool isLoaded() const { return !loading_ && !abort_; }
+  inline bool isFrameLoaded(CameraType cam) const { return loaded_files_ & (1 << cam); }
+  // bytes held by the log and the video packets, safe to call while loading
+  size_t memoryUsage() const;
 
   const int seg_num = 0;
   std::unique_ptr<LogReader> log;
-  std::unique_ptr<FrameReader> frames[MAX_CAMERAS] = {};
+  // shared with the camera server, which may still be decoding ahead after the segment is freed
+  std::shared_ptr<FrameReader> frames[MAX_CAMERAS] = {};
 
 signals:
-  void loadFinished(bool success);
+  // queued to the replay thread, which may have freed the segment by then. so they carry its number, not sender()
+  void loadFinished(int seg_num, bool success);
+  void logProgress(int seg_num);
 
 protected:
   void loadFile(int id, const std::string file);
 
   std::atomic<bool> abort_ = false;
   std::atomic<int> loading_ = 0;
+  std::atomic<int> loaded_files_ = 0;
   QFutureSynchronizer<void> synchronizer_;
   uint32_t flags;
 };
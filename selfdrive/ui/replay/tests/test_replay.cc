@@ -0,0 +1,633 @@
+#include <arpa/inet.h>
+#include <bzlib.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.h"
+#include "cereal/visionipc/visionipc_client.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+#include "selfdrive/ui/replay/replay.h"
+#include "selfdrive/ui/replay/util.h"
+
+// a log of can events with a blob each, logMonoTime counts up from 1
+static std::string make_log(int events, size_t blob_size) {
+  std::string log;
+  std::string blob(blob_size, '\0');
+  for (int i = 0; i < events; ++i) {
+    for (size_t j = 0; j < blob.size(); ++j) blob[j] = "openpilot"[(i + j) % 9] + j % 13;
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.setLogMonoTime(i + 1);
+    event.initCan(1)[0].setDat(capnp::Data::Reader((const capnp::byte *)blob.data(), blob.size()));
+    auto bytes = msg.toBytes();
+    log.append((const char *)bytes.begin(), bytes.size());
+  }
+  return log;
+}
+
+static std::string compressBZ2(const std::string &in, int block_size = 9) {
+  unsigned int out_size = in.size() + in.size() / 100 + 600;
+  std::string out(out_size, '\0');
+  REQUIRE(BZ2_bzBuffToBuffCompress(out.data(), &out_size, (char *)in.data(), in.size(), block_size, 0, 30) == BZ_OK);
+  out.resize(out_size);
+  return out;
+}
+
+static void requireEvents(LogReader &lr, int events, size_t blob_size) {
+  REQUIRE(lr.events.size() == events);
+  for (int i = 0; i < events; ++i) {
+    REQUIRE(lr.events[i]->mono_time == i + 1);
+    REQUIRE(lr.events[i]->event.getCan()[0].getDat().size() == blob_size);
+  }
+}
+
+TEST_CASE("LogReader parses events while decompressing") {
+  // ~12 MB, so the log spans several chunks and messages straddle the chunk boundaries
+  const int EVENTS = 3000;
+  const size_t BLOB_SIZE = 4000;
+  const std::string log = compressBZ2(make_log(EVENTS, BLOB_SIZE));
+
+  LogReader lr;
+  std::vector<size_t> progress;
+  lr.on_progress = [&]() { progress.push_back(lr.loadedEvents().size()); };
+  REQUIRE(lr.load((const std::byte *)log.data(), log.size()));
+
+  // events were available chunk by chunk before the load returned
+  REQUIRE(progress.size() >= 3);
+  REQUIRE(progress.front() > 0);
+  REQUIRE(progress.front() < EVENTS / 2);
+  REQUIRE(std::is_sorted(progress.begin(), progress.end()));
+  REQUIRE(progress.back() == EVENTS);
+  requireEvents(lr, EVENTS, BLOB_SIZE);
+}
+
+TEST_CASE("LogReader keeps the events before a truncated tail") {
+  const int EVENTS = 3000;
+  const size_t BLOB_SIZE = 4000;
+  const std::string log = compressBZ2(make_log(EVENTS, BLOB_SIZE));
+
+  LogReader lr;
+  REQUIRE(lr.load((const std::byte *)log.data(), log.size() / 2));
+  REQUIRE(lr.events.size() > 0);
+  REQUIRE(lr.events.size() < EVENTS);
+  for (int i = 0; i < lr.events.size(); ++i) {
+    REQUIRE(lr.events[i]->mono_time == i + 1);
+  }
+}
+
+// events for sorting and merging only, with a type and a logMonoTime but no message
+static std::vector<Event *> make_events(std::deque<Event> &storage, const std::vector<std::pair<cereal::Event::Which, uint64_t>> &events) {
+  std::vector<Event *> result;
+  for (auto &[which, mono_time] : events) {
+    result.push_back(&storage.emplace_back(which, mono_time));
+  }
+  return result;
+}
+
+TEST_CASE("sortEvents is a stable sort") {
+  std::deque<Event> storage;
+  std::vector<std::pair<cereal::Event::Which, uint64_t>> events;
+  uint32_t x = 1;
+  auto rand = [&]() { return (x = x * 1103515245 + 12345) >> 16; };
+  // few distinct times and types, so many events are equal
+  const cereal::Event::Which types[] = {cereal::Event::CAN, cereal::Event::CAR_STATE, cereal::Event::CONTROLS_STATE};
+  SECTION("shuffled") {
+    for (int i = 0; i < 5000; ++i) events.push_back({types[rand() % 3], rand() % 500});
+  }
+  SECTION("nearly sorted") {
+    // in order like a log, with pre-rolled messages that are a little older
+    for (int i = 0; i < 5000; ++i) {
+      const uint64_t t = i / 4;
+      events.push_back({types[rand() % 3], rand() % 50 == 0 && t > 20 ? t - rand() % 20 : t});
+    }
+  }
+  SECTION("sorted") {
+    for (int i = 0; i < 5000; ++i) events.push_back({types[i % 3], (uint64_t)i / 3});
+  }
+
+  std::vector<Event *> sorted = make_events(storage, events);
+  std::vector<Event *> expected = sorted;
+  std::stable_sort(expected.begin(), expected.end(), Event::lessThan());
+  sortEvents(sorted);
+  REQUIRE(sorted == expected);
+}
+
+TEST_CASE("EventMerger iterates segments in time order") {
+  std::deque<Event> storage;
+  const auto CAN = cereal::Event::CAN, CAR_STATE = cereal::Event::CAR_STATE;
+  // the segments overlap and have equal events, the earlier segment goes first
+  std::vector<std::vector<Event *>> segments = {
+    make_events(storage, {{CAN, 1}, {CAN, 2}, {CAR_STATE, 2}, {CAN, 5}}),
+    make_events(storage, {{CAN, 2}, {CAR_STATE, 2}, {CAN, 3}}),
+    make_events(storage, {{CAN, 0}, {CAN, 2}, {CAN, 5}, {CAN, 6}}),
+  };
+  std::vector<Event *> expected;
+  for (auto &events : segments) expected.insert(expected.end(), events.begin(), events.end());
+  std::stable_sort(expected.begin(), expected.end(), Event::lessThan());
+  std::vector<const std::vector<Event *> *> segment_ptrs;
+  for (auto &events : segments) segment_ptrs.push_back(&events);
+
+  auto merged = [&](const Event &after) {
+    std::vector<const Event *> result;
+    for (EventMerger it(segment_ptrs, &after); !it.end(); ++it) result.push_back(*it);
+    return result;
+  };
+  SECTION("from the start") {
+    REQUIRE(merged(Event(CAN, 0)) == std::vector<const Event *>(expected.begin() + 1, expected.end()));
+  }
+  SECTION("after an event") {
+    // starts past all the events equal to `after`
+    const Event after(CAN, 2);
+    auto first = std::upper_bound(expected.begin(), expected.end(), &after, Event::lessThan());
+    REQUIRE((*first)->which == CAR_STATE);
+    REQUIRE(merged(after) == std::vector<const Event *>(first, expected.end()));
+  }
+  SECTION("after the last event") {
+    REQUIRE(merged(Event(CAN, 6)).empty());
+  }
+}
+
+TEST_CASE("LogReader indexes events by type") {
+  std::string log;
+  for (int i = 0; i < 300; ++i) {
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.setLogMonoTime(i + 1);
+    if (i % 3 == 0) {
+      event.initCan(1);
+    } else if (i % 3 == 1) {
+      event.initCarState();
+    } else {
+      event.initControlsState();
+    }
+    auto bytes = msg.toBytes();
+    log.append((const char *)bytes.begin(), bytes.size());
+  }
+  const std::string bz2 = compressBZ2(log);
+  LogReader lr;
+  REQUIRE(lr.load((const std::byte *)bz2.data(), bz2.size()));
+
+  for (auto which : {cereal::Event::CAN, cereal::Event::CAR_STATE, cereal::Event::CONTROLS_STATE, cereal::Event::GPS_LOCATION_EXTERNAL}) {
+    std::vector<Event *> expected;
+    std::copy_if(lr.events.begin(), lr.events.end(), std::back_inserter(expected), [=](auto e) { return e->which == which; });
+    const auto &events = lr.eventsOf(which);
+    REQUIRE(events == expected);
+    REQUIRE(events.size() == (which == cereal::Event::GPS_LOCATION_EXTERNAL ? 0 : 100));
+    // built once
+    REQUIRE(&lr.eventsOf(which) == &events);
+  }
+}
+
+TEST_CASE("LogReader with a filter loads what a full load keeps after filtering") {
+  // 10 s of can, carState and controlsState from the first logMonoTime. every 7th message has
+  // far pointers, so it's parsed by capnp instead of peeked
+  const uint64_t first_mono_time = 1000 * 1e9;
+  const cereal::Event::Which types[] = {cereal::Event::CAN, cereal::Event::CAR_STATE, cereal::Event::CONTROLS_STATE};
+  std::string log;
+  for (int i = 0; i < 3000; ++i) {
+    const bool multi_segment = i % 7 == 3;
+    capnp::MallocMessageBuilder msg(multi_segment ? 1 : 1024, multi_segment ? capnp::AllocationStrategy::FIXED_SIZE : capnp::SUGGESTED_ALLOCATION_STRATEGY);
+    auto event = msg.initRoot<cereal::Event>();
+    event.setLogMonoTime(first_mono_time + i * 1e9 / 300);
+    switch (types[i % 3]) {
+      case cereal::Event::CAN: event.initCan(1)[0].setAddress(i); break;
+      case cereal::Event::CAR_STATE: event.initCarState().setVEgo(i); break;
+      default: event.initControlsState().setCurvature(i); break;
+    }
+    auto words = capnp::messageToFlatArray(msg);
+    if (multi_segment) REQUIRE(msg.getSegmentsForOutput().size() > 1);
+    log.append((const char *)words.asBytes().begin(), words.asBytes().size());
+  }
+  const std::string bz2 = compressBZ2(log);
+
+  const LogFilter filter = {
+    .allow = {cereal::Event::CAR_STATE, cereal::Event::CONTROLS_STATE},
+    .start_ns = (uint64_t)2e9,
+    .end_ns = (uint64_t)5e9,
+  };
+  LogReader full, filtered(1024);
+  filtered.setFilter(filter);
+  REQUIRE(full.load((const std::byte *)bz2.data(), bz2.size()));
+  REQUIRE(filtered.load((const std::byte *)bz2.data(), bz2.size()));
+
+  std::vector<Event *> expected;
+  std::copy_if(full.events.begin(), full.events.end(), std::back_inserter(expected), [&](Event *e) {
+    const uint64_t t = e->mono_time - first_mono_time;
+    return t >= filter.start_ns && t < filter.end_ns &&
+           std::find(filter.allow.begin(), filter.allow.end(), e->which) != filter.allow.end();
+  });
+  REQUIRE(expected.size() == 600);
+  REQUIRE(filtered.events.size() == expected.size());
+  for (int i = 0; i < expected.size(); ++i) {
+    REQUIRE(filtered.events[i]->which == expected[i]->which);
+    REQUIRE(filtered.events[i]->mono_time == expected[i]->mono_time);
+    REQUIRE(filtered.events[i]->bytes() == expected[i]->bytes());
+  }
+  REQUIRE(filtered.memoryUsage() < full.memoryUsage());
+}
+
+// text that compresses about as well as a log
+static std::string make_text(size_t size) {
+  std::string text;
+  uint32_t x = 1;
+  while (text.size() < size) {
+    x = x * 1103515245 + 12345;
+    text += "event " + std::to_string(x % 1000) + (x & 0x10000 ? " carState " : " controlsState ") + std::to_string(x >> 20) + "\n";
+  }
+  text.resize(size);
+  return text;
+}
+
+TEST_CASE("BZ2StreamDecoder splits streams and blocks") {
+  const std::string text = make_text(1 << 20);
+  // 100 kB blocks
+  const std::string single_stream = compressBZ2(text, 1);
+  const std::string multi_stream = single_stream + compressBZ2(text.substr(0, 300000), 1) + compressBZ2("", 1);
+
+  BZ2StreamDecoder single((const std::byte *)single_stream.data(), single_stream.size(), 2);
+  REQUIRE(single.pieces() >= text.size() / 100000);
+  // the blocks of both streams and the empty stream
+  BZ2StreamDecoder multi((const std::byte *)multi_stream.data(), multi_stream.size(), 2);
+  REQUIRE(multi.pieces() >= single.pieces() + 300000 / 100000 + 1);
+  REQUIRE(findBZ2Streams((const std::byte *)multi_stream.data(), multi_stream.size()).size() == 3);
+
+  // a stream of a single block, and one that is cut off, are not split
+  const std::string one_block = compressBZ2(text.substr(0, 50000), 9);
+  REQUIRE(BZ2StreamDecoder((const std::byte *)one_block.data(), one_block.size()).pieces() == 1);
+  REQUIRE(BZ2StreamDecoder((const std::byte *)single_stream.data(), single_stream.size() - 100).pieces() == 1);
+
+  std::string out, piece;
+  while (multi.next(piece)) out += piece;
+  REQUIRE(multi.resumePoint().first == multi_stream.size());
+  REQUIRE(out == text + text.substr(0, 300000));
+}
+
+TEST_CASE("decompressBZ2 gives the serial output with 1-8 threads") {
+  const std::string text = make_text(3 << 20);
+  const std::string compressed = compressBZ2(text, 1);
+  std::string corrupt = compressed;
+  corrupt[corrupt.size() / 2] ^= 0x55;
+
+  const std::vector<std::pair<const char *, std::string>> corpus = {
+    {"single stream", compressed},
+    {"multi stream", compressBZ2(text.substr(0, 1 << 20), 2) + compressBZ2(text.substr(1 << 20), 1)},
+    {"single block", compressBZ2(text.substr(0, 10000), 9)},
+    {"truncated", compressed.substr(0, compressed.size() * 2 / 3)},
+    {"corrupt", corrupt},
+    {"trailing garbage", compressed + "garbage"},
+  };
+  for (auto &[name, in] : corpus) {
+    INFO(name);
+    const std::string serial = decompressBZ2(in, 1);
+    for (int threads = 2; threads <= 8; ++threads) {
+      REQUIRE(decompressBZ2(in, threads) == serial);
+    }
+  }
+  REQUIRE(decompressBZ2(corpus[0].second, 4) == text);
+  REQUIRE(decompressBZ2(corpus[1].second, 4) == text);
+}
+
+TEST_CASE("decompressBZ2 with 1-8 threads", "[.][bench]") {
+  const std::string text = make_text(64 << 20);
+  const std::string compressed = compressBZ2(text, 9);
+  for (int threads = 1; threads <= 8; ++threads) {
+    const double start_ms = millis_since_boot();
+    REQUIRE(decompressBZ2(compressed, threads).size() == text.size());
+    std::cout << threads << " threads: " << (millis_since_boot() - start_ms) << " ms" << std::endl;
+  }
+}
+
+// a local stand-in for the file server. it answers HEAD and range requests for its files,
+// one connection per request
+class TestHttpServer {
+public:
+  struct Request {
+    std::string method, path;
+    size_t begin = 0, end = 0;
+  };
+
+  TestHttpServer(const std::map<std::string, std::string> &files) : files_(files) {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    REQUIRE(bind(fd_, (sockaddr *)&addr, sizeof(addr)) == 0);
+    REQUIRE(listen(fd_, 16) == 0);
+    REQUIRE(getsockname(fd_, (sockaddr *)&addr, &len) == 0);
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread(&TestHttpServer::serve, this);
+  }
+  ~TestHttpServer() {
+    exit_ = true;
+    thread_.join();
+    for (auto &t : connections_) t.join();
+    close(fd_);
+  }
+  std::string url(const std::string &path) const { return util::string_format("http://127.0.0.1:%d/%s", port_, path.c_str()); }
+  std::vector<Request> requests() {
+    std::lock_guard lk(lock_);
+    return requests_;
+  }
+  size_t count(const std::string &method) {
+    auto r = requests();
+    return std::count_if(r.begin(), r.end(), [&](auto &req) { return req.method == method; });
+  }
+
+  // ranges starting at fail_from or later fail with a server error
+  std::atomic<size_t> fail_from = SIZE_MAX;
+  std::atomic<int> delay_ms = 0;
+
+private:
+  void serve() {
+    while (!exit_) {
+      pollfd pfd = {.fd = fd_, .events = POLLIN};
+      if (poll(&pfd, 1, 50) == 1) {
+        int conn = accept(fd_, nullptr, nullptr);
+        if (conn >= 0) connections_.emplace_back(&TestHttpServer::handle, this, conn);
+      }
+    }
+  }
+
+  void handle(int conn) {
+    std::string request;
+    char buf[1024];
+    ssize_t n = 0;
+    while (request.find("\r\n\r\n") == std::string::npos && (n = read(conn, buf, sizeof(buf))) > 0) {
+      request.append(buf, n);
+    }
+    Request req;
+    std::istringstream(request) >> req.method >> req.path;
+    req.path = req.path.substr(1);
+    auto file = files_.find(req.path);
+    const size_t size = file != files_.end() ? file->second.size() : 0;
+    req.end = size;
+    if (size_t pos = request.find("Range: bytes="); pos != std::string::npos) {
+      sscanf(request.c_str() + pos, "Range: bytes=%zu-%zu", &req.begin, &req.end);
+      req.end++;
+    }
+    {
+      std::lock_guard lk(lock_);
+      requests_.push_back(req);
+    }
+    util::sleep_for(delay_ms);
+
+    std::string response;
+    if (file == files_.end()) {
+      response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    } else if (req.method == "HEAD") {
+      response = util::string_format("HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", size);
+    } else if (req.begin >= fail_from) {
+      response = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    } else {
+      response = util::string_format("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                                     req.begin, req.end - 1, size, req.end - req.begin);
+      response += file->second.substr(req.begin, req.end - req.begin);
+    }
+    for (size_t sent = 0; sent < response.size() && (n = write(conn, response.data() + sent, response.size() - sent)) > 0;) {
+      sent += n;
+    }
+    close(conn);
+  }
+
+  const std::map<std::string, std::string> files_;
+  int fd_ = -1, port_ = 0;
+  std::atomic<bool> exit_ = false;
+  std::thread thread_;
+  std::vector<std::thread> connections_;  // only touched by thread_ until it's joined
+  std::mutex lock_;
+  std::vector<Request> requests_;
+};
+
+static std::string clean_cache_dir() {
+  const std::string dir = "/tmp/test_file_cache/";
+  system(("rm -rf " + dir).c_str());
+  REQUIRE(util::create_directories(dir, 0755));
+  return dir;
+}
+
+static const size_t FILE_SIZE = 5000;
+static const size_t RANGE_SIZE = 1000;
+
+TEST_CASE("FileCache evicts the least recently used files") {
+  const std::string dir = clean_cache_dir();
+  TestHttpServer server({{"a", make_text(FILE_SIZE)}, {"b", make_text(FILE_SIZE)}, {"c", make_text(FILE_SIZE)}, {"d", make_text(FILE_SIZE)}});
+  FileCache cache(dir, 3 * FILE_SIZE, RANGE_SIZE);
+
+  std::map<std::string, std::string> paths;
+  for (std::string name : {"a", "b", "c", "a", "d"}) {
+    paths[name] = cache.get(server.url(name), 0);
+    REQUIRE(!paths[name].empty());
+    cache.release(paths[name]);
+  }
+  // a was read again after b, so b was the least recently used
+  REQUIRE(server.count("GET") == 4 * FILE_SIZE / RANGE_SIZE);
+  REQUIRE(!util::file_exists(paths["b"]));
+  for (std::string name : {"a", "c", "d"}) {
+    REQUIRE(util::read_file(paths[name]) == make_text(FILE_SIZE));
+  }
+}
+
+TEST_CASE("FileCache keeps pinned files") {
+  const std::string dir = clean_cache_dir();
+  TestHttpServer server({{"a", make_text(FILE_SIZE)}, {"b", make_text(FILE_SIZE)}, {"c", make_text(FILE_SIZE)}});
+  FileCache cache(dir, 2 * FILE_SIZE, RANGE_SIZE);
+
+  // a stays pinned while newer files push the cache over its size
+  const std::string a = cache.get(server.url("a"), 0);
+  std::map<std::string, std::string> paths;
+  for (std::string name : {"b", "c"}) {
+    paths[name] = cache.get(server.url(name), 0);
+    REQUIRE(!paths[name].empty());
+    cache.release(paths[name]);
+  }
+  REQUIRE(util::read_file(a) == make_text(FILE_SIZE));
+  REQUIRE(!util::file_exists(paths["b"]));
+  REQUIRE(util::file_exists(paths["c"]));
+  cache.release(a);
+}
+
+TEST_CASE("FileCache resumes an interrupted download") {
+  const std::string dir = clean_cache_dir();
+  const std::string data = make_text(FILE_SIZE);
+  TestHttpServer server({{"a", data}});
+  FileCache cache(dir, 10 * FILE_SIZE, RANGE_SIZE);
+
+  // the last two ranges fail, the others are cached
+  server.fail_from = 3 * RANGE_SIZE;
+  REQUIRE(cache.get(server.url("a"), 0).empty());
+  const size_t failed_requests = server.requests().size();
+
+  server.fail_from = SIZE_MAX;
+  const std::string path = cache.get(server.url("a"), 0);
+  REQUIRE(!path.empty());
+  REQUIRE(util::read_file(path) == data);
+  // only the missing ranges were downloaded again
+  auto requests = server.requests();
+  std::set<std::pair<size_t, size_t>> ranges;
+  for (int i = failed_requests; i < requests.size(); ++i) {
+    if (requests[i].method == "GET") ranges.insert({requests[i].begin, requests[i].end});
+  }
+  REQUIRE(ranges == std::set<std::pair<size_t, size_t>>{{3 * RANGE_SIZE, 4 * RANGE_SIZE}, {4 * RANGE_SIZE, FILE_SIZE}});
+  // and the ranges were replaced by the file
+  for (size_t begin = 0; begin < FILE_SIZE; begin += RANGE_SIZE) {
+    REQUIRE(!util::file_exists(util::string_format("%s.%zu-%zu", path.c_str(), begin, begin + RANGE_SIZE)));
+  }
+  cache.release(path);
+}
+
+TEST_CASE("FileCache downloads a file once for concurrent readers") {
+  const std::string dir = clean_cache_dir();
+  TestHttpServer server({{"a", make_text(FILE_SIZE)}});
+  FileCache cache(dir, 10 * FILE_SIZE, RANGE_SIZE);
+
+  // slow enough that the readers overlap
+  server.delay_ms = 100;
+  std::string paths[2];
+  std::thread readers[2];
+  for (int i = 0; i < 2; ++i) {
+    readers[i] = std::thread([&, i]() { paths[i] = cache.get(server.url("a"), 0); });
+  }
+  for (auto &t : readers) t.join();
+  REQUIRE(!paths[0].empty());
+  REQUIRE(paths[0] == paths[1]);
+  REQUIRE(server.count("HEAD") == 1);
+  REQUIRE(server.count("GET") == FILE_SIZE / RANGE_SIZE);
+  cache.release(paths[0]);
+  cache.release(paths[1]);
+}
+
+TEST_CASE("FileCache keeps its entries across restarts") {
+  const std::string dir = clean_cache_dir();
+  TestHttpServer server({{"a", make_text(FILE_SIZE)}, {"b", make_text(FILE_SIZE)}});
+  std::map<std::string, std::string> paths;
+  {
+    FileCache cache(dir, 10 * FILE_SIZE, RANGE_SIZE);
+    for (std::string name : {"a", "b", "a"}) {
+      paths[name] = cache.get(server.url(name), 0);
+      cache.release(paths[name]);
+    }
+  }
+  const size_t requests = server.requests().size();
+
+  // the sizes and the access order are read back, b is the least recently used
+  FileCache cache(dir, FILE_SIZE, RANGE_SIZE);
+  REQUIRE(!util::file_exists(paths["b"]));
+  REQUIRE(cache.get(server.url("a"), 0) == paths["a"]);
+  REQUIRE(server.requests().size() == requests);
+  cache.release(paths["a"]);
+}
+
+// the road camera of the first segment of the demo route, in the download cache.
+// tests using it download the route, so they're tagged [.][network] and only run when asked for
+static const std::string &demoRoadCamera() {
+  static const std::string file = []() {
+    Route route(DEMO_ROUTE);
+    REQUIRE(route.load());
+    return FileReader(true).localFile(route.at(0).road_cam.toStdString());
+  }();
+  REQUIRE(!file.empty());
+  return file;
+}
+
+class TestCameraServer : public CameraServer {
+public:
+  using CameraServer::CameraServer;
+  // the frames in the decode-ahead ring, once the decoder filled it
+  std::vector<int> decodedAhead(CameraType type) {
+    Camera &cam = cameras_[type];
+    std::unique_lock lk(cam.lock);
+    cam.cv.wait(lk, [&]() { return !cam.decoding && (cam.frames.size() == FRAME_DECODE_AHEAD || cam.next_id == cam.fr->getFrameCount()); });
+    std::vector<int> ids;
+    for (auto &f : cam.frames) ids.push_back(f.id);
+    return ids;
+  }
+};
+
+TEST_CASE("CameraServer decodes frames ahead of the stream", "[.][network]") {
+  auto fr = std::make_shared<FrameReader>();
+  REQUIRE(fr->load(demoRoadCamera(), true));
+  // frames decoded directly, to compare with. FrameReader isn't thread safe, so it's another one
+  FrameReader ref;
+  REQUIRE(ref.load(demoRoadCamera(), true));
+  std::vector<uint8_t> rgb(ref.getRGBSize()), yuv(ref.getYUVSize());
+
+  std::pair<int, int> camera_size[MAX_CAMERAS] = {{fr->width, fr->height}};
+  TestCameraServer server(camera_size, true, "test_replay");
+  VisionIpcClient client("test_replay/camerad", VISION_STREAM_ROAD, false);
+  REQUIRE(client.connect(true));
+
+  // in order, back to an earlier frame, and past the decoded frames
+  std::vector<int> ids;
+  for (int i = 0; i < 20; ++i) ids.push_back(i);
+  for (int i : {5, 6, 7, 100, 101, 102, 300}) ids.push_back(i);
+
+  for (int i = 0; i < ids.size(); ++i) {
+    const int id = ids[i];
+    if (i > 0 && id == ids[i - 1] + 1) {
+      // the next frame is already decoded, with the ones after it
+      std::vector<int> ring = server.decodedAhead(RoadCam);
+      REQUIRE(ring.front() == id);
+      for (int j = 1; j < ring.size(); ++j) {
+        REQUIRE(ring[j] == ring[j - 1] + 1);
+      }
+    }
+
+    MessageBuilder msg;
+    auto eidx = msg.initEvent().initRoadEncodeIdx();
+    eidx.setFrameId(id);
+    eidx.setSegmentId(id);
+    server.pushFrame(RoadCam, fr, eidx.asReader());
+    VisionIpcBufExtra extra = {};
+    VisionBuf *buf = client.recv(&extra, 2000);
+    REQUIRE(buf != nullptr);
+    REQUIRE(extra.frame_id == id);
+
+    // the same pixels as decoding the frame directly
+    REQUIRE(ref.get(id, rgb.data(), yuv.data()));
+    REQUIRE(memcmp(buf->addr, yuv.data(), yuv.size()) == 0);
+  }
+  server.waitFinish();
+}
+
+TEST_CASE("FrameReader maps local hevc files", "[.][network]") {
+  const std::string &file = demoRoadCamera();
+  FrameReader mapped, demuxed;
+  REQUIRE(mapped.loadMapped(file, true));
+  const std::string data = util::read_file(file);
+  REQUIRE(demuxed.load((const std::byte *)data.data(), data.size(), true));
+  // a local .hevc is mapped by load()
+  FrameReader loaded;
+  REQUIRE(loaded.load(file, true));
+  REQUIRE(loaded.memoryUsage() == mapped.memoryUsage());
+
+  // the frames are split the same as by the demuxer, and decode to the same pixels, also out of order
+  REQUIRE(mapped.getFrameCount() == demuxed.getFrameCount());
+  REQUIRE(mapped.width == demuxed.width);
+  REQUIRE(mapped.height == demuxed.height);
+  std::vector<uint8_t> rgb1(mapped.getRGBSize()), yuv1(mapped.getYUVSize());
+  std::vector<uint8_t> rgb2(demuxed.getRGBSize()), yuv2(demuxed.getYUVSize());
+  const int last = mapped.getFrameCount() - 1;
+  for (int id : {0, 1, 2, last, 100, 20, 21, last / 2}) {
+    INFO("frame " << id);
+    REQUIRE(mapped.get(id, rgb1.data(), yuv1.data()));
+    REQUIRE(demuxed.get(id, rgb2.data(), yuv2.data()));
+    REQUIRE(yuv1 == yuv2);
+    REQUIRE(rgb1 == rgb2);
+  }
+}
@@ -4,13 +4,18 @@
 #include <curl/curl.h>
 #include <openssl/sha.h>
 
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <cassert>
 #include <cmath>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <mutex>
 #include <numeric>
+#include <thread>
+#include <tuple>
 
 #include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
@@ -97,31 +102,29 @@ void enableHttpLogging(bool enable) {
 }
 
 template <class T>
-bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort) {
+bool httpDownload(const std::string &url, T &buf, const std::vector<std::pair<size_t, size_t>> &ranges,
+                  std::atomic<bool> *abort, const std::function<void(size_t, size_t)> &on_range = nullptr) {
   static CURLGlobalInitializer curl_initializer;
 
-  int parts = 1;
-  if (chunk_size > 0 && content_length > 10 * 1024 * 1024) {
-    parts = std::nearbyint(content_length / (float)chunk_size);
-    parts = std::clamp(parts, 1, 5);
-  }
-
   CURLM *cm = curl_multi_init();
   size_t written = 0;
+  size_t content_length = 0;
   std::map<CURL *, MultiPartWriter<T>> writers;
-  const int part_size = content_length / parts;
-  for (int i = 0; i < parts; ++i) {
+  std::map<CURL *, std::pair<size_t, size_t>> parts;
+  for (auto [begin, end] : ranges) {
     CURL *eh = curl_easy_init();
     writers[eh] = {
         .buf = &buf,
         .total_written = &written,
-        .offset = (size_t)(i * part_size),
-        .end = i == parts - 1 ? content_length : (i + 1) * part_size,
+        .offset = begin,
+        .end = end,
     };
+    parts[eh] = {begin, end};
+    content_length += end - begin;
     curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, write_cb<T>);
     curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void *)(&writers[eh]));
     curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%d-%d", writers[eh].offset, writers[eh].end - 1).c_str());
+    curl_easy_setopt(eh, CURLOPT_RANGE, util::string_format("%zu-%zu", writers[eh].offset, writers[eh].end - 1).c_str());
     curl_easy_setopt(eh, CURLOPT_HTTPGET, 1);
     curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1);
@@ -151,13 +154,15 @@ bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t cont
   CURLMsg *msg;
   int msgs_left = -1;
   int complete = 0;
-  while ((msg = curl_multi_info_read(cm, &msgs_left)) && !(abort && *abort)) {
+  // ranges that completed before an abort are still reported
+  while ((msg = curl_multi_info_read(cm, &msgs_left))) {
     if (msg->msg == CURLMSG_DONE) {
       if (msg->data.result == CURLE_OK) {
         long res_status = 0;
         curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &res_status);
         if (res_status == 206) {
           complete++;
+          if (on_range) on_range(parts[msg->easy_handle].first, parts[msg->easy_handle].second);
         } else {
           std::cout << "Download failed: http error code: " << res_status << std::endl;
         }
@@ -173,7 +178,23 @@ bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t cont
   }
   curl_multi_cleanup(cm);
 
-  return complete == parts;
+  return complete == ranges.size();
+}
+
+template <class T>
+bool httpDownload(const std::string &url, T &buf, size_t chunk_size, size_t content_length, std::atomic<bool> *abort) {
+  int parts = 1;
+  if (chunk_size > 0 && content_length > 10 * 1024 * 1024) {
+    parts = std::nearbyint(content_length / (float)chunk_size);
+    parts = std::clamp(parts, 1, 5);
+  }
+
+  std::vector<std::pair<size_t, size_t>> ranges;
+  const size_t part_size = content_length / parts;
+  for (int i = 0; i < parts; ++i) {
+    ranges.push_back({i * part_size, i == parts - 1 ? content_length : (i + 1) * part_size});
+  }
+  return httpDownload(url, buf, ranges, abort);
 }
 
 std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool> *abort) {
@@ -184,6 +205,11 @@ std::string httpGet(const std::string &url, size_t chunk_size, std::atomic<bool>
   return httpDownload(url, result, chunk_size, size, abort) ? result : "";
 }
 
+bool httpGetRanges(const std::string &url, std::string &buf, const std::vector<std::pair<size_t, size_t>> &ranges,
+                   const std::function<void(size_t, size_t)> &on_range, std::atomic<bool> *abort) {
+  return httpDownload(url, buf, ranges, abort, on_range);
+}
+
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size, std::atomic<bool> *abort) {
   size_t size = getRemoteFileSize(url);
   if (size == 0) return false;
@@ -193,44 +219,342 @@ bool httpDownload(const std::string &url, const std::string &file, size_t chunk_
   return httpDownload(url, of, chunk_size, size, abort);
 }
 
-std::string decompressBZ2(const std::string &in) {
-  return decompressBZ2((std::byte *)in.data(), in.size());
+std::string decompressBZ2(const std::string &in, int threads) {
+  return decompressBZ2((std::byte *)in.data(), in.size(), threads);
 }
 
-std::string decompressBZ2(const std::byte *in, size_t in_size) {
-  if (in_size == 0) return {};
-
+// decompresses the bz2 streams in `in` and appends them to out.
+// returns BZ_STREAM_END if all of `in` was decompressed, BZ_UNEXPECTED_EOF if it is truncated.
+static int decompressStreams(const std::byte *in, size_t in_size, std::string &out) {
   bz_stream strm = {};
   int bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
   assert(bzerror == BZ_OK);
 
   strm.next_in = (char *)in;
   strm.avail_in = in_size;
-  std::string out(in_size * 5, '\0');
+  size_t out_pos = out.size();
+  out.resize(out_pos + in_size * 5);
   do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
-    strm.avail_out = out.size() - strm.total_out_lo32;
+    strm.next_out = (char *)(&out[out_pos]);
+    strm.avail_out = out.size() - out_pos;
 
     const char *prev_write_pos = strm.next_out;
     bzerror = BZ2_bzDecompress(&strm);
+    out_pos = strm.next_out - out.data();
     if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
       // content is corrupt
-      bzerror = BZ_STREAM_END;
-      std::cout << "decompressBZ2 error : content is corrupt" << std::endl;
+      bzerror = BZ_UNEXPECTED_EOF;
       break;
     }
 
-    if (bzerror == BZ_OK && strm.avail_in > 0 && strm.avail_out == 0) {
+    // logs are written as a sequence of bz2 streams, continue with the next one
+    if (bzerror == BZ_STREAM_END && strm.avail_in > 0) {
+      char *next_in = strm.next_in;
+      unsigned int avail_in = strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+      strm = {};
+      bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+      assert(bzerror == BZ_OK);
+      strm.next_in = next_in;
+      strm.avail_in = avail_in;
+    }
+
+    if (bzerror == BZ_OK && strm.avail_in > 0 && out_pos == out.size()) {
       out.resize(out.size() * 2);
     }
   } while (bzerror == BZ_OK);
 
   BZ2_bzDecompressEnd(&strm);
-  if (bzerror == BZ_STREAM_END) {
-    out.resize(strm.total_out_lo32);
-    return out;
+  out.resize(out_pos);
+  return bzerror;
+}
+
+std::string decompressBZ2(const std::byte *in, size_t in_size, int threads) {
+  if (in_size == 0) return {};
+
+  std::string out;
+  size_t offset = 0, skip = 0;
+  if (threads > 1) {
+    BZ2StreamDecoder decoder(in, in_size, threads);
+    std::string piece;
+    while (decoder.next(piece)) {
+      out += piece;
+    }
+    std::tie(offset, skip) = decoder.resumePoint();
+  }
+
+  // the serial path picks up where the parallel one stopped,
+  // so corrupt input gives the same result as a serial decompression
+  if (offset < in_size) {
+    const size_t out_pos = out.size();
+    int bzerror = decompressStreams(in + offset, in_size - offset, out);
+    out.erase(out_pos, std::min(skip, out.size() - out_pos));
+    if (bzerror == BZ_UNEXPECTED_EOF) {
+      std::cout << "decompressBZ2 error : content is corrupt" << std::endl;
+    } else if (bzerror != BZ_STREAM_END) {
+      return {};
+    }
+  }
+  return out;
+}
+
+std::vector<size_t> findBZ2Streams(const std::byte *in, size_t in_size) {
+  // a stream header ("BZh" and the block size) is followed by the magic of the first block,
+  // or the end of stream magic for an empty stream
+  static const char block_magic[] = "\x31\x41\x59\x26\x53\x59";
+  static const char eos_magic[] = "\x17\x72\x45\x38\x50\x90";
+  const size_t header_size = 4 + 6;
+
+  std::vector<size_t> streams = {0};
+  const char *data = (const char *)in;
+  for (size_t i = 1; i + header_size <= in_size; ++i) {
+    if (data[i] == 'B' && data[i + 1] == 'Z' && data[i + 2] == 'h' && data[i + 3] >= '1' && data[i + 3] <= '9' &&
+        (memcmp(data + i + 4, block_magic, 6) == 0 || memcmp(data + i + 4, eos_magic, 6) == 0)) {
+      streams.push_back(i);
+    }
+  }
+  return streams;
+}
+
+namespace {
+
+const uint64_t BZ2_BLOCK_MAGIC = 0x314159265359;
+const uint64_t BZ2_EOS_MAGIC = 0x177245385090;
+const int BZ2_MAGIC_BITS = 48;
+
+// n <= 56 bits at bit offset pos, msb first like bzip2 writes them. bits past the end are 0
+uint64_t readBits(const uint8_t *in, size_t in_size, size_t pos, int n) {
+  uint64_t w = 0;
+  for (size_t i = pos / 8; i < pos / 8 + 8; ++i) {
+    w = (w << 8) | (i < in_size ? in[i] : 0);
+  }
+  return (w << (pos % 8)) >> (64 - n);
+}
+
+// bit offsets of the block magics in the bits [begin, end)
+std::vector<size_t> findBZ2Blocks(const uint8_t *in, size_t in_size, size_t begin, size_t end) {
+  // the magic is on bit offsets 0-7 of a 64 bit window starting at a byte. whatever the offset, the second byte
+  // of the window is all magic, so only the windows with one of those 8 values in their second byte are checked
+  static const auto second_bytes = []() {
+    std::array<bool, 256> values = {};
+    for (int s = 0; s < 8; ++s) {
+      values[((BZ2_BLOCK_MAGIC << 16) >> s >> 48) & 0xff] = true;
+    }
+    return values;
+  }();
+
+  std::vector<size_t> blocks;
+  for (size_t i = begin / 8; i * 8 + BZ2_MAGIC_BITS <= end && i + 1 < in_size; ++i) {
+    if (!second_bytes[in[i + 1]]) continue;
+
+    for (size_t pos = std::max(i * 8, begin); pos < i * 8 + 8 && pos + BZ2_MAGIC_BITS <= end; ++pos) {
+      if (readBits(in, in_size, pos, BZ2_MAGIC_BITS) == BZ2_BLOCK_MAGIC) blocks.push_back(pos);
+    }
+  }
+  return blocks;
+}
+
+// a block of a stream as a stream of its own: the stream header, the block, and the end of stream magic
+// followed by the stream crc, which for a single block is the block crc
+std::string wrapBZ2Block(const uint8_t *in, size_t in_size, size_t begin, size_t end, char level, uint32_t crc) {
+  std::string out = {'B', 'Z', 'h', level};
+  out.reserve(4 + (end - begin + BZ2_MAGIC_BITS + 32) / 8 + 1);
+
+  uint64_t bits = 0;
+  int bit_count = 0;
+  auto put = [&](uint64_t value, int n) {
+    bits = (bits << n) | value;
+    bit_count += n;
+    while (bit_count >= 8) {
+      bit_count -= 8;
+      out.push_back((char)(bits >> bit_count));
+    }
+  };
+  for (size_t pos = begin; pos < end; pos += 32) {
+    const int n = std::min<size_t>(32, end - pos);
+    put(readBits(in, in_size, pos, n), n);
+  }
+  put(BZ2_EOS_MAGIC >> 24, 24);
+  put(BZ2_EOS_MAGIC & 0xffffff, 24);
+  put(crc, 32);
+  if (bit_count > 0) {
+    out.push_back((char)(bits << (8 - bit_count)));
+  }
+  return out;
+}
+
+// one thread per core, shared by the decoders of all the logs being loaded so they don't oversubscribe the cpu.
+// the tasks never wait on each other, they only decompress.
+class DecodePool {
+public:
+  static DecodePool &instance() {
+    static DecodePool pool;
+    return pool;
+  }
+  inline int size() const { return threads_.size(); }
+  void run(std::function<void()> task) {
+    {
+      std::lock_guard lk(lock_);
+      tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+  }
+
+private:
+  DecodePool() {
+    const int n = std::max(1U, std::thread::hardware_concurrency());
+    for (int i = 0; i < n; ++i) {
+      threads_.emplace_back(&DecodePool::workerThread, this);
+    }
+  }
+  ~DecodePool() {
+    {
+      std::lock_guard lk(lock_);
+      exit_ = true;
+    }
+    cv_.notify_all();
+    for (auto &t : threads_) t.join();
+  }
+  void workerThread() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock lk(lock_);
+        cv_.wait(lk, [&]() { return exit_ || !tasks_.empty(); });
+        if (tasks_.empty()) return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  bool exit_ = false;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex lock_;
+  std::condition_variable cv_;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace
+
+// class BZ2StreamDecoder
+
+BZ2StreamDecoder::BZ2StreamDecoder(const std::byte *in, size_t in_size, int threads, std::atomic<bool> *abort)
+    : in_(in), in_size_(in_size), abort_(abort) {
+  if (in_size == 0) return;
+
+  const uint8_t *data = (const uint8_t *)in;
+  const std::vector<size_t> offsets = findBZ2Streams(in, in_size);
+  for (int i = 0; i < offsets.size(); ++i) {
+    const size_t begin = offsets[i], end = i + 1 < offsets.size() ? offsets[i + 1] : in_size;
+    const Piece stream = {.stream_begin = begin, .begin = begin * 8, .end = end * 8, .block = false};
+
+    // the stream ends with the end of stream magic, the crc of the stream and up to 7 bits of padding
+    size_t eos = 0;
+    for (int padding = 0; padding < 8 && !eos && end * 8 >= begin * 8 + 32 + BZ2_MAGIC_BITS + 32 + padding; ++padding) {
+      const size_t pos = end * 8 - padding - 32 - BZ2_MAGIC_BITS;
+      if (readBits(data, in_size, pos, BZ2_MAGIC_BITS) == BZ2_EOS_MAGIC) eos = pos;
+    }
+    const std::vector<size_t> blocks = eos ? findBZ2Blocks(data, in_size, begin * 8 + 32, eos) : std::vector<size_t>{};
+    if (blocks.size() < 2 || blocks[0] != begin * 8 + 32) {
+      // truncated, corrupt, or a single block
+      pieces_.push_back(stream);
+      continue;
+    }
+
+    // a false block magic inside the compressed data would break the stream crc, which is the block crcs combined
+    std::vector<Piece> stream_blocks;
+    uint32_t stream_crc = 0;
+    for (int j = 0; j < blocks.size(); ++j) {
+      const uint32_t crc = readBits(data, in_size, blocks[j] + BZ2_MAGIC_BITS, 32);
+      stream_crc = ((stream_crc << 1) | (stream_crc >> 31)) ^ crc;
+      stream_blocks.push_back({.stream_begin = begin, .begin = blocks[j], .end = j + 1 < blocks.size() ? blocks[j + 1] : eos,
+                               .block = true, .level = (char)data[begin + 3], .crc = crc});
+    }
+    if (stream_crc == readBits(data, in_size, eos + BZ2_MAGIC_BITS, 32)) {
+      pieces_.insert(pieces_.end(), stream_blocks.begin(), stream_blocks.end());
+    } else {
+      pieces_.push_back(stream);
+    }
+  }
+
+  if (pieces_.size() > 1) {
+    max_running_ = threads > 0 ? threads : DecodePool::instance().size();
+    // bound the decompressed data waiting to be read
+    max_ahead_ = max_running_ * 2;
+    std::lock_guard lk(lock_);
+    queuePieces();
+  }
+}
+
+BZ2StreamDecoder::~BZ2StreamDecoder() {
+  // the pieces already queued skip the work, the running ones are waited for
+  std::unique_lock lk(lock_);
+  exit_ = true;
+  cv_.wait(lk, [&]() { return running_ == 0; });
+}
+
+// with lock_ held
+void BZ2StreamDecoder::queuePieces() {
+  while (!exit_ && queued_ < pieces_.size() && queued_ < next_ + max_ahead_ && running_ < max_running_) {
+    ++running_;
+    DecodePool::instance().run([this, n = queued_++]() { decodePiece(n); });
   }
-  return {};
+}
+
+void BZ2StreamDecoder::decodePiece(size_t n) {
+  bool skip = false;
+  {
+    std::lock_guard lk(lock_);
+    skip = exit_ || (abort_ && *abort_);
+  }
+
+  // a block whose end was found at a false magic fails its crc here, and is left to the caller
+  const Piece &piece = pieces_[n];
+  std::string out;
+  bool success = false;
+  if (!skip && piece.block) {
+    std::string stream = wrapBZ2Block((const uint8_t *)in_, in_size_, piece.begin, piece.end, piece.level, piece.crc);
+    success = decompressStreams((const std::byte *)stream.data(), stream.size(), out) == BZ_STREAM_END;
+  } else if (!skip) {
+    success = decompressStreams(in_ + piece.begin / 8, (piece.end - piece.begin) / 8, out) == BZ_STREAM_END;
+  }
+
+  {
+    std::lock_guard lk(lock_);
+    pieces_[n].out = std::move(out);
+    pieces_[n].state = success ? Piece::DONE : Piece::FAILED;
+    --running_;
+    queuePieces();
+    // under the lock, the destructor may free the decoder as soon as it's released
+    cv_.notify_all();
+  }
+}
+
+bool BZ2StreamDecoder::next(std::string &out) {
+  std::unique_lock lk(lock_);
+  if (next_ >= pieces_.size()) return false;
+
+  Piece &piece = pieces_[next_];
+  if (piece.state == Piece::PENDING && next_ >= queued_) {
+    // not queued if the decoder was built for a single piece
+    return false;
+  }
+  cv_.wait(lk, [&]() { return piece.state != Piece::PENDING; });
+  if (piece.state == Piece::FAILED) return false;
+
+  out = std::move(piece.out);
+  piece.out = {};
+  ++next_;
+  stream_out_ = next_ < pieces_.size() && pieces_[next_].stream_begin == piece.stream_begin ? stream_out_ + out.size() : 0;
+  queuePieces();
+  return true;
+}
+
+std::pair<size_t, size_t> BZ2StreamDecoder::resumePoint() {
+  std::lock_guard lk(lock_);
+  return next_ < pieces_.size() ? std::pair{pieces_[next_].stream_begin, stream_out_} : std::pair{in_size_, (size_t)0};
 }
 
 void precise_nano_sleep(long sleep_ns) {
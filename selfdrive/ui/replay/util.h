@@ -1,14 +1,67 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <vector>
 
 std::string sha256(const std::string &str);
 void precise_nano_sleep(long sleep_ns);
-std::string decompressBZ2(const std::string &in);
-std::string decompressBZ2(const std::byte *in, size_t in_size);
+std::string decompressBZ2(const std::string &in, int threads = 1);
+std::string decompressBZ2(const std::byte *in, size_t in_size, int threads = 1);
+// offsets of the streams in a file of concatenated bz2 streams
+std::vector<size_t> findBZ2Streams(const std::byte *in, size_t in_size);
 void enableHttpLogging(bool enable);
 std::string getUrlWithoutQuery(const std::string &url);
 size_t getRemoteFileSize(const std::string &url);
 std::string httpGet(const std::string &url, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
+// downloads the byte ranges [begin, end) of url into the same offsets of buf, which must be large enough.
+// on_range is called for each range that completed, also if the download failed or was aborted.
+bool httpGetRanges(const std::string &url, std::string &buf, const std::vector<std::pair<size_t, size_t>> &ranges,
+                   const std::function<void(size_t, size_t)> &on_range, std::atomic<bool> *abort = nullptr);
 bool httpDownload(const std::string &url, const std::string &file, size_t chunk_size = 0, std::atomic<bool> *abort = nullptr);
+
+// Decompresses a bz2 file in parallel and returns the output in order. The file is split into pieces
+// that decompress on their own: the streams of a multi-stream file, like the logs written by loggerd,
+// and the blocks of each stream, which are rewrapped into a stream of their own.
+// The pieces run on a pool of one thread per core shared by all the decoders.
+class BZ2StreamDecoder {
+public:
+  // at most `threads` pieces of this file are decompressed at once, all the pool threads if threads <= 0
+  BZ2StreamDecoder(const std::byte *in, size_t in_size, int threads = 0, std::atomic<bool> *abort = nullptr);
+  ~BZ2StreamDecoder();
+  // a file that can't be split is better decompressed serially, which hands out the output as it goes
+  inline size_t pieces() const { return pieces_.size(); }
+  // waits for the next piece. returns false after the last piece, or at a piece that failed to decompress
+  bool next(std::string &out);
+  // where a serial decompression continues once next() returned false: the input offset of the stream of the
+  // first piece not returned, and the bytes of that stream's output that were already returned
+  std::pair<size_t, size_t> resumePoint();
+
+private:
+  void queuePieces();
+  void decodePiece(size_t n);
+
+  struct Piece {
+    size_t stream_begin;  // in bytes
+    size_t begin, end;    // in bits. a whole stream, or one of its blocks
+    bool block;
+    char level;
+    uint32_t crc;
+    std::string out;
+    enum { PENDING, DONE, FAILED } state = PENDING;
+  };
+
+  const std::byte *in_;
+  const size_t in_size_;
+  std::atomic<bool> *abort_;
+  std::vector<Piece> pieces_;
+  size_t next_ = 0, queued_ = 0, running_ = 0, max_running_ = 0, max_ahead_ = 0;
+  // output of the stream of next_ returned so far
+  size_t stream_out_ = 0;
+  bool exit_ = false;
+  std::mutex lock_;
+  std::condition_variable cv_;
+};